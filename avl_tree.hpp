@@ -1,25 +1,75 @@
 #ifndef AVL_TREE_HPP
 #define AVL_TREE_HPP
 
+#include <algorithm>
 #include <utility>
 #include <stdexcept>
-
-
-template <typename T, typename V>
+#include <functional>
+#include <future>
+#include <thread>
+#include <iterator>
+#include <istream>
+#include <ostream>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "node_pool.hpp"
+#include "avl_tree_format.hpp"
+#include "frozen_avl_tree.hpp"
+#include "avl_tree_view.hpp"
+#include "avl_tree_stats.hpp"
+
+
+// Keys are ordered by Compare. A transparent comparator (one declaring
+// is_transparent, like std::less<>) lets lookups take any key type it
+// accepts without converting it to T.
+template <typename T, typename V, typename Compare = std::less<T>, typename Allocator = std::allocator<std::pair<const T, V>>>
 class AVL_Tree {
 public:
     using traversal_type = void (*)(void*&, void*&, void*&);
+    using key_type = T;
+    using mapped_type = V;
+    using key_compare = Compare;
+    using allocator_type = Allocator;
+
+    template <bool Const>
+    class Iterator;
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
 public:
     AVL_Tree() :
             _root(nullptr),
+            _leftmost(nullptr),
+            _rightmost(nullptr),
             _size(0)
     {}
 
-    AVL_Tree(const AVL_Tree<T,V> &Tree);
-    AVL_Tree& operator=(const AVL_Tree<T,V> &Tree);
+    explicit AVL_Tree(const Compare &comp, const Allocator &alloc = Allocator()) :
+            _root(nullptr),
+            _leftmost(nullptr),
+            _rightmost(nullptr),
+            _size(0),
+            _comp(comp),
+            _pool(alloc)
+    {}
+
+    explicit AVL_Tree(const Allocator &alloc) :
+            _root(nullptr),
+            _leftmost(nullptr),
+            _rightmost(nullptr),
+            _size(0),
+            _pool(alloc)
+    {}
+
+    AVL_Tree(const AVL_Tree &Tree);
+    AVL_Tree& operator=(const AVL_Tree &Tree);
 
-    AVL_Tree(AVL_Tree<T,V>&& Tree) noexcept;
-    AVL_Tree& operator=(AVL_Tree<T,V>&& Tree) noexcept;
+    AVL_Tree(AVL_Tree&& Tree) noexcept;
+    AVL_Tree& operator=(AVL_Tree&& Tree) noexcept;
 
     template<typename ...Args,
             typename = typename std::enable_if<
@@ -30,27 +80,122 @@ public:
 
     ~AVL_Tree();
 
+    // Builds a perfectly balanced tree in O(n) from a range of key/value
+    // pairs given in strictly increasing key order.
+    template <typename It>
+    static AVL_Tree from_sorted(It first, It last, const Compare &comp = Compare(), const Allocator &alloc = Allocator());
+
+    template <typename It>
+    void assign_sorted(It first, It last);
+
+    // Binary image of the entries as sorted key and value arrays (see
+    // avl_tree_format.hpp); T and V must be trivially copyable. load()
+    // rebuilds in O(n) with the sorted build and throws on a malformed
+    // image, leaving the tree empty.
+    void save(std::ostream &out) const;
+
+    void load(std::istream &in);
+
+    // Immutable copy of the entries laid out for lookups; for trees that are
+    // built once and then only queried.
+    FrozenAVL_Tree<T, V, Compare> freeze() const {return FrozenAVL_Tree<T, V, Compare>::from_sorted(begin(), end(), _comp);}
+
 
     template<typename TT, typename VV>
     void insert(TT&& key, VV&& val);
 
+    // Single-descent insertion: V is constructed from args only when key is
+    // absent. The iterator points at the entry for key, the flag tells
+    // whether it was inserted.
+    template<typename TT, typename ...Args>
+    std::pair<iterator, bool> try_emplace(TT&& key, Args&& ...args);
+
+    template<typename TT, typename ...Args>
+    std::pair<iterator, bool> emplace(TT&& key, Args&& ...args) {return try_emplace(std::forward<TT>(key), std::forward<Args>(args)...);}
+
+    template<typename TT, typename VV>
+    std::pair<iterator, bool> insert_or_assign(TT&& key, VV&& val);
+
+    template<typename TT>
+    void erase(TT&& key) {_assert_empty(); _erase(_get(key));}
+
+    // Removes the entry of key and returns it, in a single descent.
     template<typename TT>
-    void erase(TT&& key) {_assert_empty(); _root = _remove(_root, std::forward<TT>(key)); --_size;}
+    std::pair<T,V> extract(TT&& key);
 
     void clear();
 
     template<typename TT>
-    V& get(TT&& key) {return _get(_root, std::forward<TT>(key))->val;}
+    V& get(TT&& key) {return _get(key)->val;}
+
+    template<typename TT>
+    const V& get(TT&& key) const {return _get(key)->val;}
+
+    template<typename TT>
+    bool find(TT&& key) const {return _find(key) != nullptr;}
+
+    // Batched lookups over a forward range of keys: one result per key is
+    // written to out, a found flag for find_many() and a pointer to the value
+    // (nullptr when absent) for get_many(). Lookups advance in lock-step in
+    // groups of lookup_batch, prefetching the next node of each, so their
+    // cache misses overlap; an ascending batch that is dense in the tree
+    // instead resumes every search from the path of the previous one.
+    static constexpr size_t lookup_batch = 16;
+
+    template<typename It, typename Out>
+    Out find_many(It first, It last, Out out) const;
+
+    template<typename It, typename Out>
+    Out get_many(It first, It last, Out out);
+
+    template<typename It, typename Out>
+    Out get_many(It first, It last, Out out) const;
+
+    std::pair<const T&,V&> find_min() const {_assert_empty(); return {_leftmost->key, _leftmost->val};}
+
+    std::pair<const T&,V&> find_max() const {_assert_empty(); return {_rightmost->key, _rightmost->val};}
+
+    // Removes the smallest (greatest) entry and returns it.
+    std::pair<T,V> pop_min();
+
+    std::pair<T,V> pop_max();
+
+    template<typename TT>
+    iterator lower_bound(const TT &key) {return {_lower_bound(key), this};}
+
+    template<typename TT>
+    const_iterator lower_bound(const TT &key) const {return {_lower_bound(key), this};}
+
+    template<typename TT>
+    iterator upper_bound(const TT &key) {return {_upper_bound(key), this};}
+
+    template<typename TT>
+    const_iterator upper_bound(const TT &key) const {return {_upper_bound(key), this};}
+
+    template<typename TT>
+    std::pair<iterator, iterator> equal_range(const TT &key) {return {lower_bound(key), upper_bound(key)};}
 
     template<typename TT>
-    const V& get(TT&& key) const {return _get(_root, std::forward<TT>(key))->val;}
+    std::pair<const_iterator, const_iterator> equal_range(const TT &key) const {return {lower_bound(key), upper_bound(key)};}
+
+    // k-th smallest entry (0-based), end() if k >= size().
+    iterator select(size_t k) {return {_select(k), this};}
+    const_iterator select(size_t k) const {return {_select(k), this};}
 
+    // Number of keys less than key.
     template<typename TT>
-    bool find(TT&& key) const {return _find(_root, std::forward<TT>(key)) != nullptr;}
+    size_t rank(const TT &key) const;
 
-    std::pair<const T&,V&> find_min() const {_assert_empty(); Node* min_node = _find_min(_root); return {min_node->key, min_node->val};}
+    // Number of keys in [lo, hi).
+    template<typename TT1, typename TT2>
+    size_t count_range(const TT1 &lo, const TT2 &hi) const;
 
-    std::pair<const T&,V&> find_max() const {_assert_empty(); Node* max_node = _find_max(_root); return {max_node->key, max_node->val};}
+    // Calls func(key, val) for every key in [lo, hi) in ascending order.
+    template <typename TT1, typename TT2, typename Func>
+    void for_each_in_range(const TT1 &lo, const TT2 &hi, Func func);
+
+    template <typename TT1, typename TT2, typename Func>
+    void for_each_in_range(const TT1 &lo, const TT2 &hi, Func func) const;
 
     template<typename TT>
     V& operator[] (TT&& key);
@@ -64,12 +209,81 @@ public:
     template <typename Func>
     void const_traversal(traversal_type t, Func func) const {_const_traversal(_root, nullptr, t, func);}
 
+    // Lazy where/map/reduce pipeline over the entries, run in a single
+    // traversal without intermediate trees (see avl_tree_view.hpp).
+    AVL_TreeView<AVL_Tree, V> view() const {return AVL_TreeView<AVL_Tree, V>(*this);}
+
+    // Fork/join over subtrees: while a subtree is larger than grain, its
+    // left half runs on another thread. func must be safe to call
+    // concurrently on distinct entries.
+    static constexpr size_t parallel_grain = 1 << 14;
+
+    // Calls func(key, val) for every entry, in no particular order.
+    template <typename Func>
+    void parallel_for_each(Func func, size_t grain = parallel_grain);
+
+    template <typename Func>
+    void parallel_for_each(Func func, size_t grain = parallel_grain) const;
+
+    // Every piece starts from identity and is folded in key order with
+    // func(acc, key, val); neighbouring pieces are joined left to right with
+    // combine(left, right), which must be associative.
+    template <typename R, typename Func, typename Combine>
+    R parallel_fold(const R &identity, Func func, Combine combine, size_t grain = parallel_grain) const;
+
+
+    template<typename TT>
+    AVL_Tree subtree(TT&& key) const;
+
+    // Join-based bulk operations. Each takes O(m log(n/m + 1)) comparisons
+    // for trees of sizes m <= n instead of m separate descents; the set
+    // operations fork their recursion while both sides exceed grain.
+
+    // Appends every entry of other, whose keys must all be greater than
+    // ours, and leaves other empty. Allocators must compare equal.
+    void join(AVL_Tree &other);
 
+    // Moves the entries with keys not less than key into the returned tree.
+    // O(log n) plus a rebuild of the smaller half, so no memory stays shared.
     template<typename TT>
-    AVL_Tree<T,V> subtree(TT&& key) const;
+    AVL_Tree split(const TT &key);
+
+    // Union: moves in every entry of other, keeping our value where both
+    // trees have the key, and leaves other empty.
+    void merge(AVL_Tree &other, size_t grain = parallel_grain);
+
+    // Keeps only the keys that other also has.
+    void intersect(const AVL_Tree &other, size_t grain = parallel_grain);
+
+    // Erases every key that other has.
+    void difference(const AVL_Tree &other, size_t grain = parallel_grain);
+
+    iterator begin() noexcept {return {_leftmost, this};}
+    iterator end() noexcept {return {nullptr, this};}
+    const_iterator begin() const noexcept {return cbegin();}
+    const_iterator end() const noexcept {return cend();}
+    const_iterator cbegin() const noexcept {return {_leftmost, this};}
+    const_iterator cend() const noexcept {return {nullptr, this};}
+
+    reverse_iterator rbegin() noexcept {return reverse_iterator(end());}
+    reverse_iterator rend() noexcept {return reverse_iterator(begin());}
+    const_reverse_iterator rbegin() const noexcept {return crbegin();}
+    const_reverse_iterator rend() const noexcept {return crend();}
+    const_reverse_iterator crbegin() const noexcept {return const_reverse_iterator(cend());}
+    const_reverse_iterator crend() const noexcept {return const_reverse_iterator(cbegin());}
 
     size_t size() const noexcept {return _size;}
-    int height() const noexcept {return _root->height;}
+    int height() const noexcept {return _height(_root);}
+
+    key_compare key_comp() const {return _comp;}
+
+    // Operation counters since construction or reset_stats(); all zero
+    // unless built with AVL_TREE_STATS (see avl_tree_stats.hpp). Not
+    // thread-safe, even for concurrent const lookups.
+    AVL_TreeStats stats() const;
+
+    void reset_stats() noexcept;
+    allocator_type get_allocator() const {return allocator_type(_pool.get_allocator());}
 
 private:
     struct Node {
@@ -79,18 +293,134 @@ private:
                 key(std::forward<TT>(k)),
                 val(std::forward<VV>(v)),
                 height(1),
+                count(1),
+                left(nullptr),
+                right(nullptr),
+                parent(nullptr)
+        {}
+
+        template<typename TT, typename ...Args>
+        Node(std::piecewise_construct_t, TT&& k, Args&& ...args):
+                key(std::forward<TT>(k)),
+                val(std::forward<Args>(args)...),
+                height(1),
+                count(1),
                 left(nullptr),
-                right(nullptr)
+                right(nullptr),
+                parent(nullptr)
         {}
-        explicit Node(const Node *node);
-        ~Node();
 
         T key;
         V val;
         unsigned int height;
-        Node *left, *right;
+        size_t count;
+        Node *left, *right, *parent;
+    };
+
+public:
+    // Bidirectional in-order iterator. Nodes keep key and value apart, so it
+    // yields the same {key, value} reference pair as find_min()/find_max().
+    template <bool Const>
+    class Iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::pair<const T, V>;
+        using difference_type = std::ptrdiff_t;
+        using reference = std::pair<const T&, typename std::conditional<Const, const V&, V&>::type>;
+
+        struct pointer {
+            reference ref;
+            reference *operator->() {return &ref;}
+        };
+
+        Iterator() noexcept : _node(nullptr), _tree(nullptr) {}
+        operator Iterator<true>() const noexcept {return {_node, _tree};}
+
+        reference operator*() const {return {_node->key, _node->val};}
+        pointer operator->() const {return {**this};}
+
+        Iterator& operator++() {_node = _next(_node); return *this;}
+        Iterator operator++(int) {Iterator ret = *this; ++*this; return ret;}
+        Iterator& operator--() {_node = _node ? _prev(_node) : _tree->_rightmost; return *this;}
+        Iterator operator--(int) {Iterator ret = *this; --*this; return ret;}
+
+        friend bool operator==(const Iterator &a, const Iterator &b) noexcept {return a._node == b._node;}
+        friend bool operator!=(const Iterator &a, const Iterator &b) noexcept {return a._node != b._node;}
+
+    private:
+        friend class AVL_Tree;
+
+        Iterator(Node *node, const AVL_Tree *tree) noexcept : _node(node), _tree(tree) {}
+
+        Node *_node;
+        const AVL_Tree *_tree;
     };
 
+private:
+
+
+    using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+
+    template<typename C, typename = void>
+    struct _is_transparent : std::false_type {};
+    template<typename C>
+    struct _is_transparent<C, std::void_t<typename C::is_transparent>> : std::true_type {};
+
+    // Lookup keys are compared as they are with a transparent comparator and
+    // converted to T once otherwise.
+    template<typename TT>
+    using _lookup_type = typename std::conditional<_is_transparent<Compare>::value, TT, T>::type;
+
+    Node *_copy(const Node *p);
+
+    void _destroy(Node *p);
+
+    void _destroy_all();
+
+    template <typename Src>
+    Node *_build(size_t n, Src &src);
+
+    // Reads n raw objects for load(), throwing std::runtime_error on a
+    // short stream.
+    template <typename U>
+    static void _read_array(std::istream &in, std::vector<U> &out, size_t n);
+
+    Node *_relocate(Node *p, AVL_Tree &from);
+
+    template <typename Func>
+    void _keep_if(Func &f);
+    template <typename Func>
+    void _filter(Node *p, Func &f, Node **&tail, size_t &n);
+
+    // where() on an rvalue tree keeps the passing nodes instead of copying them
+    template <typename TT, typename VV, typename C, typename A, typename Func>
+    friend AVL_Tree<TT,VV,C,A> where(AVL_Tree<TT,VV,C,A> &&tree, Func f);
+
+    Node *_link(Node *l, Node *k, Node *r);
+    Node *_join(Node *l, Node *k, Node *r);
+    Node *_join_right(Node *l, Node *k, Node *r);
+    Node *_join_left(Node *l, Node *k, Node *r);
+    Node *_join2(Node *l, Node *r);
+    Node *_split_last(Node *p, Node *&last);
+
+    template<typename TT>
+    void _split(Node *p, const TT &key, Node *&l, Node *&mid, Node *&r);
+
+    template <typename Left, typename Right>
+    static void _fork(bool parallel, Left left, Right right);
+
+    Node *_union(Node *a, Node *b, std::vector<Node*> &dropped, size_t grain, int depth);
+    Node *_intersect(Node *a, const Node *b, std::vector<Node*> &dropped, size_t grain, int depth);
+    Node *_difference(Node *a, const Node *b, std::vector<Node*> &dropped, size_t grain, int depth);
+    void _adopt(Node *root, std::vector<Node*> &dropped);
+
+    static Node *_next(const Node *p);
+
+    static Node *_prev(const Node *p);
+
+    void _set_root(Node *p) {_root = p; if(p) p->parent = nullptr;}
+
+    void _reset_extremes() {_leftmost = _root ? _find_min(_root) : nullptr; _rightmost = _root ? _find_max(_root) : nullptr;}
 
     int _height(Node *p) const;
 
@@ -104,23 +434,45 @@ private:
 
     Node *_balance(Node *p);
 
+    void _rebalance_up(Node *p);
+
     template<typename TT>
-    Node *_find(Node *p, TT&& key) const;
+    Node *_find_slot(const TT &key, Node *&parent, bool &left) const;
 
-    Node *_find_min(Node *p) const;
+    Node *_attach(Node *n, Node *parent, bool left);
 
-    Node *_find_max(Node *p) const;
+    template<typename TT>
+    Node *_find(const TT &key) const;
 
-    Node *_remove_min(Node *p);
+    static void _prefetch(const Node *p);
+
+    template<typename It, typename Emit>
+    void _lookup_many(It first, It last, Emit emit) const;
+
+    template<typename K>
+    void _find_group(const K *const *keys, size_t m, Node **found) const;
+
+    template<typename K>
+    Node *_find_from(const K &key, std::vector<std::pair<Node*, const Node*>> &path) const;
 
     template<typename TT>
-    Node *_remove(Node *p, TT&& k);
+    Node *_lower_bound(const TT &key) const;
 
-    template<typename TT, typename VV>
-    Node *_insert(Node *p, TT&& k, VV&& val);
+    template<typename TT>
+    Node *_upper_bound(const TT &key) const;
+
+    Node *_select(size_t k) const;
+
+    Node *_find_min(Node *p) const;
+
+    Node *_find_max(Node *p) const;
+
+    void _replace(Node *p, Node *n);
+
+    void _erase(Node *p);
 
     template<typename TT>
-    Node *_get(Node *p, TT&& k) const;
+    Node *_get(const TT &key) const;
 
     template <typename Func>
     void _traversal(Node *p, Node *parent, traversal_type t, Func func);
@@ -128,7 +480,18 @@ private:
     template <typename Func>
     void _const_traversal(Node *p, Node *parent, traversal_type t, Func func) const;
 
-    size_t _calc_size(Node *p) const;
+    size_t _count(const Node *p) const {return p ? p->count : 0;}
+
+    static int _parallel_depth();
+
+    template <typename Func>
+    static void _parallel_for_each(Node *p, Func &func, size_t grain, int depth);
+
+    template <typename R, typename Func>
+    static R _fold(const Node *p, R acc, Func &func);
+
+    template <typename R, typename Func, typename Combine>
+    static R _parallel_fold(const Node *p, const R &identity, Func &func, Combine &combine, size_t grain, int depth);
 
     void _assert_empty() const;
 public:
@@ -145,415 +508,1641 @@ private:
     void _list_initializer(){}
 
     Node *_root;
+    // extreme nodes, kept up to date so find_min()/find_max() and begin() are O(1)
+    Node *_leftmost, *_rightmost;
     size_t _size;
+    AVL_TreeCompare<Compare> _comp;
+    NodePool<Node, node_allocator> _pool;
+#ifdef AVL_TREE_STATS
+    // rotations, balances and max_depth; the rest is kept by _comp and _pool
+    mutable AVL_TreeStats _stats;
+#endif
 };
 
 
-template <typename T, typename V>
-AVL_Tree<T, V>::AVL_Tree(const AVL_Tree<T,V> &Tree):
-        _root(Tree._root ? new Node(Tree._root) : nullptr),
-        _size(Tree._size)
-{}
+template <typename T, typename V, typename Compare, typename Allocator>
+AVL_Tree<T,V,Compare,Allocator>::AVL_Tree(const AVL_Tree &Tree):
+        _root(nullptr),
+        _leftmost(nullptr),
+        _rightmost(nullptr),
+        _size(Tree._size),
+        _comp(Tree._comp),
+        _pool(std::allocator_traits<node_allocator>::select_on_container_copy_construction(Tree._pool.get_allocator()))
+{
+    _root = _copy(Tree._root);
+    _reset_extremes();
+}
 
-template <typename T, typename V>
-AVL_Tree<T,V>& AVL_Tree<T,V>::operator=(const AVL_Tree<T, V> &Tree)
+template <typename T, typename V, typename Compare, typename Allocator>
+AVL_Tree<T,V,Compare,Allocator>& AVL_Tree<T,V,Compare,Allocator>::operator=(const AVL_Tree &Tree)
 {
-    delete _root;
-    _root = new Node(Tree._root);
+    if(this != &Tree) {
+        clear();
+        _comp = Tree._comp;
+        _root = _copy(Tree._root);
+        _size = Tree._size;
+        _reset_extremes();
+    }
     return *this;
 }
 
-template <typename T, typename V>
-AVL_Tree<T, V>::AVL_Tree(AVL_Tree<T,V>&& Tree) noexcept:
+template <typename T, typename V, typename Compare, typename Allocator>
+AVL_Tree<T,V,Compare,Allocator>::AVL_Tree(AVL_Tree&& Tree) noexcept:
         _root(Tree._root),
-        _size(Tree._size)
+        _leftmost(Tree._leftmost),
+        _rightmost(Tree._rightmost),
+        _size(Tree._size),
+        _comp(std::move(Tree._comp)),
+        _pool(std::move(Tree._pool))
 {
-    Tree._root = nullptr;
+    Tree._root = Tree._leftmost = Tree._rightmost = nullptr;
     Tree._size = 0;
+    AVL_TREE_STAT(std::swap(_stats, Tree._stats);)
 }
 
-template <typename T, typename V>
-AVL_Tree<T,V>& AVL_Tree<T,V>::operator=(AVL_Tree<T, V> &&Tree) noexcept
+template <typename T, typename V, typename Compare, typename Allocator>
+AVL_Tree<T,V,Compare,Allocator>& AVL_Tree<T,V,Compare,Allocator>::operator=(AVL_Tree &&Tree) noexcept
 {
-    delete _root;
-    _root = Tree._root;
-    _size = Tree._size;
-    Tree._root = nullptr;
-    Tree._size = 0;
+    if(this != &Tree) {
+        clear();
+        _pool.swap(Tree._pool);
+        std::swap(_comp, Tree._comp);
+        std::swap(_root, Tree._root);
+        std::swap(_leftmost, Tree._leftmost);
+        std::swap(_rightmost, Tree._rightmost);
+        std::swap(_size, Tree._size);
+        AVL_TREE_STAT(std::swap(_stats, Tree._stats);)
+    }
     return *this;
 }
 
 
-template <typename T, typename V>
+template <typename T, typename V, typename Compare, typename Allocator>
 template <typename ...Args, typename>
-AVL_Tree<T, V>::AVL_Tree(Args&& ...args):
+AVL_Tree<T,V,Compare,Allocator>::AVL_Tree(Args&& ...args):
         AVL_Tree()
 {
     _list_initializer(std::forward<Args>(args)...);
 }
 
-template <typename T, typename V>
-AVL_Tree<T,V>::~AVL_Tree()
+template <typename T, typename V, typename Compare, typename Allocator>
+AVL_Tree<T,V,Compare,Allocator>::~AVL_Tree()
 {
-    delete _root;
+    _destroy_all();
 }
 
 
-template <typename T, typename V>
-template<typename TT, typename VV>
-void AVL_Tree<T,V>::insert(TT&& key, VV&& val)
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename It>
+AVL_Tree<T,V,Compare,Allocator> AVL_Tree<T,V,Compare,Allocator>::from_sorted(It first, It last, const Compare &comp, const Allocator &alloc)
 {
-    if(_root == nullptr){
-        _root = new Node(std::forward<TT>(key), std::forward<VV>(val));
-    }
-    else{
-        _root = _insert(_root, std::forward<TT>(key), std::forward<VV>(val));
-    }
-
-    ++_size;
+    AVL_Tree ret(comp, alloc);
+    ret.assign_sorted(first, last);
+    return ret;
 }
 
-template <typename T, typename V>
-void AVL_Tree<T,V>::clear()
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename It>
+void AVL_Tree<T,V,Compare,Allocator>::assign_sorted(It first, It last)
 {
-    delete _root;
-    _root = nullptr;
+    using category = typename std::iterator_traits<It>::iterator_category;
+    if constexpr (!std::is_base_of<std::forward_iterator_tag, category>::value) {
+        std::vector<typename std::iterator_traits<It>::value_type> buf(first, last);
+        assign_sorted(std::make_move_iterator(buf.begin()), std::make_move_iterator(buf.end()));
+    }
+    else {
+        clear();
+        size_t n = std::distance(first, last);
+        _pool.reserve(n);
+
+        Node *prev = nullptr;
+        auto src = [this, &first, &prev](){
+            auto &&kv = *first;
+            if(prev != nullptr && !_comp(prev->key, std::get<0>(kv)))
+                throw std::runtime_error("AVL_Tree sorted input is not strictly increasing");
+            prev = _pool.create(std::get<0>(std::forward<decltype(kv)>(kv)),
+                                std::get<1>(std::forward<decltype(kv)>(kv)));
+            ++first;
+            return prev;
+        };
+
+        _set_root(_build(n, src));
+        _size = n;
+        _reset_extremes();
+    }
 }
 
-template <typename T, typename V>
-template<typename TT>
-V& AVL_Tree<T,V>::operator[](TT&& key)
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::save(std::ostream &out) const
 {
-    if(!find(key)){
-        insert(std::forward<TT>(key), V());
-    }
+    static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_copyable<V>::value,
+                  "AVL_Tree::save needs trivially copyable keys and values");
 
-    return get(std::forward<TT>(key));
-}
+    AVL_FileHeader header = AVL_FileHeader::make<T, V>(_size);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
 
-template <typename T, typename V>
-template<typename TT>
-AVL_Tree<T,V> AVL_Tree<T,V>::subtree(TT&& key) const
-{
-    const Node *p = _find(_root, std::forward<TT>(key));
-    AVL_Tree<T,V> ret;
-    ret._root = new Node(p);
-    ret._size = ret._calc_size(ret._root);
+    // alignment padding can be longer than the buffer for over-aligned types
+    auto pad = [&out](uint64_t n){
+        const char zeros[64] = {};
+        for(; n > 0; n -= std::min<uint64_t>(n, sizeof(zeros)))
+            out.write(zeros, std::min<uint64_t>(n, sizeof(zeros)));
+    };
 
-    return ret;
+    pad(header.keys_offset - sizeof(header));
+    for(const Node *p = _leftmost; p != nullptr; p = _next(p))
+        out.write(reinterpret_cast<const char*>(&p->key), sizeof(T));
+
+    pad(header.values_offset - header.keys_offset - _size * sizeof(T));
+    for(const Node *p = _leftmost; p != nullptr; p = _next(p))
+        out.write(reinterpret_cast<const char*>(&p->val), sizeof(V));
+
+    if(!out)
+        throw std::runtime_error("AVL_Tree write failed");
 }
 
-template <typename T, typename V>
-template <typename Func>
-void AVL_Tree<T,V>::_traversal(Node *p, Node *parent, traversal_type t, Func func)
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::load(std::istream &in)
 {
-    if(p == nullptr)
-        return;
-
-    if(p == parent) {
-        func(p->key, p->val);
+    static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_copyable<V>::value,
+                  "AVL_Tree::load needs trivially copyable keys and values");
+
+    clear();
+
+    AVL_FileHeader header;
+    if(!in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        throw std::runtime_error("AVL_Tree read failed");
+    header.validate<T, V>();
+
+    // A corrupt count must not turn into one huge allocation: a seekable
+    // stream is checked against its length up front, any other is read in
+    // chunks that only grow with the data actually there.
+    std::streampos pos = in.tellg();
+    if(pos != std::streampos(-1) && in.seekg(0, std::ios::end)) {
+        std::streamoff remaining = in.tellg() - pos;
+        in.seekg(pos);
+        if(remaining < 0 || uint64_t(remaining) < header.file_size - sizeof(header))
+            throw std::runtime_error("AVL_Tree read failed");
     }
-    else {
-        void *n1 = p->left, *n2 = p, *n3 = p->right;
-        t(n1, n2, n3);
+    in.clear();
+
+    size_t n = header.count;
+    std::vector<T> keys;
+    std::vector<V> vals;
+    in.ignore(header.keys_offset - sizeof(header));
+    _read_array(in, keys, n);
+    in.ignore(header.values_offset - header.keys_offset - n * sizeof(T));
+    _read_array(in, vals, n);
+
+    _pool.reserve(n);
+    size_t i = 0;
+    Node *prev = nullptr;
+    auto src = [this, &keys, &vals, &i, &prev](){
+        if(prev != nullptr && !_comp(prev->key, keys[i]))
+            throw std::runtime_error("AVL_Tree sorted input is not strictly increasing");
+        prev = _pool.create(keys[i], vals[i]);
+        ++i;
+        return prev;
+    };
 
-        _traversal((Node*)n1, p, t, func);
-        _traversal((Node*)n2, p, t, func);
-        _traversal((Node*)n3, p, t, func);
+    try {
+        _set_root(_build(n, src));
     }
+    catch (...) {
+        clear();
+        throw;
+    }
+    _size = n;
+    _reset_extremes();
 }
 
-template <typename T, typename V>
-template <typename Func>
-void AVL_Tree<T,V>::_const_traversal(Node *p, Node *parent, traversal_type t, Func func) const
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename U>
+void AVL_Tree<T,V,Compare,Allocator>::_read_array(std::istream &in, std::vector<U> &out, size_t n)
 {
-    if(p == nullptr)
-        return;
-
-    if(p == parent) {
-        func(p->key, p->val);
-    }
-    else {
-        void *n1 = p->left, *n2 = p, *n3 = p->right;
-        t(n1, n2, n3);
-
-        _const_traversal((Node*)n1, p, t, func);
-        _const_traversal((Node*)n2, p, t, func);
-        _const_traversal((Node*)n3, p, t, func);
+    const size_t chunk = (size_t(1) << 20) / sizeof(U) + 1;
+    out.clear();
+    while(out.size() < n) {
+        size_t old = out.size(), m = std::min(chunk, n - old);
+        out.resize(old + m);
+        if(!in.read(reinterpret_cast<char*>(out.data() + old), m * sizeof(U)))
+            throw std::runtime_error("AVL_Tree read failed");
     }
 }
 
-template <typename T, typename V>
-template <typename FV, typename ...Args>
-void AVL_Tree<T, V>::_list_initializer(FV&& p, Args&& ...args)
+template <typename T, typename V, typename Compare, typename Allocator>
+AVL_TreeStats AVL_Tree<T,V,Compare,Allocator>::stats() const
 {
-    insert(std::forward<typename FV::first_type>(p.first),
-           std::forward<typename FV::second_type>(p.second));
-
-    _list_initializer(std::forward<Args>(args)...);
+    AVL_TreeStats ret;
+#ifdef AVL_TREE_STATS
+    ret = _stats;
+    ret.comparisons = _comp.count();
+    ret.allocations = _pool.created();
+    ret.deallocations = _pool.destroyed();
+    ret.bytes_in_use = _pool.in_use() * sizeof(Node);
+#endif
+    return ret;
 }
 
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::reset_stats() noexcept
+{
+    AVL_TREE_STAT(_stats = AVL_TreeStats(); _comp.reset(); _pool.reset_counts();)
+}
 
-template <typename T, typename V>
-AVL_Tree<T,V>::Node::Node(const AVL_Tree<T, V>::Node *node):
-        key(node->key),
-        val(node->val),
-        height(node->height)
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT, typename VV>
+void AVL_Tree<T,V,Compare,Allocator>::insert(TT&& key, VV&& val)
 {
-    if(node->left != nullptr)
-        left = new Node(node->left);
-    else
-        left = nullptr;
+    Node *parent;
+    bool left;
+    if(_find_slot(key, parent, left) != nullptr)
+        throw std::runtime_error("AVL_Tree trying to insert by existing key");
 
-    if(node->right != nullptr)
-        right = new Node(node->right);
-    else
-        right = nullptr;
+    _attach(_pool.create(std::forward<TT>(key), std::forward<VV>(val)), parent, left);
 }
 
-template <typename T, typename V>
-AVL_Tree<T,V>::Node::~Node()
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::clear()
 {
-    delete left;
-    delete right;
+    _destroy_all();
 }
 
-template <typename T, typename V>
-int AVL_Tree<T,V>::_height(Node *p) const{
-    return p ? p->height : 0;
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT, typename ...Args>
+std::pair<typename AVL_Tree<T,V,Compare,Allocator>::iterator, bool> AVL_Tree<T,V,Compare,Allocator>::try_emplace(TT&& key, Args&& ...args)
+{
+    Node *parent;
+    bool left;
+    Node *p = _find_slot(key, parent, left);
+    if(p != nullptr)
+        return {{p, this}, false};
+
+    p = _pool.create(std::piecewise_construct, std::forward<TT>(key), std::forward<Args>(args)...);
+    return {{_attach(p, parent, left), this}, true};
 }
 
-template <typename T, typename V>
-void AVL_Tree<T,V>::_fixheight(Node *p){
-    p->height = std::max(_height(p->left), _height(p->right)) + 1;
-}
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT, typename VV>
+std::pair<typename AVL_Tree<T,V,Compare,Allocator>::iterator, bool> AVL_Tree<T,V,Compare,Allocator>::insert_or_assign(TT&& key, VV&& val)
+{
+    Node *parent;
+    bool left;
+    Node *p = _find_slot(key, parent, left);
+    if(p != nullptr) {
+        p->val = std::forward<VV>(val);
+        return {{p, this}, false};
+    }
 
-template <typename T, typename V>
-int AVL_Tree<T,V>::_factor(Node *p) const {
-    return _height(p->right) - _height(p->left);
+    p = _pool.create(std::forward<TT>(key), std::forward<VV>(val));
+    return {{_attach(p, parent, left), this}, true};
 }
 
-template <typename T, typename V>
-typename AVL_Tree<T,V>::Node *AVL_Tree<T,V>::_rotate_right(Node *p)
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+V& AVL_Tree<T,V,Compare,Allocator>::operator[](TT&& key)
 {
-    Node *q = p->left;
-    p->left = q->right;
-    q->right = p;
+    return try_emplace(std::forward<TT>(key)).first._node->val;
+}
 
-    _fixheight(p);
-    _fixheight(q);
+// The extreme node has at most one child, so detaching it is a single
+// unlink plus one walk up to the root.
+template <typename T, typename V, typename Compare, typename Allocator>
+std::pair<T,V> AVL_Tree<T,V,Compare,Allocator>::pop_min()
+{
+    _assert_empty();
+    Node *p = _leftmost;
+    std::pair<T,V> ret(std::move(p->key), std::move(p->val));
+    _erase(p);
+    return ret;
+}
 
-    return q;
+template <typename T, typename V, typename Compare, typename Allocator>
+std::pair<T,V> AVL_Tree<T,V,Compare,Allocator>::pop_max()
+{
+    _assert_empty();
+    Node *p = _rightmost;
+    std::pair<T,V> ret(std::move(p->key), std::move(p->val));
+    _erase(p);
+    return ret;
 }
 
-template <typename T, typename V>
-typename AVL_Tree<T,V>::Node *AVL_Tree<T,V>::_rotate_left(Node *q)
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+std::pair<T,V> AVL_Tree<T,V,Compare,Allocator>::extract(TT&& key)
 {
-    Node *p = q->right;
-    q->right = p->left;
-    p->left = q;
+    _assert_empty();
+    Node *p = _get(key);
+    std::pair<T,V> ret(std::move(p->key), std::move(p->val));
+    _erase(p);
+    return ret;
+}
 
-    _fixheight(q);
-    _fixheight(p);
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+AVL_Tree<T,V,Compare,Allocator> AVL_Tree<T,V,Compare,Allocator>::subtree(TT&& key) const
+{
+    const Node *p = _find(key);
+    AVL_Tree ret(_comp, get_allocator());
+    ret._root = ret._copy(p);
+    ret._size = _count(p);
+    ret._reset_extremes();
 
-    return p;
+    return ret;
 }
 
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::join(AVL_Tree &other)
+{
+    if(this == &other || other._root == nullptr)
+        return;
+    if(_root != nullptr && !_comp(_rightmost->key, other._leftmost->key))
+        throw std::runtime_error("AVL_Tree joined trees overlap");
+
+    _pool.splice(other._pool);
+    Node *leftmost = _root ? _leftmost : other._leftmost;
+    _set_root(_join2(_root, other._root));
+    _size += other._size;
+    _leftmost = leftmost;
+    _rightmost = other._rightmost;
+
+    other._root = other._leftmost = other._rightmost = nullptr;
+    other._size = 0;
+}
 
-template <typename T, typename V>
-typename AVL_Tree<T,V>::Node *AVL_Tree<T,V>::_balance(Node *p)
+// The split itself is O(log n), but the two halves must end up in different
+// pools, so the smaller one is rebuilt in the other pool.
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+AVL_Tree<T,V,Compare,Allocator> AVL_Tree<T,V,Compare,Allocator>::split(const TT &key)
 {
-    _fixheight(p);
+    AVL_Tree ret(_comp, get_allocator());
 
-    if(_factor(p) == 2)
-    {
-        if(_factor(p->right) < 0)
-            p->right = _rotate_right(p->right);
+    Node *l, *mid, *r;
+    _split(_root, static_cast<const _lookup_type<TT>&>(key), l, mid, r);
+    if(mid != nullptr)
+        r = _join(nullptr, mid, r);
+    _root = nullptr;
 
-        p = _rotate_left(p);
+    if(_count(r) <= _count(l)) {
+        ret._pool.reserve(_count(r));
+        ret._set_root(ret._relocate(r, *this));
+        _set_root(l);
     }
-    else if(_factor(p) == -2)
-    {
-        if(_factor(p->left) > 0)
-            p->left = _rotate_left(p->left);
-
-        p = _rotate_right(p);
+    else {
+        _pool.swap(ret._pool);
+        _pool.reserve(_count(l));
+        _set_root(_relocate(l, ret));
+        ret._set_root(r);
     }
 
-    return p;
+    _size = _count(_root);
+    _reset_extremes();
+    ret._size = _count(ret._root);
+    ret._reset_extremes();
+    return ret;
 }
 
-template <typename T, typename V>
-template<typename TT>
-typename AVL_Tree<T,V>::Node *AVL_Tree<T,V>::_find(Node *p, TT&& key) const
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::merge(AVL_Tree &other, size_t grain)
 {
-    if(p == nullptr)
-        return nullptr;
-    if(key == p->key)
-        return p;
-    if(key < p->key)
-        return _find(p->left, std::forward<TT>(key));
-    if(key > p->key)
-        return _find(p->right, std::forward<TT>(key));
+    if(this == &other)
+        return;
+
+    _pool.splice(other._pool);
+    std::vector<Node*> dropped;
+    Node *root = _union(_root, other._root, dropped, grain, _parallel_depth());
+
+    other._root = other._leftmost = other._rightmost = nullptr;
+    other._size = 0;
+    _adopt(root, dropped);
 }
 
-template<typename T, typename V>
-typename AVL_Tree<T,V>::Node *AVL_Tree<T,V>::_find_min(Node *p) const
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::intersect(const AVL_Tree &other, size_t grain)
 {
-    return p->left ? _find_min(p->left) : p;
+    if(this == &other)
+        return;
+
+    std::vector<Node*> dropped;
+    _adopt(_intersect(_root, other._root, dropped, grain, _parallel_depth()), dropped);
 }
 
-template<typename T, typename V>
-typename AVL_Tree<T,V>::Node *AVL_Tree<T,V>::_find_max(Node *p) const
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::difference(const AVL_Tree &other, size_t grain)
 {
-    return p->right ? _find_max(p->right) : p;
+    if(this == &other) {
+        clear();
+        return;
+    }
+
+    std::vector<Node*> dropped;
+    _adopt(_difference(_root, other._root, dropped, grain, _parallel_depth()), dropped);
 }
 
-template<typename T, typename V>
-typename AVL_Tree<T,V>::Node *AVL_Tree<T,V>::_remove_min(Node *p)
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT1, typename TT2, typename Func>
+void AVL_Tree<T,V,Compare,Allocator>::for_each_in_range(const TT1 &lo, const TT2 &hi, Func func)
 {
-    if(p->left == nullptr)
-        return p->right;
-    p->left = _remove_min(p->left);
-    return _balance(p);
+    const _lookup_type<TT2> &h = hi;
+    for(Node *p = _lower_bound(lo); p != nullptr && _comp(p->key, h); p = _next(p))
+        func(p->key, p->val);
 }
 
-template<typename T, typename V>
-template<typename TT>
-typename AVL_Tree<T,V>::Node *AVL_Tree<T,V>::_remove(Node *p, TT&& k)
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT1, typename TT2, typename Func>
+void AVL_Tree<T,V,Compare,Allocator>::for_each_in_range(const TT1 &lo, const TT2 &hi, Func func) const
+{
+    const _lookup_type<TT2> &h = hi;
+    for(const Node *p = _lower_bound(lo); p != nullptr && _comp(p->key, h); p = _next(p))
+        func(p->key, p->val);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void AVL_Tree<T,V,Compare,Allocator>::parallel_for_each(Func func, size_t grain)
+{
+    _parallel_for_each(_root, func, grain, _parallel_depth());
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void AVL_Tree<T,V,Compare,Allocator>::parallel_for_each(Func func, size_t grain) const
+{
+    auto const_func = [&func](const T &key, const V &val){func(key, val);};
+    _parallel_for_each(_root, const_func, grain, _parallel_depth());
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename R, typename Func, typename Combine>
+R AVL_Tree<T,V,Compare,Allocator>::parallel_fold(const R &identity, Func func, Combine combine, size_t grain) const
+{
+    return _parallel_fold(_root, identity, func, combine, grain, _parallel_depth());
+}
+
+// Enough levels of forking for about two tasks per hardware thread.
+template <typename T, typename V, typename Compare, typename Allocator>
+int AVL_Tree<T,V,Compare,Allocator>::_parallel_depth()
+{
+    int depth = 1;
+    for(unsigned threads = std::thread::hardware_concurrency(); threads > 1; threads >>= 1)
+        ++depth;
+    return depth;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void AVL_Tree<T,V,Compare,Allocator>::_parallel_for_each(Node *p, Func &func, size_t grain, int depth)
+{
+    while(p != nullptr) {
+        if(depth > 0 && p->count > grain) {
+            auto left = std::async(std::launch::async, [p, &func, grain, depth](){
+                _parallel_for_each(p->left, func, grain, depth - 1);
+            });
+            func(static_cast<const T&>(p->key), p->val);
+            _parallel_for_each(p->right, func, grain, depth - 1);
+            left.get();
+            return;
+        }
+
+        _parallel_for_each(p->left, func, grain, 0);
+        func(static_cast<const T&>(p->key), p->val);
+        p = p->right;
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename R, typename Func>
+R AVL_Tree<T,V,Compare,Allocator>::_fold(const Node *p, R acc, Func &func)
+{
+    while(p != nullptr) {
+        acc = _fold(p->left, std::move(acc), func);
+        acc = func(std::move(acc), p->key, p->val);
+        p = p->right;
+    }
+    return acc;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename R, typename Func, typename Combine>
+R AVL_Tree<T,V,Compare,Allocator>::_parallel_fold(const Node *p, const R &identity, Func &func, Combine &combine, size_t grain, int depth)
+{
+    if(p == nullptr || depth == 0 || p->count <= grain)
+        return _fold(p, identity, func);
+
+    auto left = std::async(std::launch::async, [p, &identity, &func, &combine, grain, depth](){
+        return _parallel_fold(p->left, identity, func, combine, grain, depth - 1);
+    });
+    R right = func(R(identity), p->key, p->val);
+    right = combine(std::move(right), _parallel_fold(p->right, identity, func, combine, grain, depth - 1));
+
+    return combine(left.get(), std::move(right));
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void AVL_Tree<T,V,Compare,Allocator>::_traversal(Node *p, Node *parent, traversal_type t, Func func)
 {
     if(p == nullptr)
-        throw std::out_of_range("AVL_Tree out of range!");
-    if(k < p->key)
-        p->left = _remove(p->left, std::forward<TT>(k));
-    else if(k > p->key)
-        p->right = _remove(p->right, std::forward<TT>(k));
-    else
-    {
-        Node *q = p->left;
-        Node *r = p->right;
+        return;
 
-        p->left = nullptr;
-        p->right = nullptr;
-        delete p;
+    if(p == parent) {
+        func(p->key, p->val);
+    }
+    else {
+        void *n1 = p->left, *n2 = p, *n3 = p->right;
+        t(n1, n2, n3);
+
+        _traversal((Node*)n1, p, t, func);
+        _traversal((Node*)n2, p, t, func);
+        _traversal((Node*)n3, p, t, func);
+    }
+}
 
-        if(r == nullptr)
-            return q;
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void AVL_Tree<T,V,Compare,Allocator>::_const_traversal(Node *p, Node *parent, traversal_type t, Func func) const
+{
+    if(p == nullptr)
+        return;
 
-        Node *m = _find_min(r);
-        m->right = _remove_min(r);
-        m->left = q;
-        return _balance(m);
+    if(p == parent) {
+        func(p->key, p->val);
     }
-    return _balance(p);
+    else {
+        void *n1 = p->left, *n2 = p, *n3 = p->right;
+        t(n1, n2, n3);
+
+        _const_traversal((Node*)n1, p, t, func);
+        _const_traversal((Node*)n2, p, t, func);
+        _const_traversal((Node*)n3, p, t, func);
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename FV, typename ...Args>
+void AVL_Tree<T,V,Compare,Allocator>::_list_initializer(FV&& p, Args&& ...args)
+{
+    insert(std::forward<typename FV::first_type>(p.first),
+           std::forward<typename FV::second_type>(p.second));
+
+    _list_initializer(std::forward<Args>(args)...);
 }
 
 
-template <typename T, typename V>
-template <typename TT, typename VV>
-typename AVL_Tree<T,V>::Node *AVL_Tree<T,V>::_insert(Node *p, TT&& k, VV&& val)
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_copy(const Node *p)
 {
     if(p == nullptr)
-        return new Node(std::forward<TT>(k), std::forward<VV>(val));
-    if(p->key == k)
-        throw std::runtime_error("AVL_Tree trying to insert by existing key");
-    if(k < p->key)
-        p->left = _insert(p->left, std::forward<TT>(k), std::forward<VV>(val));
-    else
-        p->right = _insert(p->right, std::forward<TT>(k), std::forward<VV>(val));
+        return nullptr;
+
+    Node *ret = _pool.create(p->key, p->val);
+    ret->height = p->height;
+    ret->count = p->count;
+    try {
+        ret->left = _copy(p->left);
+        if(ret->left)
+            ret->left->parent = ret;
+        ret->right = _copy(p->right);
+        if(ret->right)
+            ret->right->parent = ret;
+    }
+    catch (...) {
+        _destroy(ret);
+        throw;
+    }
+
+    return ret;
+}
+
+// Builds a balanced subtree of n nodes taken in order from src(); the
+// left half gets the smaller share, so heights differ by at most one.
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Src>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_build(size_t n, Src &src)
+{
+    if(n == 0)
+        return nullptr;
+
+    Node *left = _build(n / 2, src);
+    Node *p;
+    try {
+        p = src();
+    }
+    catch (...) {
+        _destroy(left);
+        throw;
+    }
+
+    p->left = left;
+    if(left)
+        left->parent = p;
+
+    try {
+        p->right = _build(n - n / 2 - 1, src);
+    }
+    catch (...) {
+        _destroy(p);
+        throw;
+    }
+    if(p->right)
+        p->right->parent = p;
 
     _fixheight(p);
-    return _balance(p);
+    return p;
 }
 
-template <typename T, typename V>
-template <typename TT>
-typename AVL_Tree<T,V>::Node *AVL_Tree<T,V>::_get(Node *p, TT&& k) const
+// Rebuilds the subtree p, whose nodes belong to from's pool, in this tree's
+// pool by moving keys and values over, then frees the originals.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_relocate(Node *p, AVL_Tree &from)
 {
     if(p == nullptr)
-        throw std::out_of_range("AVL_Tree out of range!");
-    if(k == p->key)
+        return nullptr;
+
+    p->parent = nullptr;
+    Node *q = _find_min(p);
+    auto src = [this, &q](){
+        Node *ret = _pool.create(std::move(q->key), std::move(q->val));
+        q = _next(q);
+        return ret;
+    };
+
+    Node *ret = _build(_count(p), src);
+    from._destroy(p);
+    return ret;
+}
+
+// Rebuilds the tree balanced from the nodes whose value passes f, in one
+// in-order pass and without allocating; the other nodes are destroyed.
+// If f throws, the tree is left empty.
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void AVL_Tree<T,V,Compare,Allocator>::_keep_if(Func &f)
+{
+    Node *root = _root;
+    _root = _leftmost = _rightmost = nullptr;
+    _size = 0;
+
+    Node *head = nullptr, **tail = &head;
+    size_t n = 0;
+    try {
+        _filter(root, f, tail, n);
+    }
+    catch (...) {
+        _destroy(head);
+        throw;
+    }
+
+    auto src = [&head](){
+        Node *p = head;
+        head = p->right;
         return p;
-    if(k < p->key)
-        return _get(p->left, k);
-    else
-        return _get(p->right, k);
+    };
+    _set_root(_build(n, src));
+    _size = n;
+    _reset_extremes();
 }
 
-template <typename T, typename V>
-size_t AVL_Tree<T,V>::_calc_size(Node *p) const
+// Appends the passing nodes of p in order to the list ending at tail,
+// linked through right, and destroys the rest. Children are read before a
+// node is relinked, so no parent links are followed. On an exception the
+// part of p not yet visited is destroyed.
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void AVL_Tree<T,V,Compare,Allocator>::_filter(Node *p, Func &f, Node **&tail, size_t &n)
 {
     if(p == nullptr)
-        return 0;
+        return;
+
+    Node *right = p->right;
+    bool keep;
+    try {
+        _filter(p->left, f, tail, n);
+        p->left = nullptr;
+        keep = f(p->val);
+    }
+    catch (...) {
+        p->left = nullptr;
+        _destroy(p);
+        throw;
+    }
+
+    p->right = nullptr;
+    if(keep) {
+        *tail = p;
+        tail = &p->right;
+        ++n;
+    }
+    else {
+        _pool.destroy(p);
+    }
+    _filter(right, f, tail, n);
+}
+
+// The join/split helpers work on detached subtrees: the parent link of a
+// subtree root is not maintained until it is linked under another node.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_link(Node *l, Node *k, Node *r)
+{
+    k->left = l;
+    if(l)
+        l->parent = k;
+    k->right = r;
+    if(r)
+        r->parent = k;
+
+    _fixheight(k);
+    return k;
+}
+
+// Joins l < k < r into one AVL tree in O(|height(l) - height(r)|): k is
+// linked in down the spine of the taller side, where the heights meet.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_join(Node *l, Node *k, Node *r)
+{
+    if(_height(l) > _height(r) + 1)
+        return _join_right(l, k, r);
+    if(_height(r) > _height(l) + 1)
+        return _join_left(l, k, r);
+    return _link(l, k, r);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_join_right(Node *l, Node *k, Node *r)
+{
+    if(_height(l) <= _height(r) + 1)
+        return _link(l, k, r);
+
+    l->right = _join_right(l->right, k, r);
+    l->right->parent = l;
+    return _balance(l);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_join_left(Node *l, Node *k, Node *r)
+{
+    if(_height(r) <= _height(l) + 1)
+        return _link(l, k, r);
+
+    r->left = _join_left(l, k, r->left);
+    r->left->parent = r;
+    return _balance(r);
+}
+
+// Join without a middle node: the last node of l takes that role.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_join2(Node *l, Node *r)
+{
+    if(l == nullptr)
+        return r;
+    if(r == nullptr)
+        return l;
+
+    Node *last;
+    l = _split_last(l, last);
+    return _join(l, last, r);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_split_last(Node *p, Node *&last)
+{
+    if(p->right == nullptr) {
+        last = p;
+        Node *l = p->left;
+        p->left = nullptr;
+        return l;
+    }
+
+    p->right = _split_last(p->right, last);
+    if(p->right)
+        p->right->parent = p;
+    return _balance(p);
+}
+
+// Splits p into the keys less than key (l), the node holding key if any
+// (mid, detached), and the keys greater than key (r).
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+void AVL_Tree<T,V,Compare,Allocator>::_split(Node *p, const TT &key, Node *&l, Node *&mid, Node *&r)
+{
+    if(p == nullptr) {
+        l = mid = r = nullptr;
+        return;
+    }
+
+    Node *pl = p->left, *pr = p->right;
+    if(_comp(key, p->key)) {
+        _split(pl, key, l, mid, r);
+        r = _join(r, p, pr);
+    }
+    else if(_comp(p->key, key)) {
+        _split(pr, key, l, mid, r);
+        l = _join(pl, p, l);
+    }
+    else {
+        l = pl;
+        r = pr;
+        mid = _link(nullptr, p, nullptr);
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Left, typename Right>
+void AVL_Tree<T,V,Compare,Allocator>::_fork(bool parallel, Left left, Right right)
+{
+    // both branches would bump the same unsynchronized stats counters
+    if(!parallel || AVL_TreeStats::enabled) {
+        left();
+        right();
+        return;
+    }
+
+    auto future = std::async(std::launch::async, left);
+    right();
+    future.get();
+}
+
+// Subtrees that leave the tree are collected in dropped and destroyed by
+// _adopt() afterwards, so forked branches never touch the pool.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_union(Node *a, Node *b, std::vector<Node*> &dropped, size_t grain, int depth)
+{
+    if(a == nullptr)
+        return b;
+    if(b == nullptr)
+        return a;
+
+    bool parallel = depth > 0 && _count(a) > grain && _count(b) > grain;
+    Node *l, *mid, *r;
+    _split(b, a->key, l, mid, r);
+    if(mid != nullptr)
+        dropped.push_back(mid);
+
+    Node *al = a->left, *ar = a->right;
+    std::vector<Node*> dropped_left;
+    _fork(parallel,
+          [&](){l = _union(al, l, dropped_left, grain, depth - 1);},
+          [&](){r = _union(ar, r, dropped, grain, depth - 1);});
+    dropped.insert(dropped.end(), dropped_left.begin(), dropped_left.end());
+
+    return _join(l, a, r);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_intersect(Node *a, const Node *b, std::vector<Node*> &dropped, size_t grain, int depth)
+{
+    if(a == nullptr)
+        return nullptr;
+    if(b == nullptr) {
+        dropped.push_back(a);
+        return nullptr;
+    }
+
+    bool parallel = depth > 0 && _count(a) > grain && _count(b) > grain;
+    Node *l, *mid, *r;
+    _split(a, b->key, l, mid, r);
+
+    std::vector<Node*> dropped_left;
+    _fork(parallel,
+          [&](){l = _intersect(l, b->left, dropped_left, grain, depth - 1);},
+          [&](){r = _intersect(r, b->right, dropped, grain, depth - 1);});
+    dropped.insert(dropped.end(), dropped_left.begin(), dropped_left.end());
+
+    return mid != nullptr ? _join(l, mid, r) : _join2(l, r);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_difference(Node *a, const Node *b, std::vector<Node*> &dropped, size_t grain, int depth)
+{
+    if(a == nullptr || b == nullptr)
+        return a;
+
+    bool parallel = depth > 0 && _count(a) > grain && _count(b) > grain;
+    Node *l, *mid, *r;
+    _split(a, b->key, l, mid, r);
+    if(mid != nullptr)
+        dropped.push_back(mid);
+
+    std::vector<Node*> dropped_left;
+    _fork(parallel,
+          [&](){l = _difference(l, b->left, dropped_left, grain, depth - 1);},
+          [&](){r = _difference(r, b->right, dropped, grain, depth - 1);});
+    dropped.insert(dropped.end(), dropped_left.begin(), dropped_left.end());
+
+    return _join2(l, r);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::_adopt(Node *root, std::vector<Node*> &dropped)
+{
+    for(Node *p : dropped)
+        _destroy(p);
+
+    _set_root(root);
+    _size = _count(_root);
+    _reset_extremes();
+}
+
+// Nodes are destroyed without recursion by rotating left children up into
+// a right-leaning list.
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::_destroy(Node *p)
+{
+    while(p != nullptr) {
+        if(p->left != nullptr) {
+            Node *l = p->left;
+            p->left = l->right;
+            l->right = p;
+            p = l;
+        }
+        else {
+            Node *r = p->right;
+            _pool.destroy(p);
+            p = r;
+        }
+    }
+}
+
+// Every live node of the pool belongs to the tree (split rebuilds the half
+// it gives away), so the slabs are returned in one go; trivially
+// destructible nodes are not even visited.
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::_destroy_all()
+{
+    if(!std::is_trivially_destructible<Node>::value)
+        _destroy(_root);
+
+    _pool.release();
+    _root = _leftmost = _rightmost = nullptr;
+    _size = 0;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_next(const Node *p)
+{
+    if(p->right != nullptr) {
+        Node *q = p->right;
+        while(q->left != nullptr)
+            q = q->left;
+        return q;
+    }
+
+    while(p->parent != nullptr && p->parent->right == p)
+        p = p->parent;
+    return p->parent;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_prev(const Node *p)
+{
+    if(p->left != nullptr) {
+        Node *q = p->left;
+        while(q->right != nullptr)
+            q = q->right;
+        return q;
+    }
+
+    while(p->parent != nullptr && p->parent->left == p)
+        p = p->parent;
+    return p->parent;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+int AVL_Tree<T,V,Compare,Allocator>::_height(Node *p) const{
+    return p ? p->height : 0;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::_fixheight(Node *p){
+    p->height = std::max(_height(p->left), _height(p->right)) + 1;
+    p->count = _count(p->left) + _count(p->right) + 1;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+int AVL_Tree<T,V,Compare,Allocator>::_factor(Node *p) const {
+    return _height(p->right) - _height(p->left);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_rotate_right(Node *p)
+{
+    Node *q = p->left;
+    p->left = q->right;
+    if(p->left)
+        p->left->parent = p;
+    q->right = p;
+    q->parent = p->parent;
+    p->parent = q;
+
+    _fixheight(p);
+    _fixheight(q);
+
+    AVL_TREE_STAT(++_stats.rotations;)
+    return q;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_rotate_left(Node *q)
+{
+    Node *p = q->right;
+    q->right = p->left;
+    if(q->right)
+        q->right->parent = q;
+    p->left = q;
+    p->parent = q->parent;
+    q->parent = p;
+
+    _fixheight(q);
+    _fixheight(p);
+
+    AVL_TREE_STAT(++_stats.rotations;)
+    return p;
+}
+
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_balance(Node *p)
+{
+    AVL_TREE_STAT(++_stats.balances;)
+    _fixheight(p);
+
+    if(_factor(p) == 2)
+    {
+        if(_factor(p->right) < 0)
+            p->right = _rotate_right(p->right);
+
+        p = _rotate_left(p);
+    }
+    else if(_factor(p) == -2)
+    {
+        if(_factor(p->left) > 0)
+            p->left = _rotate_left(p->left);
+
+        p = _rotate_right(p);
+    }
+
+    return p;
+}
+
+// Walks from p back to the top fixing heights and sizes and rebalancing.
+// p still holds the height its subtree had before the change, so once a
+// subtree (rotated or not) comes out as high as it was, nothing above it
+// needs rebalancing and only the sizes are fixed from there on.
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::_rebalance_up(Node *p)
+{
+    while(p != nullptr) {
+        Node *parent = p->parent;
+        bool left = parent != nullptr && parent->left == p;
+        unsigned int height = p->height;
+
+        Node *q = _balance(p);
+        if(parent == nullptr)
+            _root = q;
+        else if(left)
+            parent->left = q;
+        else
+            parent->right = q;
+
+        p = parent;
+        if(q->height == height)
+            break;
+    }
+
+    for(; p != nullptr; p = p->parent)
+        p->count = _count(p->left) + _count(p->right) + 1;
+}
+
+// Returns the node holding key, or nullptr together with the place where
+// it would be attached. One comparison per level: the last node not
+// greater than key is remembered and checked for equality at the end.
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_find_slot(const TT &key, Node *&parent, bool &left) const
+{
+    const _lookup_type<TT> &k = key;
+    Node *p = _root, *cand = nullptr;
+    parent = nullptr;
+    left = false;
+    AVL_TREE_STAT(size_t depth = 0;)
+    while(p != nullptr) {
+        AVL_TREE_STAT(++depth;)
+        parent = p;
+        left = _comp(k, p->key);
+        if(left) {
+            p = p->left;
+        }
+        else {
+            cand = p;
+            p = p->right;
+        }
+    }
+    AVL_TREE_STAT(_stats.max_depth = std::max(_stats.max_depth, depth);)
+    return cand != nullptr && !_comp(cand->key, k) ? cand : nullptr;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_attach(Node *n, Node *parent, bool left)
+{
+    n->parent = parent;
+    if(parent == nullptr) {
+        _root = _leftmost = _rightmost = n;
+    }
+    else if(left) {
+        parent->left = n;
+        if(parent == _leftmost)
+            _leftmost = n;
+    }
+    else {
+        parent->right = n;
+        if(parent == _rightmost)
+            _rightmost = n;
+    }
+
+    _rebalance_up(parent);
+    ++_size;
+    return n;
+}
+
+// Returns the node holding key, or nullptr. Keys of class type take one
+// comparison per level plus the final equality check. Arithmetic keys take
+// two per level instead (and count two in the stats): the loop stops at the
+// equal key and picks the child with a conditional move, which the
+// benchmark's find vs find_via_lower_bound rows show to be 2-3x faster.
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_find(const TT &key) const
+{
+    const _lookup_type<TT> &k = key;
+    if constexpr (!std::is_arithmetic<T>::value) {
+        Node *p = _lower_bound(k);
+        return p != nullptr && !_comp(k, p->key) ? p : nullptr;
+    }
+    else {
+        // Both comparisons are one instruction here. The lower_bound descent
+        // carries its candidate along, so it compiles to branches, and
+        // random keys mispredict half of them.
+        Node *p = _root;
+        AVL_TREE_STAT(size_t depth = 0;)
+        while(p != nullptr) {
+            AVL_TREE_STAT(++depth;)
+            bool left = _comp(k, p->key), right = _comp(p->key, k);
+            if(left == right)
+                break;
+            p = left ? p->left : p->right;
+        }
+        AVL_TREE_STAT(_stats.max_depth = std::max(_stats.max_depth, depth);)
+        return p;
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename It, typename Out>
+Out AVL_Tree<T,V,Compare,Allocator>::find_many(It first, It last, Out out) const
+{
+    _lookup_many(first, last, [&out](Node *p){*out++ = p != nullptr;});
+    return out;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename It, typename Out>
+Out AVL_Tree<T,V,Compare,Allocator>::get_many(It first, It last, Out out)
+{
+    _lookup_many(first, last, [&out](Node *p){*out++ = p != nullptr ? &p->val : nullptr;});
+    return out;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename It, typename Out>
+Out AVL_Tree<T,V,Compare,Allocator>::get_many(It first, It last, Out out) const
+{
+    _lookup_many(first, last, [&out](const Node *p){*out++ = p != nullptr ? &p->val : static_cast<const V*>(nullptr);});
+    return out;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::_prefetch(const Node *p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p);
+#else
+    (void)p;
+#endif
+}
+
+// Calls emit(node or nullptr) for every key in order.
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename It, typename Emit>
+void AVL_Tree<T,V,Compare,Allocator>::_lookup_many(It first, It last, Emit emit) const
+{
+    using K = _lookup_type<typename std::iterator_traits<It>::value_type>;
+    using reference = typename std::iterator_traits<It>::reference;
+
+    // resuming from the previous path only pays when the batch is dense
+    // enough for consecutive searches to share most of it
+    size_t n = std::distance(first, last);
+    if(_size / 64 <= n && std::is_sorted(first, last, [this](const K &a, const K &b){return _comp(a, b);})) {
+        std::vector<std::pair<Node*, const Node*>> path;
+        path.reserve(_height(_root) + 1);
+        for(; first != last; ++first)
+            emit(_find_from<K>(*first, path));
+        return;
+    }
+
+    // keys are read in place when the range holds them already, and
+    // converted once per group otherwise
+    constexpr bool direct = std::is_lvalue_reference<reference>::value &&
+                            std::is_same<typename std::decay<reference>::type, K>::value;
+    std::vector<K> converted;
+    if(!direct)
+        converted.reserve(lookup_batch);
+
+    const K *keys[lookup_batch];
+    Node *found[lookup_batch];
+    while(first != last) {
+        size_t m = 0;
+        converted.clear();
+        for(; m < lookup_batch && first != last; ++m, ++first) {
+            if constexpr (direct) {
+                keys[m] = &*first;
+            }
+            else {
+                converted.emplace_back(*first);
+                keys[m] = &converted.back();
+            }
+        }
+
+        _find_group(keys, m, found);
+        for(size_t j = 0; j < m; ++j)
+            emit(found[j]);
+    }
+}
+
+// Each round moves every unfinished lookup one level down and prefetches
+// the node it will read next round.
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename K>
+void AVL_Tree<T,V,Compare,Allocator>::_find_group(const K *const *keys, size_t m, Node **found) const
+{
+    Node *cur[lookup_batch];
+    size_t active = 0;
+    for(size_t j = 0; j < m; ++j) {
+        found[j] = nullptr;
+        cur[j] = _root;
+        active += _root != nullptr;
+    }
+
+    while(active > 0) {
+        for(size_t j = 0; j < m; ++j) {
+            Node *p = cur[j];
+            if(p == nullptr)
+                continue;
+
+            const K &k = *keys[j];
+            if(_comp(k, p->key)) {
+                p = p->left;
+            }
+            else if(_comp(p->key, k)) {
+                p = p->right;
+            }
+            else {
+                found[j] = p;
+                p = nullptr;
+            }
+
+            cur[j] = p;
+            if(p != nullptr)
+                _prefetch(p);
+            else
+                --active;
+        }
+    }
+}
+
+// path holds the nodes of the previous search with the exclusive upper bound
+// of each one's subtree (nullptr for none). Keys come in ascending order, so
+// the search restarts from the lowest of them whose bound is above key.
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename K>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_find_from(const K &key, std::vector<std::pair<Node*, const Node*>> &path) const
+{
+    while(!path.empty() && path.back().second != nullptr && !_comp(key, path.back().second->key))
+        path.pop_back();
+
+    Node *p = _root;
+    const Node *bound = nullptr;
+    if(!path.empty()) {
+        std::tie(p, bound) = path.back();
+        path.pop_back();
+    }
+
+    while(p != nullptr) {
+        path.emplace_back(p, bound);
+        if(_comp(key, p->key)) {
+            bound = p;
+            p = p->left;
+        }
+        else if(_comp(p->key, key)) {
+            p = p->right;
+        }
+        else {
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_lower_bound(const TT &key) const
+{
+    const _lookup_type<TT> &k = key;
+    Node *p = _root, *ret = nullptr;
+    AVL_TREE_STAT(size_t depth = 0;)
+    while(p != nullptr) {
+        AVL_TREE_STAT(++depth;)
+        if(_comp(p->key, k)) {
+            p = p->right;
+        }
+        else {
+            ret = p;
+            p = p->left;
+        }
+    }
+    AVL_TREE_STAT(_stats.max_depth = std::max(_stats.max_depth, depth);)
+    return ret;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_upper_bound(const TT &key) const
+{
+    const _lookup_type<TT> &k = key;
+    Node *p = _root, *ret = nullptr;
+    AVL_TREE_STAT(size_t depth = 0;)
+    while(p != nullptr) {
+        AVL_TREE_STAT(++depth;)
+        if(_comp(k, p->key)) {
+            ret = p;
+            p = p->left;
+        }
+        else {
+            p = p->right;
+        }
+    }
+    AVL_TREE_STAT(_stats.max_depth = std::max(_stats.max_depth, depth);)
+    return ret;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_select(size_t k) const
+{
+    Node *p = _root;
+    while(p != nullptr) {
+        size_t left = _count(p->left);
+        if(k < left) {
+            p = p->left;
+        }
+        else if(k == left) {
+            return p;
+        }
+        else {
+            k -= left + 1;
+            p = p->right;
+        }
+    }
+    return nullptr;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+size_t AVL_Tree<T,V,Compare,Allocator>::rank(const TT &key) const
+{
+    const _lookup_type<TT> &k = key;
+    size_t ret = 0;
+    Node *p = _root;
+    while(p != nullptr) {
+        if(_comp(p->key, k)) {
+            ret += _count(p->left) + 1;
+            p = p->right;
+        }
+        else {
+            p = p->left;
+        }
+    }
+    return ret;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT1, typename TT2>
+size_t AVL_Tree<T,V,Compare,Allocator>::count_range(const TT1 &lo, const TT2 &hi) const
+{
+    size_t l = rank(lo), h = rank(hi);
+    return h > l ? h - l : 0;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_find_min(Node *p) const
+{
+    while(p->left != nullptr)
+        p = p->left;
+    return p;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_find_max(Node *p) const
+{
+    while(p->right != nullptr)
+        p = p->right;
+    return p;
+}
+
+// Puts n (possibly nullptr) in place of p under p's parent.
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::_replace(Node *p, Node *n)
+{
+    Node *parent = p->parent;
+    if(n != nullptr)
+        n->parent = parent;
+
+    if(parent == nullptr)
+        _root = n;
+    else if(parent->left == p)
+        parent->left = n;
     else
-        return _calc_size(p->left) + _calc_size(p->right) + 1;
+        parent->right = n;
+}
+
+// Unlinks p, moving its in-order successor into its place when it has two
+// children, then rebalances from the lowest node whose subtree changed.
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::_erase(Node *p)
+{
+    // rotations keep the in-order sequence, so only losing an extreme moves it
+    if(p == _leftmost)
+        _leftmost = _next(p);
+    if(p == _rightmost)
+        _rightmost = _prev(p);
+
+    Node *from;
+    if(p->left != nullptr && p->right != nullptr) {
+        Node *m = _find_min(p->right);
+        if(m->parent != p) {
+            from = m->parent;
+            from->left = m->right;
+            if(m->right)
+                m->right->parent = from;
+            m->right = p->right;
+            m->right->parent = m;
+        }
+        else {
+            from = m;
+        }
+
+        m->left = p->left;
+        m->left->parent = m;
+        // m takes over p's place, and the old height rebalancing compares to
+        m->height = p->height;
+        _replace(p, m);
+    }
+    else {
+        from = p->parent;
+        _replace(p, p->left ? p->left : p->right);
+    }
+
+    _pool.destroy(p);
+    --_size;
+    _rebalance_up(from);
 }
 
-template <typename T, typename V>
-void AVL_Tree<T,V>::_assert_empty() const
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT>
+typename AVL_Tree<T,V,Compare,Allocator>::Node *AVL_Tree<T,V,Compare,Allocator>::_get(const TT &key) const
+{
+    Node *p = _find(key);
+    if(p == nullptr)
+        throw std::out_of_range("AVL_Tree out of range!");
+    return p;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Tree<T,V,Compare,Allocator>::_assert_empty() const
 {
     if(_root == nullptr)
         throw std::logic_error("AVL_Tree assert empty");
 }
 
 
-template <typename T, typename V, typename Func>
-AVL_Tree<T,V> map(const AVL_Tree<T,V> &tree, Func f)
+template <typename T, typename V, typename Compare, typename Allocator, typename Func>
+AVL_Tree<T,V,Compare,Allocator> map(const AVL_Tree<T,V,Compare,Allocator> &tree, Func f)
 {
-    AVL_Tree<T,V> ret = tree;
-    ret.traversal(ret.LRtR, [f](const T &key, V &val){
+    AVL_Tree<T,V,Compare,Allocator> ret = tree;
+    ret.traversal(ret.LRtR, [f](const T &, V &val){
         val = f(val);
     });
 
     return ret;
 }
 
-template <typename T, typename V, typename Func>
-AVL_Tree<T,V> map(AVL_Tree<T,V> &&tree, Func f)
+template <typename T, typename V, typename Compare, typename Allocator, typename Func>
+AVL_Tree<T,V,Compare,Allocator> map(AVL_Tree<T,V,Compare,Allocator> &&tree, Func f)
 {
-    AVL_Tree<T,V> ret = tree;
-    ret.traversal(ret.LRtR, [f](const T &key, V &val){
+    AVL_Tree<T,V,Compare,Allocator> ret = std::move(tree);
+    ret.traversal(ret.LRtR, [f](const T &, V &val){
         val = f(val);
     });
 
     return ret;
 }
 
-template <typename T, typename V, typename Func>
-AVL_Tree<T,V> where(const AVL_Tree<T,V> &tree, Func f)
+template <typename T, typename V, typename Compare, typename Allocator, typename Func>
+AVL_Tree<T,V,Compare,Allocator> where(const AVL_Tree<T,V,Compare,Allocator> &tree, Func f)
 {
-    AVL_Tree<T,V> ret;
-    tree.const_traversal(tree.LRtR, [&f, &ret](const T &key, const V &val){
-        if(f(val)){
-            ret.insert(key, val);
+    std::vector<std::pair<const T&, const V&>> kept;
+    for(auto kv : tree) {
+        if(f(kv.second)){
+            kept.push_back(kv);
         }
-    });
-    return ret;
+    }
+    return AVL_Tree<T,V,Compare,Allocator>::from_sorted(kept.begin(), kept.end(), tree.key_comp(), tree.get_allocator());
 }
 
-template <typename T, typename V, typename Func>
-AVL_Tree<T,V> where(AVL_Tree<T,V> &&tree, Func f)
+template <typename T, typename V, typename Compare, typename Allocator, typename Func>
+AVL_Tree<T,V,Compare,Allocator> where(AVL_Tree<T,V,Compare,Allocator> &&tree, Func f)
 {
-    AVL_Tree<T,V> ret;
-    tree.const_traversal(tree.LRtR, [&f, &ret](const T &key, const V &val){
-        if(f(val)){
-            // Are we actually not able to move key too?
-            ret.insert(key, std::move(val));
-        }
-    });
+    // the kept entries never move: their nodes are relinked in place
+    AVL_Tree<T,V,Compare,Allocator> ret(std::move(tree));
+    ret._keep_if(f);
     return ret;
 }
 
-template <typename T, typename V, typename VV, typename Func>
-V reduce(const AVL_Tree<T,V> &tree, VV&& init, Func f, typename AVL_Tree<T,V>::traversal_type t_type = AVL_Tree<T,V>::LRtR)
+template <typename T, typename V, typename Compare, typename Allocator, typename VV, typename Func>
+V reduce(const AVL_Tree<T,V,Compare,Allocator> &tree, VV&& init, Func f, typename AVL_Tree<T,V,Compare,Allocator>::traversal_type t_type = AVL_Tree<T,V,Compare,Allocator>::LRtR)
 {
     V ret = init;
 
-    tree.const_traversal(t_type, [&f, &ret](const T &key, const V &val){
+    tree.const_traversal(t_type, [&f, &ret](const T &, const V &val){
         ret = f(val, ret);
     });
 
     return ret;
 }
 
+
+template <typename T, typename V, typename Compare, typename Allocator, typename Func>
+AVL_Tree<T,V,Compare,Allocator> parallel_map(const AVL_Tree<T,V,Compare,Allocator> &tree, Func f)
+{
+    AVL_Tree<T,V,Compare,Allocator> ret = tree;
+    ret.parallel_for_each([&f](const T &, V &val){
+        val = f(val);
+    });
+
+    return ret;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator, typename Func>
+AVL_Tree<T,V,Compare,Allocator> parallel_map(AVL_Tree<T,V,Compare,Allocator> &&tree, Func f)
+{
+    AVL_Tree<T,V,Compare,Allocator> ret = std::move(tree);
+    ret.parallel_for_each([&f](const T &, V &val){
+        val = f(val);
+    });
+
+    return ret;
+}
+
+// Survivors of every subtree are gathered in order and the pieces are
+// concatenated, so the result is bulk-built rather than re-inserted.
+template <typename T, typename V, typename Compare, typename Allocator, typename Func>
+AVL_Tree<T,V,Compare,Allocator> parallel_where(const AVL_Tree<T,V,Compare,Allocator> &tree, Func f)
+{
+    using kept_type = std::vector<std::pair<const T&, const V&>>;
+    kept_type kept = tree.parallel_fold(kept_type(),
+        [&f](kept_type acc, const T &key, const V &val){
+            if(f(val)){
+                acc.emplace_back(key, val);
+            }
+            return acc;
+        },
+        [](kept_type left, kept_type right){
+            left.reserve(left.size() + right.size());
+            for(auto &kv : right)
+                left.push_back(kv);
+            return left;
+        });
+
+    return AVL_Tree<T,V,Compare,Allocator>::from_sorted(kept.begin(), kept.end(), tree.key_comp(), tree.get_allocator());
+}
+
+// identity starts every piece (0 for a sum), combine joins partial results.
+template <typename T, typename V, typename Compare, typename Allocator, typename VV, typename Func, typename Combine>
+V parallel_reduce(const AVL_Tree<T,V,Compare,Allocator> &tree, VV&& identity, Func f, Combine combine)
+{
+    return tree.parallel_fold(V(std::forward<VV>(identity)),
+        [&f](V acc, const T &, const V &val){
+            return f(val, acc);
+        },
+        combine);
+}
+
 #endif
\ No newline at end of file
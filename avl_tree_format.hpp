@@ -0,0 +1,83 @@
+#ifndef AVL_TREE_FORMAT_HPP
+#define AVL_TREE_FORMAT_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+
+// On-disk layout written by AVL_Tree::save() and served by MappedAVL_View:
+//
+//   AVL_FileHeader                 64 bytes
+//   T keys[count]                  at keys_offset, sorted by the tree's Compare
+//   V values[count]                at values_offset
+//
+// Offsets are aligned for T and V, so a page-aligned mapping of the file
+// can be used in place. Keys and values are raw object bytes, hence only
+// trivially copyable types, and files are only portable between builds with
+// the same sizes, alignments and byte order.
+struct AVL_FileHeader {
+    static constexpr char magic_value[8] = {'A', 'V', 'L', 'T', 'R', 'E', 'E', '1'};
+    static constexpr uint32_t version_value = 1;
+    static constexpr uint32_t byte_order_value = 0x01020304;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t key_size, key_align;
+    uint32_t val_size, val_align;
+    uint64_t count;
+    uint64_t keys_offset;
+    uint64_t values_offset;
+    uint64_t file_size;
+
+    template <typename T, typename V>
+    static AVL_FileHeader make(uint64_t count);
+
+    // Throws unless the header describes count entries of T and V laid out
+    // within file_size bytes.
+    template <typename T, typename V>
+    void validate() const;
+
+    static uint64_t align_up(uint64_t n, uint64_t a) {return (n + a - 1) / a * a;}
+};
+
+static_assert(sizeof(AVL_FileHeader) == 64, "AVL_FileHeader must stay 64 bytes");
+
+
+template <typename T, typename V>
+AVL_FileHeader AVL_FileHeader::make(uint64_t count)
+{
+    AVL_FileHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, magic_value, sizeof(h.magic));
+    h.version = version_value;
+    h.byte_order = byte_order_value;
+    h.key_size = sizeof(T);
+    h.key_align = alignof(T);
+    h.val_size = sizeof(V);
+    h.val_align = alignof(V);
+    h.count = count;
+    h.keys_offset = align_up(sizeof(AVL_FileHeader), alignof(T));
+    h.values_offset = align_up(h.keys_offset + count * sizeof(T), alignof(V));
+    h.file_size = h.values_offset + count * sizeof(V);
+    return h;
+}
+
+template <typename T, typename V>
+void AVL_FileHeader::validate() const
+{
+    if(std::memcmp(magic, magic_value, sizeof(magic)) != 0 || version != version_value)
+        throw std::runtime_error("AVL_Tree bad file header");
+    if(byte_order != byte_order_value || key_size != sizeof(T) || key_align != alignof(T) ||
+       val_size != sizeof(V) || val_align != alignof(V))
+        throw std::runtime_error("AVL_Tree file was written for other key or value types");
+    if(count > (UINT64_MAX >> 2) / (sizeof(T) + sizeof(V)))
+        throw std::runtime_error("AVL_Tree bad file layout");
+
+    AVL_FileHeader expected = make<T, V>(count);
+    if(keys_offset != expected.keys_offset || values_offset != expected.values_offset || file_size != expected.file_size)
+        throw std::runtime_error("AVL_Tree bad file layout");
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef AVL_TREE_STATS_HPP
+#define AVL_TREE_STATS_HPP
+
+#include <cstddef>
+#include <utility>
+
+
+// Opt-in operation counters for AVL_Tree and the PriorityQueue backends.
+// Define AVL_TREE_STATS (or configure with -DAVL_TREE_STATS=ON) to enable
+// them; otherwise the hooks compile to nothing, the containers carry no
+// extra members and stats() returns an all-zero snapshot.
+//
+// Stats mode is not thread-safe: the counters are plain fields bumped even
+// by const lookups, so a tree read from several threads at once races on
+// them. merge(), intersect() and difference() run on one thread while the
+// stats are enabled.
+struct AVL_TreeStats {
+#ifdef AVL_TREE_STATS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    // find() on arithmetic keys spends two per level, everything else one
+    size_t comparisons = 0;
+    // single rotations; a double rotation counts two
+    size_t rotations = 0;
+    size_t balances = 0;
+    // nodes created and destroyed; array-backed heaps have none
+    size_t allocations = 0;
+    size_t deallocations = 0;
+    // most nodes visited by one search from the root
+    size_t max_depth = 0;
+    // bytes taken by the live nodes or heap entries
+    size_t bytes_in_use = 0;
+};
+
+#ifdef AVL_TREE_STATS
+#define AVL_TREE_STAT(...) __VA_ARGS__
+#else
+#define AVL_TREE_STAT(...)
+#endif
+
+
+// Comparator that counts its calls; stands in for Compare when the stats
+// are enabled and converts back to it wherever a Compare is expected.
+template <typename Compare>
+class AVL_TreeCountingCompare {
+public:
+    AVL_TreeCountingCompare() : _count(0) {}
+    AVL_TreeCountingCompare(const Compare &comp) : _comp(comp), _count(0) {}
+
+    operator const Compare&() const noexcept {return _comp;}
+
+    template <typename A, typename B>
+    bool operator()(A&& a, B&& b) const
+    {
+        ++_count;
+        return _comp(std::forward<A>(a), std::forward<B>(b));
+    }
+
+    size_t count() const noexcept {return _count;}
+    void reset() const noexcept {_count = 0;}
+
+private:
+    Compare _comp;
+    mutable size_t _count;
+};
+
+#ifdef AVL_TREE_STATS
+template <typename Compare>
+using AVL_TreeCompare = AVL_TreeCountingCompare<Compare>;
+#else
+template <typename Compare>
+using AVL_TreeCompare = Compare;
+#endif
+
+#endif
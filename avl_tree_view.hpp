@@ -0,0 +1,157 @@
+#ifndef AVL_TREE_VIEW_HPP
+#define AVL_TREE_VIEW_HPP
+
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+template <typename T, typename V, typename Compare, typename Allocator>
+class AVL_Tree;
+
+
+// Stages of a view pipeline. A stage wraps the sink of the stage after it
+// into the sink it feeds, so a whole chain collapses into one callable that
+// a single in-order traversal calls per entry, with nothing stored between
+// stages.
+struct AVL_TreeViewSource {
+    template <typename Sink>
+    Sink operator()(Sink sink) const {return sink;}
+};
+
+template <typename Prev, typename Pred>
+struct AVL_TreeViewWhere {
+    template <typename Sink>
+    auto operator()(Sink sink) const {
+        return prev([pred = pred, sink](const auto &key, auto &&val) mutable {
+            if(pred(val))
+                sink(key, std::forward<decltype(val)>(val));
+        });
+    }
+
+    Prev prev;
+    Pred pred;
+};
+
+template <typename Prev, typename Func>
+struct AVL_TreeViewMap {
+    template <typename Sink>
+    auto operator()(Sink sink) const {
+        return prev([f = f, sink](const auto &key, auto &&val) mutable {
+            sink(key, f(std::forward<decltype(val)>(val)));
+        });
+    }
+
+    Prev prev;
+    Func f;
+};
+
+
+// Lazy view of an AVL_Tree (see AVL_Tree::view()): where() and map() only
+// record their functions, and for_each(), reduce(), count() or to_tree() run
+// all of them in one pass over the tree. Entries keep their keys and key
+// order; map() may change the value type. The tree must outlive the view
+// and stay unmodified while it runs.
+template <typename Tree, typename Value, typename Stage = AVL_TreeViewSource>
+class AVL_TreeView {
+public:
+    using key_type = typename Tree::key_type;
+    using value_type = Value;
+
+    explicit AVL_TreeView(const Tree &tree, Stage stage = Stage()) : _tree(&tree), _stage(std::move(stage)) {}
+
+    // Keeps the entries whose value satisfies pred.
+    template <typename Pred>
+    AVL_TreeView<Tree, Value, AVL_TreeViewWhere<Stage, Pred>> where(Pred pred) const;
+
+    // Replaces every value with f(value).
+    template <typename Func,
+              typename Result = typename std::decay<decltype(std::declval<Func&>()(std::declval<const Value&>()))>::type>
+    AVL_TreeView<Tree, Result, AVL_TreeViewMap<Stage, Func>> map(Func f) const;
+
+    // Calls func(key, val) in ascending key order.
+    template <typename Func>
+    void for_each(Func func) const {_run([&func](const key_type &key, auto &&val){func(key, val);});}
+
+    // Folds the values in key order with acc = f(val, acc), as reduce() does.
+    template <typename R, typename Func>
+    R reduce(R init, Func f) const;
+
+    size_t count() const;
+
+    // Builds a tree of the resulting entries with the linear sorted build.
+    AVL_Tree<key_type, Value, typename Tree::key_compare,
+             typename std::allocator_traits<typename Tree::allocator_type>::template rebind_alloc<std::pair<const key_type, Value>>> to_tree() const;
+
+private:
+    template <typename Sink>
+    void _run(Sink sink) const;
+
+    const Tree *_tree;
+    Stage _stage;
+};
+
+
+template <typename Tree, typename Value, typename Stage>
+template <typename Pred>
+AVL_TreeView<Tree, Value, AVL_TreeViewWhere<Stage, Pred>> AVL_TreeView<Tree,Value,Stage>::where(Pred pred) const
+{
+    return AVL_TreeView<Tree, Value, AVL_TreeViewWhere<Stage, Pred>>(*_tree, {_stage, std::move(pred)});
+}
+
+template <typename Tree, typename Value, typename Stage>
+template <typename Func, typename Result>
+AVL_TreeView<Tree, Result, AVL_TreeViewMap<Stage, Func>> AVL_TreeView<Tree,Value,Stage>::map(Func f) const
+{
+    return AVL_TreeView<Tree, Result, AVL_TreeViewMap<Stage, Func>>(*_tree, {_stage, std::move(f)});
+}
+
+template <typename Tree, typename Value, typename Stage>
+template <typename R, typename Func>
+R AVL_TreeView<Tree,Value,Stage>::reduce(R init, Func f) const
+{
+    R acc = std::move(init);
+    _run([&acc, &f](const key_type &, auto &&val){
+        acc = f(val, std::move(acc));
+    });
+    return acc;
+}
+
+template <typename Tree, typename Value, typename Stage>
+size_t AVL_TreeView<Tree,Value,Stage>::count() const
+{
+    size_t n = 0;
+    _run([&n](const key_type &, auto &&){++n;});
+    return n;
+}
+
+template <typename Tree, typename Value, typename Stage>
+AVL_Tree<typename Tree::key_type, Value, typename Tree::key_compare,
+         typename std::allocator_traits<typename Tree::allocator_type>::template rebind_alloc<std::pair<const typename Tree::key_type, Value>>>
+AVL_TreeView<Tree,Value,Stage>::to_tree() const
+{
+    using tree_type = decltype(to_tree());
+
+    // keys stay in the source tree until the build copies them
+    std::vector<std::pair<const key_type&, Value>> kept;
+    _run([&kept](const key_type &key, auto &&val){
+        kept.emplace_back(key, std::forward<decltype(val)>(val));
+    });
+
+    return tree_type::from_sorted(std::make_move_iterator(kept.begin()), std::make_move_iterator(kept.end()),
+                                  _tree->key_comp(), typename tree_type::allocator_type(_tree->get_allocator()));
+}
+
+template <typename Tree, typename Value, typename Stage>
+template <typename Sink>
+void AVL_TreeView<Tree,Value,Stage>::_run(Sink sink) const
+{
+    auto pipeline = _stage(std::move(sink));
+    _tree->const_traversal(Tree::LRtR, [&pipeline](const key_type &key, const typename Tree::mapped_type &val){
+        pipeline(key, val);
+    });
+}
+
+#endif
@@ -0,0 +1,945 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <map>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "avl_tree.hpp"
+#include "priority_queue.hpp"
+#include "concurrent_priority_queue.hpp"
+#include "concurrent_avl_tree.hpp"
+#include "persistent_avl_tree.hpp"
+#if defined(__unix__) || defined(__APPLE__)
+#include "mapped_avl_view.hpp"
+#endif
+
+// Micro-benchmarks for AVL_Tree and PriorityQueue against the standard
+// containers. Every case prints one record (CSV by default, or JSON lines)
+// with the time per operation, so runs can be diffed to catch regressions.
+//
+//   benchmark [--min N] [--max N] [--repeat R] [--filter TEXT] [--json]
+
+
+struct Options {
+    size_t min_n = 1000;
+    size_t max_n = 1000000;
+    int repeat = 3;
+    const char *filter = nullptr;
+    bool json = false;
+};
+
+static Options options;
+
+// Keeps the optimizer from dropping the measured work.
+static volatile size_t sink;
+
+template <typename TT>
+void do_not_optimize(const TT &value)
+{
+    sink = sink + static_cast<size_t>(value);
+}
+
+void report(const char *container, const char *op, const char *order, size_t n, size_t ops, double ns)
+{
+    double per_op = ns / static_cast<double>(ops);
+    if(options.json)
+        printf("{\"container\":\"%s\",\"op\":\"%s\",\"order\":\"%s\",\"n\":%zu,\"ns_per_op\":%.2f,\"total_ms\":%.3f}\n",
+               container, op, order, n, per_op, ns / 1e6);
+    else
+        printf("%s,%s,%s,%zu,%.2f,%.3f\n", container, op, order, n, per_op, ns / 1e6);
+    fflush(stdout);
+}
+
+bool enabled(const char *container, const char *op)
+{
+    if(options.filter == nullptr)
+        return true;
+    std::string name = std::string(container) + "/" + op;
+    return name.find(options.filter) != std::string::npos;
+}
+
+// Runs setup() + func() options.repeat times and reports the best time of
+// func(), which performs `ops` operations.
+template <typename Setup, typename Func>
+void measure(const char *container, const char *op, const char *order, size_t n, size_t ops, Setup setup, Func func)
+{
+    if(!enabled(container, op))
+        return;
+
+    double best = 0;
+    for(int r = 0; r < options.repeat; ++r) {
+        auto state = setup();
+        auto start = std::chrono::steady_clock::now();
+        func(state);
+        auto stop = std::chrono::steady_clock::now();
+
+        double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+        if(r == 0 || ns < best)
+            best = ns;
+    }
+    report(container, op, order, n, ops, best);
+}
+
+template <typename Func>
+void measure(const char *container, const char *op, const char *order, size_t n, size_t ops, Func func)
+{
+    measure(container, op, order, n, ops, [](){return 0;}, [&func](int){func();});
+}
+
+
+// Key orders: random permutation, ascending, and a zigzag (0, n-1, 1, n-2, ...)
+// that keeps rebalancing both flanks of the tree.
+std::vector<int> make_keys(size_t n, const char *order)
+{
+    std::vector<int> keys(n);
+    std::iota(keys.begin(), keys.end(), 0);
+
+    if(strcmp(order, "random") == 0) {
+        std::mt19937 gen(42);
+        std::shuffle(keys.begin(), keys.end(), gen);
+    }
+    else if(strcmp(order, "zigzag") == 0) {
+        for(size_t i = 0; i < n; ++i)
+            keys[i] = static_cast<int>(i % 2 == 0 ? i / 2 : n - 1 - i / 2);
+    }
+    return keys;
+}
+
+using Tree = AVL_Tree<int, int>;
+using Map = std::map<int, int>;
+
+Tree make_tree(const std::vector<int> &keys)
+{
+    Tree tree;
+    for(int k : keys)
+        tree.insert(k, k);
+    return tree;
+}
+
+Map make_map(const std::vector<int> &keys)
+{
+    Map map;
+    for(int k : keys)
+        map.emplace(k, k);
+    return map;
+}
+
+// The recursive insert, erase and lookup AVL_Tree used before they became
+// loops over parent pointers, kept here only as a baseline. Nodes come from
+// the same NodePool, so the rows differ in the traversal alone (AVL_Tree
+// also maintains parent links and subtree counts on the way).
+class RecursiveAVL {
+public:
+    void insert(int key, int val) {_root = _insert(_root, key, val); ++_size;}
+    void erase(int key) {_root = _erase(_root, key); --_size;}
+    bool find(int key) const {return _find(_root, key) != nullptr;}
+    size_t size() const {return _size;}
+
+private:
+    struct Node {
+        Node(int k, int v) : key(k), val(v), height(1), left(nullptr), right(nullptr) {}
+
+        int key;
+        int val;
+        int height;
+        Node *left, *right;
+    };
+
+    static int _height(const Node *p) {return p ? p->height : 0;}
+    static int _factor(const Node *p) {return _height(p->right) - _height(p->left);}
+    static void _fixheight(Node *p) {p->height = std::max(_height(p->left), _height(p->right)) + 1;}
+
+    static Node *_rotate_right(Node *p)
+    {
+        Node *q = p->left;
+        p->left = q->right;
+        q->right = p;
+        _fixheight(p);
+        _fixheight(q);
+        return q;
+    }
+
+    static Node *_rotate_left(Node *q)
+    {
+        Node *p = q->right;
+        q->right = p->left;
+        p->left = q;
+        _fixheight(q);
+        _fixheight(p);
+        return p;
+    }
+
+    static Node *_balance(Node *p)
+    {
+        _fixheight(p);
+        if(_factor(p) == 2) {
+            if(_factor(p->right) < 0)
+                p->right = _rotate_right(p->right);
+            return _rotate_left(p);
+        }
+        if(_factor(p) == -2) {
+            if(_factor(p->left) > 0)
+                p->left = _rotate_left(p->left);
+            return _rotate_right(p);
+        }
+        return p;
+    }
+
+    static const Node *_find(const Node *p, int key)
+    {
+        if(p == nullptr || p->key == key)
+            return p;
+        return _find(key < p->key ? p->left : p->right, key);
+    }
+
+    static Node *_find_min(Node *p) {return p->left ? _find_min(p->left) : p;}
+
+    static Node *_remove_min(Node *p)
+    {
+        if(p->left == nullptr)
+            return p->right;
+        p->left = _remove_min(p->left);
+        return _balance(p);
+    }
+
+    Node *_insert(Node *p, int key, int val)
+    {
+        if(p == nullptr)
+            return _pool.create(key, val);
+        if(key < p->key)
+            p->left = _insert(p->left, key, val);
+        else
+            p->right = _insert(p->right, key, val);
+        return _balance(p);
+    }
+
+    Node *_erase(Node *p, int key)
+    {
+        if(key < p->key) {
+            p->left = _erase(p->left, key);
+        }
+        else if(p->key < key) {
+            p->right = _erase(p->right, key);
+        }
+        else {
+            Node *l = p->left, *r = p->right;
+            _pool.destroy(p);
+            if(r == nullptr)
+                return l;
+            Node *m = _find_min(r);
+            m->right = _remove_min(r);
+            m->left = l;
+            return _balance(m);
+        }
+        return _balance(p);
+    }
+
+    Node *_root = nullptr;
+    size_t _size = 0;
+    NodePool<Node> _pool;
+};
+
+RecursiveAVL make_recursive(const std::vector<int> &keys)
+{
+    RecursiveAVL tree;
+    for(int k : keys)
+        tree.insert(k, k);
+    return tree;
+}
+
+void bench_tree(size_t n, const char *order)
+{
+    std::vector<int> keys = make_keys(n, order);
+    std::vector<int> lookups = make_keys(n, "random");
+
+    measure("AVL_Tree", "insert", order, n, n, [&keys](){
+        Tree tree;
+        for(int k : keys)
+            tree.insert(k, k);
+        do_not_optimize(tree.size());
+    });
+    measure("RecursiveAVL", "insert", order, n, n, [&keys](){
+        RecursiveAVL tree;
+        for(int k : keys)
+            tree.insert(k, k);
+        do_not_optimize(tree.size());
+    });
+    measure("std::map", "insert", order, n, n, [&keys](){
+        Map map;
+        for(int k : keys)
+            map.emplace(k, k);
+        do_not_optimize(map.size());
+    });
+
+    measure("AVL_Tree", "operator[]", order, n, n, [&keys](){
+        Tree tree;
+        for(int k : keys)
+            tree[k] += k;
+        do_not_optimize(tree.size());
+    });
+    measure("std::map", "operator[]", order, n, n, [&keys](){
+        Map map;
+        for(int k : keys)
+            map[k] += k;
+        do_not_optimize(map.size());
+    });
+
+    {
+        Tree tree = make_tree(keys);
+        Map std_map = make_map(keys);
+        RecursiveAVL recursive = make_recursive(keys);
+
+        measure("AVL_Tree", "find", order, n, n, [&tree, &lookups](){
+            size_t found = 0;
+            for(int k : lookups)
+                found += tree.find(k);
+            do_not_optimize(found);
+        });
+        // the one-comparison descent find() uses for non-arithmetic keys
+        measure("AVL_Tree", "find_via_lower_bound", order, n, n, [&tree, &lookups](){
+            size_t found = 0;
+            for(int k : lookups) {
+                auto it = tree.lower_bound(k);
+                found += it != tree.end() && (*it).first == k;
+            }
+            do_not_optimize(found);
+        });
+        measure("RecursiveAVL", "find", order, n, n, [&recursive, &lookups](){
+            size_t found = 0;
+            for(int k : lookups)
+                found += recursive.find(k);
+            do_not_optimize(found);
+        });
+        measure("std::map", "find", order, n, n, [&std_map, &lookups](){
+            size_t found = 0;
+            for(int k : lookups)
+                found += std_map.find(k) != std_map.end();
+            do_not_optimize(found);
+        });
+
+        // batches of 256 lookups, as given and sorted
+        std::vector<int> sorted_lookups = lookups;
+        for(size_t i = 0; i < sorted_lookups.size(); i += 256)
+            std::sort(sorted_lookups.begin() + i, sorted_lookups.begin() + std::min(i + 256, sorted_lookups.size()));
+        auto batched = [&tree](const std::vector<int> &batch_keys){
+            std::vector<const int*> vals(256);
+            size_t found = 0;
+            for(size_t i = 0; i < batch_keys.size(); i += 256) {
+                auto last = batch_keys.begin() + std::min(i + 256, batch_keys.size());
+                auto end = tree.get_many(batch_keys.begin() + i, last, vals.begin());
+                found += std::count_if(vals.begin(), end, [](const int *v){return v != nullptr;});
+            }
+            do_not_optimize(found);
+        };
+        measure("AVL_Tree", "get_many", order, n, n, [&batched, &lookups](){batched(lookups);});
+        measure("AVL_Tree", "get_many_sorted", order, n, n, [&batched, &sorted_lookups](){batched(sorted_lookups);});
+
+        measure("AVL_Tree", "freeze", order, n, n, [&tree](){
+            do_not_optimize(tree.freeze().size());
+        });
+        FrozenAVL_Tree<int, int> frozen = tree.freeze();
+        measure("FrozenAVL_Tree", "find", order, n, n, [&frozen, &lookups](){
+            size_t found = 0;
+            for(int k : lookups)
+                found += frozen.find(k);
+            do_not_optimize(found);
+        });
+        measure("FrozenAVL_Tree", "iterate", order, n, n, [&frozen](){
+            size_t sum = 0;
+            frozen.for_each([&sum](const int &, const int &v){sum += v;});
+            do_not_optimize(sum);
+        });
+
+        measure("AVL_Tree", "iterate", order, n, n, [&tree](){
+            size_t sum = 0;
+            for(auto kv : tree)
+                sum += kv.second;
+            do_not_optimize(sum);
+        });
+        measure("std::map", "iterate", order, n, n, [&std_map](){
+            size_t sum = 0;
+            for(auto &kv : std_map)
+                sum += kv.second;
+            do_not_optimize(sum);
+        });
+
+        measure("AVL_Tree", "traversal", order, n, n, [&tree](){
+            size_t sum = 0;
+            tree.const_traversal(Tree::LRtR, [&sum](const int &, const int &v){sum += v;});
+            do_not_optimize(sum);
+        });
+
+        measure("AVL_Tree", "map", order, n, n, [&tree](){
+            Tree ret = map(tree, [](int v){return v + 1;});
+            do_not_optimize(ret.size());
+        });
+
+        measure("AVL_Tree", "where", order, n, n, [&tree](){
+            Tree ret = where(tree, [](int v){return v % 2 == 0;});
+            do_not_optimize(ret.size());
+        });
+
+        measure("AVL_Tree", "where(rvalue)", order, n, n,
+                [&tree](){return Tree(tree);},
+                [](Tree &copy){
+                    Tree ret = where(std::move(copy), [](int v){return v % 2 == 0;});
+                    do_not_optimize(ret.size());
+                });
+
+        measure("AVL_Tree", "reduce", order, n, n, [&tree](){
+            do_not_optimize(reduce(tree, 0, [](int v, int acc){return v ^ acc;}));
+        });
+
+        // the same where -> map -> reduce chain, eager and fused
+        measure("AVL_Tree", "where+map+reduce", order, n, n, [&tree](){
+            Tree ret = map(where(tree, [](int v){return v % 2 == 0;}), [](int v){return v + 1;});
+            do_not_optimize(reduce(ret, 0, [](int v, int acc){return v ^ acc;}));
+        });
+        measure("AVL_Tree", "view_where+map+reduce", order, n, n, [&tree](){
+            do_not_optimize(tree.view()
+                    .where([](int v){return v % 2 == 0;})
+                    .map([](int v){return v + 1;})
+                    .reduce(0, [](int v, int acc){return v ^ acc;}));
+        });
+
+        measure("AVL_Tree", "parallel_map", order, n, n, [&tree](){
+            Tree ret = parallel_map(tree, [](int v){return v + 1;});
+            do_not_optimize(ret.size());
+        });
+
+        measure("AVL_Tree", "parallel_where", order, n, n, [&tree](){
+            Tree ret = parallel_where(tree, [](int v){return v % 2 == 0;});
+            do_not_optimize(ret.size());
+        });
+
+        measure("AVL_Tree", "parallel_reduce", order, n, n, [&tree](){
+            do_not_optimize(parallel_reduce(tree, 0, [](int v, int acc){return v ^ acc;}, std::bit_xor<>()));
+        });
+
+        // a copy of the tree that then diverges by a handful of updates
+        measure("AVL_Tree", "snapshot+16updates", order, n, 1, [&tree, &lookups](){
+            Tree copy(tree);
+            for(size_t i = 0; i < 16 && i < lookups.size(); ++i)
+                copy.insert_or_assign(lookups[i], -1);
+            do_not_optimize(copy.size());
+        });
+    }
+
+    {
+        std::vector<std::pair<int, int>> items;
+        for(size_t i = 0; i < n; ++i)
+            items.emplace_back(static_cast<int>(i), static_cast<int>(i));
+        PersistentAVL_Tree<int, int> tree = PersistentAVL_Tree<int, int>::from_sorted(items.begin(), items.end());
+
+        measure("PersistentAVL_Tree", "snapshot+16updates", order, n, 1, [&tree, &lookups](){
+            PersistentAVL_Tree<int, int> copy = tree.snapshot();
+            for(size_t i = 0; i < 16 && i < lookups.size(); ++i)
+                copy.insert_or_assign(lookups[i], -1);
+            do_not_optimize(copy.size());
+        });
+
+        measure("PersistentAVL_Tree", "find", order, n, n, [&tree, &lookups](){
+            size_t found = 0;
+            for(int k : lookups)
+                found += tree.find(k);
+            do_not_optimize(found);
+        });
+    }
+
+    // binary image: load rebuilds in O(n), the mapped view searches the file
+    {
+        Tree tree = make_tree(keys);
+        std::stringstream image;
+        tree.save(image);
+        std::string bytes = image.str();
+
+        measure("AVL_Tree", "save", order, n, n, [&tree](){
+            std::stringstream out;
+            tree.save(out);
+            do_not_optimize(out.tellp());
+        });
+        measure("AVL_Tree", "load", order, n, n, [&bytes](){
+            std::stringstream in(bytes);
+            Tree loaded;
+            loaded.load(in);
+            do_not_optimize(loaded.size());
+        });
+
+#if defined(__unix__) || defined(__APPLE__)
+        std::string path = "/tmp/avl_tree_benchmark.bin";
+        {
+            std::ofstream file(path, std::ios::binary);
+            file << bytes;
+        }
+        {
+            MappedAVL_View<int, int> view(path);
+            measure("MappedAVL_View", "find", order, n, n, [&view, &lookups](){
+                size_t found = 0;
+                for(int k : lookups)
+                    found += view.find(k);
+                do_not_optimize(found);
+            });
+        }
+        std::remove(path.c_str());
+#endif
+    }
+
+    // set operations of the tree against one a sixteenth of its size
+    {
+        std::vector<int> small_keys(lookups.begin(), lookups.begin() + n / 16);
+        for(int &k : small_keys)
+            k = k * 2 + 1;
+        Tree small = make_tree(small_keys);
+        Map small_map = make_map(small_keys);
+        size_t m = small_keys.size();
+
+        measure("AVL_Tree", "merge", order, n, m,
+                [&keys, &small](){return std::make_pair(make_tree(keys), Tree(small));},
+                [](std::pair<Tree, Tree> &trees){
+                    trees.first.merge(trees.second);
+                    do_not_optimize(trees.first.size());
+                });
+        measure("std::map", "merge", order, n, m,
+                [&keys, &small_map](){return std::make_pair(make_map(keys), Map(small_map));},
+                [](std::pair<Map, Map> &maps){
+                    maps.first.merge(maps.second);
+                    do_not_optimize(maps.first.size());
+                });
+
+        measure("AVL_Tree", "intersect", order, n, m,
+                [&keys](){return make_tree(keys);},
+                [&small](Tree &tree){
+                    tree.intersect(small);
+                    do_not_optimize(tree.size());
+                });
+        measure("AVL_Tree", "difference", order, n, m,
+                [&keys](){return make_tree(keys);},
+                [&small](Tree &tree){
+                    tree.difference(small);
+                    do_not_optimize(tree.size());
+                });
+        measure("std::map", "difference", order, n, m,
+                [&keys](){return make_map(keys);},
+                [&small_map](Map &map){
+                    for(auto &kv : small_map)
+                        map.erase(kv.first);
+                    do_not_optimize(map.size());
+                });
+    }
+
+    measure("AVL_Tree", "erase", order, n, n,
+            [&keys](){return make_tree(keys);},
+            [&lookups](Tree &tree){
+                for(int k : lookups)
+                    tree.erase(k);
+                do_not_optimize(tree.size());
+            });
+    measure("RecursiveAVL", "erase", order, n, n,
+            [&keys](){return make_recursive(keys);},
+            [&lookups](RecursiveAVL &tree){
+                for(int k : lookups)
+                    tree.erase(k);
+                do_not_optimize(tree.size());
+            });
+    measure("std::map", "erase", order, n, n,
+            [&keys](){return make_map(keys);},
+            [&lookups](Map &map){
+                for(int k : lookups)
+                    map.erase(k);
+                do_not_optimize(map.size());
+            });
+}
+
+template <typename Backend>
+void bench_queue_backend(const char *container, const std::vector<int> &keys, const char *order)
+{
+    using Queue = PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, Backend>;
+    size_t n = keys.size();
+
+    measure(container, "push+pop", order, n, 2 * n, [&keys](){
+        Queue queue;
+        for(int k : keys)
+            queue.push(k, k);
+        size_t sum = 0;
+        while(!queue.empty())
+            sum += queue.pop();
+        do_not_optimize(sum);
+    });
+
+    // dispatcher-like batches of 1024
+    measure(container, "push_range+pop_n", order, n, 2 * n,
+            [&keys](){
+                std::vector<std::pair<int, int>> items;
+                for(int k : keys)
+                    items.emplace_back(k, k);
+                return std::make_pair(Queue(), items);
+            },
+            [n](std::pair<Queue, std::vector<std::pair<int, int>>> &state){
+                Queue &queue = state.first;
+                std::vector<int> out(n);
+                size_t sum = 0;
+                for(size_t i = 0; i < n; i += 1024) {
+                    auto last = state.second.begin() + std::min(n, i + 1024);
+                    queue.push_range(state.second.begin() + i, last);
+                    if((i / 1024) % 2 == 1)
+                        queue.pop_n(1024, out.begin());
+                    sum += out[0];
+                }
+                sum += queue.pop_n(n, out.begin()) - out.begin();
+                do_not_optimize(sum);
+            });
+
+    // scheduler-like steady state: the queue stays at n entries
+    measure(container, "pop+push", order, n, 2 * n,
+            [&keys](){
+                Queue queue;
+                for(int k : keys)
+                    queue.push(k, k);
+                return queue;
+            },
+            [&keys, n](Queue &queue){
+                size_t sum = 0;
+                for(size_t i = 0; i < n; ++i) {
+                    int top = queue.top_priority();
+                    sum += queue.pop();
+                    queue.push(top - static_cast<int>(n) - keys[i], keys[i]);
+                }
+                do_not_optimize(sum);
+            });
+
+    measure(container, "merge", order, n, n,
+            [&keys](){
+                std::pair<Queue, Queue> queues;
+                for(size_t i = 0; i < keys.size(); ++i)
+                    (i % 2 == 0 ? queues.first : queues.second).push(keys[i], keys[i]);
+                return queues;
+            },
+            [](std::pair<Queue, Queue> &queues){
+                queues.first.merge(queues.second);
+                do_not_optimize(queues.first.size());
+            });
+}
+
+void bench_queue(size_t n, const char *order)
+{
+    std::vector<int> keys = make_keys(n, order);
+
+    bench_queue_backend<AVL_Backend>("PriorityQueue<AVL>", keys, order);
+    bench_queue_backend<DaryHeapBackend<2>>("PriorityQueue<Dary2>", keys, order);
+    bench_queue_backend<DaryHeapBackend<4>>("PriorityQueue<Dary4>", keys, order);
+    bench_queue_backend<PairingHeapBackend>("PriorityQueue<Pairing>", keys, order);
+    measure("std::priority_queue", "push+pop", order, n, 2 * n, [&keys](){
+        std::priority_queue<std::pair<int, int>> queue;
+        for(int k : keys)
+            queue.emplace(k, k);
+        size_t sum = 0;
+        while(!queue.empty()) {
+            sum += queue.top().second;
+            queue.pop();
+        }
+        do_not_optimize(sum);
+    });
+}
+
+// Random directed graph in adjacency-array form, a fixed number of
+// weighted out-edges per node and a fixed seed so runs compare.
+struct Graph {
+    std::vector<size_t> first;
+    std::vector<int> to;
+    std::vector<int> weight;
+};
+
+Graph make_graph(size_t n, size_t degree)
+{
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<int> node(0, static_cast<int>(n) - 1), weight(1, 1000);
+    Graph g;
+    for(size_t u = 0; u < n; ++u) {
+        g.first.push_back(g.to.size());
+        for(size_t e = 0; e < degree; ++e) {
+            g.to.push_back(node(gen));
+            g.weight.push_back(weight(gen));
+        }
+    }
+    g.first.push_back(g.to.size());
+    return g;
+}
+
+// Shortest paths from node 0. The lazy variant pushes a node again on
+// every improvement and skips the outdated entries as they come out; the
+// other keeps one entry per node and moves it through its handle. The queue
+// is a max-queue, so priorities are negated distances.
+template <typename Backend>
+void bench_dijkstra_backend(const char *container, const Graph &g)
+{
+    using Queue = PriorityQueue<int, long long, std::less<long long>, std::allocator<std::pair<const long long, int>>, Backend>;
+    const long long inf = std::numeric_limits<long long>::max();
+    size_t n = g.first.size() - 1;
+
+    measure(container, "dijkstra_lazy", "graph", n, g.to.size(), [&g, n, inf](){
+        std::vector<long long> dist(n, inf);
+        Queue queue;
+        dist[0] = 0;
+        queue.push(0, 0);
+        while(!queue.empty()) {
+            long long d = -queue.top_priority();
+            int u = queue.pop();
+            if(d > dist[u])
+                continue;
+            for(size_t e = g.first[u]; e < g.first[u + 1]; ++e) {
+                long long nd = d + g.weight[e];
+                if(nd < dist[g.to[e]]) {
+                    dist[g.to[e]] = nd;
+                    queue.push(-nd, g.to[e]);
+                }
+            }
+        }
+        do_not_optimize(dist.back());
+    });
+
+    measure(container, "dijkstra_handles", "graph", n, g.to.size(), [&g, n, inf](){
+        std::vector<long long> dist(n, inf);
+        std::vector<typename Queue::handle> handles(n);
+        Queue queue;
+        dist[0] = 0;
+        handles[0] = queue.push_tracked(0, 0);
+        while(!queue.empty()) {
+            long long d = -queue.top_priority();
+            int u = queue.pop();
+            for(size_t e = g.first[u]; e < g.first[u + 1]; ++e) {
+                int v = g.to[e];
+                long long nd = d + g.weight[e];
+                if(nd >= dist[v])
+                    continue;
+                if(dist[v] == inf)
+                    handles[v] = queue.push_tracked(-nd, v);
+                else
+                    queue.update_priority(handles[v], -nd);
+                dist[v] = nd;
+            }
+        }
+        do_not_optimize(dist.back());
+    });
+}
+
+void bench_dijkstra(size_t n)
+{
+    Graph g = make_graph(n, 8);
+
+    bench_dijkstra_backend<AVL_Backend>("PriorityQueue<AVL>", g);
+    bench_dijkstra_backend<DaryHeapBackend<4>>("PriorityQueue<Dary4>", g);
+    bench_dijkstra_backend<PairingHeapBackend>("PriorityQueue<Pairing>", g);
+    measure("std::priority_queue", "dijkstra_lazy", "graph", n, g.to.size(), [&g, n](){
+        std::vector<long long> dist(n, std::numeric_limits<long long>::max());
+        std::priority_queue<std::pair<long long, int>, std::vector<std::pair<long long, int>>, std::greater<>> queue;
+        dist[0] = 0;
+        queue.emplace(0, 0);
+        while(!queue.empty()) {
+            long long d = queue.top().first;
+            int u = queue.top().second;
+            queue.pop();
+            if(d > dist[u])
+                continue;
+            for(size_t e = g.first[u]; e < g.first[u + 1]; ++e) {
+                long long nd = d + g.weight[e];
+                if(nd < dist[g.to[e]]) {
+                    dist[g.to[e]] = nd;
+                    queue.emplace(nd, g.to[e]);
+                }
+            }
+        }
+        do_not_optimize(dist.back());
+    });
+}
+
+// Every thread pushes its share of n entries, popping one after every
+// second push, then drains: the worker-pool pattern the queue is made for.
+template <typename Push, typename Pop>
+void run_workers(size_t threads, const std::vector<int> &keys, Push push, Pop pop)
+{
+    std::vector<std::thread> workers;
+    for(size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&keys, &push, &pop, threads, t](){
+            size_t sum = 0;
+            for(size_t i = t; i < keys.size(); i += threads) {
+                push(keys[i]);
+                if(i / threads % 2 == 1)
+                    sum += pop();
+            }
+            for(int v = pop(); v >= 0; v = pop())
+                sum += v;
+            do_not_optimize(sum);
+        });
+    }
+    for(auto &w : workers)
+        w.join();
+}
+
+void bench_concurrent(size_t n)
+{
+    std::vector<int> keys = make_keys(n, "random");
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+
+    for(size_t threads = 1; ; threads = std::min(threads * 2, cores)) {
+        std::string op = "mpmc/" + std::to_string(threads) + "t";
+
+        measure("PriorityQueue+mutex", op.c_str(), "random", n, 2 * n, [&keys, threads](){
+            PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, DaryHeapBackend<4>> queue;
+            std::mutex mutex;
+            run_workers(threads, keys,
+                        [&](int k){std::lock_guard<std::mutex> lock(mutex); queue.push(k, k);},
+                        [&](){std::lock_guard<std::mutex> lock(mutex); return queue.empty() ? -1 : queue.pop();});
+        });
+
+        measure("ConcurrentPriorityQueue", op.c_str(), "random", n, 2 * n, [&keys, threads](){
+            ConcurrentPriorityQueue<int, int> queue;
+            run_workers(threads, keys,
+                        [&](int k){queue.try_push(k, k);},
+                        [&](){int v; return queue.try_pop(v) ? v : -1;});
+        });
+
+        measure("ConcurrentPriorityQueue(strict)", op.c_str(), "random", n, 2 * n, [&keys, threads](){
+            ConcurrentPriorityQueue<int, int> queue(1);
+            run_workers(threads, keys,
+                        [&](int k){queue.try_push(k, k);},
+                        [&](){int v; return queue.try_pop(v) ? v : -1;});
+        });
+
+        if(threads == cores)
+            break;
+    }
+}
+
+// Each reader thread does n finds while one writer keeps updating the tree.
+template <typename Find, typename Update>
+void run_readers(size_t threads, const std::vector<int> &lookups, Find find, Update update)
+{
+    std::atomic<bool> done(false);
+    std::thread writer([&done, &update, &lookups](){
+        for(size_t i = 0; !done.load(); i = (i + 1) % lookups.size())
+            update(lookups[i]);
+    });
+
+    std::vector<std::thread> readers;
+    for(size_t t = 0; t < threads; ++t) {
+        readers.emplace_back([&lookups, &find](){
+            size_t found = 0;
+            for(int k : lookups)
+                found += find(k);
+            do_not_optimize(found);
+        });
+    }
+    for(auto &r : readers)
+        r.join();
+    done = true;
+    writer.join();
+}
+
+// Every thread inserts its share of the keys.
+template <typename Insert>
+void run_writers(size_t threads, const std::vector<int> &keys, Insert insert)
+{
+    std::vector<std::thread> writers;
+    for(size_t t = 0; t < threads; ++t) {
+        writers.emplace_back([&keys, &insert, threads, t](){
+            for(size_t i = t; i < keys.size(); i += threads)
+                insert(keys[i]);
+        });
+    }
+    for(auto &w : writers)
+        w.join();
+}
+
+void bench_concurrent_tree(size_t n)
+{
+    std::vector<int> keys = make_keys(n, "random");
+    std::vector<int> lookups = make_keys(n, "random");
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+
+    Tree tree = make_tree(keys);
+    std::shared_mutex mutex;
+    ConcurrentAVL_Tree<int, int> concurrent;
+    for(int k : keys)
+        concurrent.insert(k, k);
+
+    for(size_t threads = 1; ; threads = std::min(threads * 2, cores)) {
+        std::string op = "find+1writer/" + std::to_string(threads) + "t";
+
+        measure("AVL_Tree+shared_mutex", op.c_str(), "random", n, threads * n, [&](){
+            run_readers(threads, lookups,
+                        [&](int k){std::shared_lock<std::shared_mutex> lock(mutex); return tree.find(k);},
+                        [&](int k){std::unique_lock<std::shared_mutex> lock(mutex); tree.insert_or_assign(k, k + 1);});
+        });
+
+        measure("ConcurrentAVL_Tree", op.c_str(), "random", n, threads * n, [&](){
+            run_readers(threads, lookups,
+                        [&](int k){return concurrent.find(k);},
+                        [&](int k){concurrent.insert_or_assign(k, k + 1);});
+        });
+
+        op = "writers/" + std::to_string(threads) + "t";
+
+        measure("AVL_Tree+mutex", op.c_str(), "random", n, n, [&keys, threads](){
+            Tree tree;
+            std::mutex mutex;
+            run_writers(threads, keys, [&](int k){std::lock_guard<std::mutex> lock(mutex); tree.insert_or_assign(k, k);});
+        });
+
+        measure("ConcurrentAVL_Tree", op.c_str(), "random", n, n, [&keys, threads](){
+            ConcurrentAVL_Tree<int, int> tree;
+            run_writers(threads, keys, [&](int k){tree.insert_or_assign(k, k);});
+        });
+
+        if(threads == cores)
+            break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--min") == 0 && i + 1 < argc)
+            options.min_n = strtoull(argv[++i], nullptr, 10);
+        else if(strcmp(argv[i], "--max") == 0 && i + 1 < argc)
+            options.max_n = strtoull(argv[++i], nullptr, 10);
+        else if(strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            options.repeat = std::max(1, atoi(argv[++i]));
+        else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            options.filter = argv[++i];
+        else if(strcmp(argv[i], "--json") == 0)
+            options.json = true;
+        else {
+            fprintf(stderr, "usage: %s [--min N] [--max N] [--repeat R] [--filter TEXT] [--json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if(!options.json)
+        printf("container,op,order,n,ns_per_op,total_ms\n");
+
+    const char *orders[] = {"random", "sorted", "zigzag"};
+    for(size_t n = options.min_n; n <= options.max_n; n *= 10) {
+        for(const char *order : orders) {
+            bench_tree(n, order);
+            bench_queue(n, order);
+        }
+        bench_dijkstra(n);
+        bench_concurrent(n);
+        bench_concurrent_tree(n);
+    }
+
+    return 0;
+}
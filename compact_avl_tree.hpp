@@ -0,0 +1,458 @@
+#ifndef COMPACT_AVL_TREE_HPP
+#define COMPACT_AVL_TREE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+// Array-backed AVL tree for small keys.
+// Nodes live in one contiguous vector and link to each other by 32-bit
+// indices, the height takes a single byte and values are kept in a parallel
+// vector, so a search only touches {key, left, right, height} records.
+// Erased slots are filled with the last node, keeping storage dense; as a
+// consequence references to values are invalidated by any modification.
+template <typename T, typename V, typename Compare = std::less<T>, typename Allocator = std::allocator<std::pair<const T, V>>>
+class CompactAVL_Tree {
+public:
+    using index_type = std::uint32_t;
+    using key_compare = Compare;
+    using allocator_type = Allocator;
+
+    static constexpr index_type npos = std::numeric_limits<index_type>::max();
+
+public:
+    CompactAVL_Tree() :
+            _root(npos)
+    {}
+
+    explicit CompactAVL_Tree(const Compare &comp, const Allocator &alloc = Allocator()) :
+            _root(npos),
+            _comp(comp),
+            _nodes(node_allocator(alloc)),
+            _vals(value_allocator(alloc))
+    {}
+
+    explicit CompactAVL_Tree(const Allocator &alloc) :
+            _root(npos),
+            _nodes(node_allocator(alloc)),
+            _vals(value_allocator(alloc))
+    {}
+
+    void reserve(size_t n) {_nodes.reserve(n); _vals.reserve(n);}
+
+    template<typename TT, typename VV>
+    void insert(TT&& key, VV&& val);
+
+    template<typename TT, typename ...Args>
+    std::pair<index_type, bool> try_emplace(TT&& key, Args&& ...args);
+
+    template<typename TT, typename VV>
+    std::pair<index_type, bool> insert_or_assign(TT&& key, VV&& val);
+
+    template<typename TT>
+    void erase(const TT &key);
+
+    void clear() noexcept {_nodes.clear(); _vals.clear(); _root = npos;}
+
+    template<typename TT>
+    V& get(const TT &key) {return _vals[_get(key)];}
+
+    template<typename TT>
+    const V& get(const TT &key) const {return _vals[_get(key)];}
+
+    template<typename TT>
+    bool find(const TT &key) const {return _find(key) != npos;}
+
+    std::pair<const T&, V&> find_min() {_assert_empty(); index_type i = _find_min(_root); return {_nodes[i].key, _vals[i]};}
+
+    std::pair<const T&, V&> find_max() {_assert_empty(); index_type i = _find_max(_root); return {_nodes[i].key, _vals[i]};}
+
+    template<typename TT>
+    V& operator[] (TT&& key) {return _vals[try_emplace(std::forward<TT>(key)).first];}
+
+    // Calls func(key, val) for every entry in ascending key order.
+    template <typename Func>
+    void for_each(Func func);
+
+    template <typename Func>
+    void for_each(Func func) const;
+
+    size_t size() const noexcept {return _nodes.size();}
+    bool empty() const noexcept {return _nodes.empty();}
+    int height() const noexcept {return _height(_root);}
+
+    key_compare key_comp() const {return _comp;}
+    allocator_type get_allocator() const {return allocator_type(_nodes.get_allocator());}
+
+private:
+    struct Node {
+        template<typename TT>
+        explicit Node(TT&& k):
+                key(std::forward<TT>(k)),
+                left(npos),
+                right(npos),
+                height(1)
+        {}
+
+        T key;
+        index_type left, right;
+        std::uint8_t height;
+    };
+
+    // AVL height never exceeds 1.44 log2(n + 2), so 64 levels cover any
+    // tree addressable with 32-bit indices.
+    static constexpr int max_depth = 64;
+
+    using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using value_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<V>;
+
+    int _height(index_type i) const {return i == npos ? 0 : _nodes[i].height;}
+
+    void _fixheight(index_type i);
+
+    int _factor(index_type i) const {return _height(_nodes[i].right) - _height(_nodes[i].left);}
+
+    index_type _rotate_right(index_type p);
+
+    index_type _rotate_left(index_type q);
+
+    index_type _balance(index_type p);
+
+    void _rebalance_path(const index_type *path, const bool *left, int depth);
+
+    template<typename TT>
+    index_type _find(const TT &key) const;
+
+    template<typename TT>
+    index_type _get(const TT &key) const;
+
+    index_type _find_min(index_type i) const;
+
+    index_type _find_max(index_type i) const;
+
+    void _relocate(index_type from, index_type to);
+
+    void _assert_empty() const;
+
+    index_type _root;
+    Compare _comp;
+    std::vector<Node, node_allocator> _nodes;
+    std::vector<V, value_allocator> _vals;
+};
+
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT, typename VV>
+void CompactAVL_Tree<T,V,Compare,Allocator>::insert(TT&& key, VV&& val)
+{
+    if(!try_emplace(std::forward<TT>(key), std::forward<VV>(val)).second)
+        throw std::runtime_error("CompactAVL_Tree trying to insert by existing key");
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT, typename ...Args>
+std::pair<typename CompactAVL_Tree<T,V,Compare,Allocator>::index_type, bool>
+CompactAVL_Tree<T,V,Compare,Allocator>::try_emplace(TT&& key, Args&& ...args)
+{
+    index_type path[max_depth];
+    bool left[max_depth];
+    int depth = 0;
+
+    for(index_type p = _root; p != npos; ++depth) {
+        path[depth] = p;
+        if(_comp(key, _nodes[p].key)) {
+            left[depth] = true;
+            p = _nodes[p].left;
+        }
+        else if(_comp(_nodes[p].key, key)) {
+            left[depth] = false;
+            p = _nodes[p].right;
+        }
+        else {
+            return {p, false};
+        }
+    }
+
+    if(_nodes.size() >= npos)
+        throw std::length_error("CompactAVL_Tree is full");
+
+    index_type n = static_cast<index_type>(_nodes.size());
+    _vals.emplace_back(std::forward<Args>(args)...);
+    try {
+        _nodes.emplace_back(std::forward<TT>(key));
+    }
+    catch (...) {
+        _vals.pop_back();
+        throw;
+    }
+
+    if(depth == 0)
+        _root = n;
+    else if(left[depth - 1])
+        _nodes[path[depth - 1]].left = n;
+    else
+        _nodes[path[depth - 1]].right = n;
+
+    _rebalance_path(path, left, depth);
+    return {n, true};
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT, typename VV>
+std::pair<typename CompactAVL_Tree<T,V,Compare,Allocator>::index_type, bool>
+CompactAVL_Tree<T,V,Compare,Allocator>::insert_or_assign(TT&& key, VV&& val)
+{
+    auto ret = try_emplace(std::forward<TT>(key), std::forward<VV>(val));
+    if(!ret.second)
+        _vals[ret.first] = std::forward<VV>(val);
+    return ret;
+}
+
+// The entry of a node with two children is swapped with its in-order
+// successor, which is then unlinked; the freed slot is refilled with the
+// last node so the arrays stay dense.
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+void CompactAVL_Tree<T,V,Compare,Allocator>::erase(const TT &key)
+{
+    _assert_empty();
+
+    index_type path[max_depth];
+    bool left[max_depth];
+    int depth = 0;
+
+    index_type p = _root;
+    while(true) {
+        if(p == npos)
+            throw std::out_of_range("CompactAVL_Tree out of range!");
+        if(_comp(key, _nodes[p].key)) {
+            path[depth] = p;
+            left[depth++] = true;
+            p = _nodes[p].left;
+        }
+        else if(_comp(_nodes[p].key, key)) {
+            path[depth] = p;
+            left[depth++] = false;
+            p = _nodes[p].right;
+        }
+        else {
+            break;
+        }
+    }
+
+    if(_nodes[p].left != npos && _nodes[p].right != npos) {
+        index_type z = p;
+        path[depth] = p;
+        left[depth++] = false;
+        p = _nodes[p].right;
+        while(_nodes[p].left != npos) {
+            path[depth] = p;
+            left[depth++] = true;
+            p = _nodes[p].left;
+        }
+
+        using std::swap;
+        swap(_nodes[z].key, _nodes[p].key);
+        swap(_vals[z], _vals[p]);
+    }
+
+    index_type child = _nodes[p].left != npos ? _nodes[p].left : _nodes[p].right;
+    if(depth == 0)
+        _root = child;
+    else if(left[depth - 1])
+        _nodes[path[depth - 1]].left = child;
+    else
+        _nodes[path[depth - 1]].right = child;
+
+    _rebalance_path(path, left, depth);
+
+    index_type last = static_cast<index_type>(_nodes.size() - 1);
+    if(p != last)
+        _relocate(last, p);
+
+    _nodes.pop_back();
+    _vals.pop_back();
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void CompactAVL_Tree<T,V,Compare,Allocator>::for_each(Func func)
+{
+    index_type stack[max_depth];
+    int depth = 0;
+    index_type p = _root;
+
+    while(p != npos || depth > 0) {
+        while(p != npos) {
+            stack[depth++] = p;
+            p = _nodes[p].left;
+        }
+        p = stack[--depth];
+        func(static_cast<const T&>(_nodes[p].key), _vals[p]);
+        p = _nodes[p].right;
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void CompactAVL_Tree<T,V,Compare,Allocator>::for_each(Func func) const
+{
+    index_type stack[max_depth];
+    int depth = 0;
+    index_type p = _root;
+
+    while(p != npos || depth > 0) {
+        while(p != npos) {
+            stack[depth++] = p;
+            p = _nodes[p].left;
+        }
+        p = stack[--depth];
+        func(_nodes[p].key, _vals[p]);
+        p = _nodes[p].right;
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void CompactAVL_Tree<T,V,Compare,Allocator>::_fixheight(index_type i)
+{
+    Node &n = _nodes[i];
+    n.height = static_cast<std::uint8_t>(std::max(_height(n.left), _height(n.right)) + 1);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename CompactAVL_Tree<T,V,Compare,Allocator>::index_type CompactAVL_Tree<T,V,Compare,Allocator>::_rotate_right(index_type p)
+{
+    index_type q = _nodes[p].left;
+    _nodes[p].left = _nodes[q].right;
+    _nodes[q].right = p;
+
+    _fixheight(p);
+    _fixheight(q);
+
+    return q;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename CompactAVL_Tree<T,V,Compare,Allocator>::index_type CompactAVL_Tree<T,V,Compare,Allocator>::_rotate_left(index_type q)
+{
+    index_type p = _nodes[q].right;
+    _nodes[q].right = _nodes[p].left;
+    _nodes[p].left = q;
+
+    _fixheight(q);
+    _fixheight(p);
+
+    return p;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename CompactAVL_Tree<T,V,Compare,Allocator>::index_type CompactAVL_Tree<T,V,Compare,Allocator>::_balance(index_type p)
+{
+    _fixheight(p);
+
+    if(_factor(p) == 2)
+    {
+        if(_factor(_nodes[p].right) < 0)
+            _nodes[p].right = _rotate_right(_nodes[p].right);
+
+        p = _rotate_left(p);
+    }
+    else if(_factor(p) == -2)
+    {
+        if(_factor(_nodes[p].left) > 0)
+            _nodes[p].left = _rotate_left(_nodes[p].left);
+
+        p = _rotate_right(p);
+    }
+
+    return p;
+}
+
+// Rebalances the recorded descent path bottom-up, relinking every subtree
+// root under its parent (left[i] tells which child path[i + 1] is).
+template <typename T, typename V, typename Compare, typename Allocator>
+void CompactAVL_Tree<T,V,Compare,Allocator>::_rebalance_path(const index_type *path, const bool *left, int depth)
+{
+    for(int i = depth - 1; i >= 0; --i) {
+        index_type p = _balance(path[i]);
+        if(i == 0)
+            _root = p;
+        else if(left[i - 1])
+            _nodes[path[i - 1]].left = p;
+        else
+            _nodes[path[i - 1]].right = p;
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+typename CompactAVL_Tree<T,V,Compare,Allocator>::index_type CompactAVL_Tree<T,V,Compare,Allocator>::_find(const TT &key) const
+{
+    index_type p = _root;
+    while(p != npos) {
+        const Node &n = _nodes[p];
+        if(_comp(key, n.key))
+            p = n.left;
+        else if(_comp(n.key, key))
+            p = n.right;
+        else
+            return p;
+    }
+    return npos;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template<typename TT>
+typename CompactAVL_Tree<T,V,Compare,Allocator>::index_type CompactAVL_Tree<T,V,Compare,Allocator>::_get(const TT &key) const
+{
+    index_type p = _find(key);
+    if(p == npos)
+        throw std::out_of_range("CompactAVL_Tree out of range!");
+    return p;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename CompactAVL_Tree<T,V,Compare,Allocator>::index_type CompactAVL_Tree<T,V,Compare,Allocator>::_find_min(index_type i) const
+{
+    while(_nodes[i].left != npos)
+        i = _nodes[i].left;
+    return i;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename CompactAVL_Tree<T,V,Compare,Allocator>::index_type CompactAVL_Tree<T,V,Compare,Allocator>::_find_max(index_type i) const
+{
+    while(_nodes[i].right != npos)
+        i = _nodes[i].right;
+    return i;
+}
+
+// Moves node `from` into the free slot `to`, redirecting the link that
+// pointed at it (found by searching for its key).
+template <typename T, typename V, typename Compare, typename Allocator>
+void CompactAVL_Tree<T,V,Compare,Allocator>::_relocate(index_type from, index_type to)
+{
+    const T &key = _nodes[from].key;
+    index_type *link = &_root;
+    while(*link != from)
+        link = _comp(key, _nodes[*link].key) ? &_nodes[*link].left : &_nodes[*link].right;
+    *link = to;
+
+    _nodes[to] = std::move(_nodes[from]);
+    _vals[to] = std::move(_vals[from]);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void CompactAVL_Tree<T,V,Compare,Allocator>::_assert_empty() const
+{
+    if(_root == npos)
+        throw std::logic_error("CompactAVL_Tree assert empty");
+}
+
+#endif
@@ -0,0 +1,834 @@
+#ifndef CONCURRENT_AVL_TREE_HPP
+#define CONCURRENT_AVL_TREE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "node_pool.hpp"
+
+
+// AVL tree shared between threads, RCU style: published nodes are never
+// modified. The keys are split into ranges (partitions), each an AVL tree
+// of its own with its own root pointer, writer mutex and node pool; an
+// immutable router maps keys to partitions. A writer locks only the
+// partition of its key, copies the path it changes, swaps that root in and
+// retires the replaced nodes, so writers on different ranges run in
+// parallel. Readers load the router and a root and walk them without
+// taking any lock. A partition growing past partition_size is split in
+// two and an empty one is dropped; only these take the router mutex.
+// Retired nodes, partitions and routers are freed once every reader that
+// could still see them has left (epoch-based reclamation).
+template <typename T, typename V, typename Compare = std::less<T>, typename Allocator = std::allocator<std::pair<const T, V>>>
+class ConcurrentAVL_Tree {
+public:
+    using key_type = T;
+    using mapped_type = V;
+    using key_compare = Compare;
+    using allocator_type = Allocator;
+
+    // Readers (and writers) that can be inside the tree at the same time;
+    // more wait.
+    static constexpr size_t reader_slots = 128;
+
+    // A partition holding more entries than this is split in two.
+    static constexpr size_t partition_size = 1024;
+
+    ConcurrentAVL_Tree() : ConcurrentAVL_Tree(Compare()) {}
+    explicit ConcurrentAVL_Tree(const Compare &comp, const Allocator &alloc = Allocator());
+
+    ConcurrentAVL_Tree(const ConcurrentAVL_Tree&) = delete;
+    ConcurrentAVL_Tree& operator=(const ConcurrentAVL_Tree&) = delete;
+
+    ~ConcurrentAVL_Tree();
+
+    // Writers; safe to call concurrently with each other and with readers.
+
+    template <typename TT, typename VV>
+    void insert(TT&& key, VV&& val);
+
+    // Returns true when the key was inserted, false when it was assigned.
+    template <typename TT, typename VV>
+    bool insert_or_assign(TT&& key, VV&& val);
+
+    void erase(const T &key);
+
+    void clear();
+
+    // Readers; safe to call concurrently with each other and with writers.
+
+    bool find(const T &key) const;
+
+    // Returns a copy, the node may be reclaimed as soon as the read ends.
+    V get(const T &key) const;
+
+    // Calls func(const V&) if the key is present; the reference is valid
+    // only during the call.
+    template <typename Func>
+    bool visit(const T &key, Func func) const;
+
+    // Calls func(key, val) in key order. Every partition is walked at one
+    // consistent version, but writers may change one partition between the
+    // walks of two others.
+    template <typename Func>
+    void for_each(Func func) const;
+
+    size_t size() const noexcept {return _size.load();}
+    // Height of the tallest partition.
+    int height() const;
+
+    key_compare key_comp() const {return _comp;}
+    allocator_type get_allocator() const {return allocator_type(_alloc);}
+
+private:
+    struct Node {
+        template <typename TT, typename VV>
+        Node(TT&& k, VV&& v, const Node *l, const Node *r):
+                key(std::forward<TT>(k)),
+                val(std::forward<VV>(v)),
+                height(std::max(l ? l->height : 0, r ? r->height : 0) + 1),
+                left(l),
+                right(r)
+        {}
+
+        const T key;
+        const V val;
+        const int height;
+        const Node *const left, *const right;
+    };
+
+    using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+
+    // Pins the current epoch in a free reader slot for its lifetime.
+    class ReadGuard {
+    public:
+        explicit ReadGuard(const ConcurrentAVL_Tree &tree);
+        ~ReadGuard() {_slot->store(0);}
+
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+    private:
+        std::atomic<uint64_t> *_slot;
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> pin{0};
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        std::vector<const Node*> nodes;
+    };
+
+    // One key range. size and limbo are guarded by mutex, and so are the
+    // pool and root for writers.
+    struct Partition {
+        explicit Partition(const node_allocator &alloc) : root(nullptr), size(0), pool(alloc) {}
+        ~Partition();
+
+        std::mutex mutex;
+        std::atomic<const Node*> root;
+        size_t size;
+        std::vector<Retired> limbo;
+        NodePool<Node, node_allocator> pool;
+    };
+
+    // Never modified once published: parts[i] holds the keys from
+    // bounds[i - 1] (from the smallest key for i == 0) up to bounds[i].
+    struct Router {
+        std::vector<T> bounds;
+        std::vector<Partition*> parts;
+    };
+
+    struct RetiredRouter {
+        uint64_t epoch;
+        const Router *router;
+        // partitions that left the tree with this router
+        std::vector<Partition*> parts;
+    };
+
+    // One path-copying update of a partition: the nodes it made and the
+    // published nodes it replaced, and the change in the entry count.
+    struct Update {
+        explicit Update(Partition *part) : part(part), delta(0) {}
+
+        Partition *part;
+        std::vector<const Node*> created, retired;
+        long delta;
+    };
+
+    static int _height(const Node *p) {return p ? p->height : 0;}
+
+    template <typename TT, typename VV>
+    static const Node *_make(Update &u, TT&& key, VV&& val, const Node *l, const Node *r);
+
+    static void _retire(Update &u, const Node *p) {u.retired.push_back(p);}
+
+    static const Node *_balance(Update &u, const T &key, const V &val, const Node *l, const Node *r);
+
+    template <typename TT, typename VV>
+    const Node *_insert(Update &u, const Node *p, TT&& key, VV&& val, bool assign);
+
+    const Node *_erase(Update &u, const Node *p, const T &key);
+    static const Node *_erase_min(Update &u, const Node *p, const Node *&min);
+
+    static const Node *_copy(Update &u, const Node *p);
+
+    const Node *_find(const Node *p, const T &key) const;
+
+    Partition *_route(const Router *router, const T &key) const;
+    // Root of the partition of key as of one router version; needs a ReadGuard.
+    const Node *_root_of(const T &key) const;
+
+    template <typename Func>
+    void _update(const T &key, Func func);
+
+    void _repartition(const T &key);
+    void _split(const Router *router, size_t i);
+    void _drop(const Router *router, size_t i);
+    void _publish_router(const Router *router, std::vector<Partition*> &&gone);
+
+    uint64_t _oldest_pin() const;
+    void _reclaim(Partition *part);
+    void _reclaim_routers();
+    static void _discard(Update &u);
+    static void _free(NodePool<Node, node_allocator> &pool, const Node *p);
+
+    std::atomic<const Router*> _router;
+    std::atomic<size_t> _size;
+    Compare _comp;
+    node_allocator _alloc;
+
+    mutable std::unique_ptr<Slot[]> _slots;
+    std::atomic<uint64_t> _epoch;
+
+    // Taken before any partition mutex; guards router changes.
+    std::mutex _router_mutex;
+    std::vector<RetiredRouter> _router_limbo;
+};
+
+
+template <typename T, typename V, typename Compare, typename Allocator>
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::ConcurrentAVL_Tree(const Compare &comp, const Allocator &alloc):
+        _router(nullptr),
+        _size(0),
+        _comp(comp),
+        _alloc(alloc),
+        _slots(new Slot[reader_slots]),
+        _epoch(1)
+{
+    std::unique_ptr<Partition> part(new Partition(_alloc));
+    Router *router = new Router();
+    try {
+        router->parts.push_back(part.get());
+    }
+    catch (...) {
+        delete router;
+        throw;
+    }
+    part.release();
+    _router.store(router);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::~ConcurrentAVL_Tree()
+{
+    const Router *router = _router.load();
+    for(Partition *part : router->parts)
+        delete part;
+    delete router;
+
+    for(auto &retired : _router_limbo) {
+        for(Partition *part : retired.parts)
+            delete part;
+        delete retired.router;
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::Partition::~Partition()
+{
+    if(!std::is_trivially_destructible<Node>::value) {
+        _free(pool, root.load());
+        for(auto &batch : limbo) {
+            for(const Node *p : batch.nodes)
+                pool.destroy(const_cast<Node*>(p));
+        }
+    }
+    pool.release();
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::insert(TT&& key, VV&& val)
+{
+    bool inserted = false;
+    _update(key, [&](Update &u, const Node *root){
+        const Node *ret = _insert<TT, VV>(u, root, std::forward<TT>(key), std::forward<VV>(val), false);
+        inserted = u.delta > 0;
+        return ret;
+    });
+    if(!inserted)
+        throw std::runtime_error("AVL_Tree trying to insert by existing key");
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+bool ConcurrentAVL_Tree<T,V,Compare,Allocator>::insert_or_assign(TT&& key, VV&& val)
+{
+    bool inserted = false;
+    _update(key, [&](Update &u, const Node *root){
+        const Node *ret = _insert<TT, VV>(u, root, std::forward<TT>(key), std::forward<VV>(val), true);
+        inserted = u.delta > 0;
+        return ret;
+    });
+    return inserted;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::erase(const T &key)
+{
+    bool erased = false;
+    _update(key, [&](Update &u, const Node *root){
+        const Node *ret = _erase(u, root, key);
+        erased = u.delta < 0;
+        return ret;
+    });
+    if(!erased)
+        throw std::out_of_range("AVL_Tree out of range!");
+}
+
+// Locks every partition, so no writer is half way through one, and swaps
+// in a router with a single empty partition.
+template <typename T, typename V, typename Compare, typename Allocator>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::clear()
+{
+    std::lock_guard<std::mutex> router_lock(_router_mutex);
+    {
+        const Router *router = _router.load();
+        std::vector<std::unique_lock<std::mutex>> locks;
+        locks.reserve(router->parts.size());
+        for(Partition *part : router->parts)
+            locks.emplace_back(part->mutex);
+
+        std::unique_ptr<Partition> part(new Partition(_alloc));
+        std::unique_ptr<Router> next(new Router());
+        next->parts.push_back(part.get());
+        std::vector<Partition*> gone(router->parts);
+        _router_limbo.reserve(_router_limbo.size() + 1);
+
+        part.release();
+        _publish_router(next.release(), std::move(gone));
+        _size = 0;
+    }
+    // the old partitions are unlocked now
+    _reclaim_routers();
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+bool ConcurrentAVL_Tree<T,V,Compare,Allocator>::find(const T &key) const
+{
+    ReadGuard guard(*this);
+    return _find(_root_of(key), key) != nullptr;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+V ConcurrentAVL_Tree<T,V,Compare,Allocator>::get(const T &key) const
+{
+    ReadGuard guard(*this);
+    const Node *p = _find(_root_of(key), key);
+    if(p == nullptr)
+        throw std::out_of_range("AVL_Tree out of range!");
+    return p->val;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+bool ConcurrentAVL_Tree<T,V,Compare,Allocator>::visit(const T &key, Func func) const
+{
+    ReadGuard guard(*this);
+    const Node *p = _find(_root_of(key), key);
+    if(p == nullptr)
+        return false;
+    func(p->val);
+    return true;
+}
+
+// The roots are all taken under one router version first, so a split
+// published meanwhile cannot make the walk miss or repeat keys.
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::for_each(Func func) const
+{
+    ReadGuard guard(*this);
+
+    std::vector<const Node*> roots;
+    while(true) {
+        const Router *router = _router.load();
+        roots.clear();
+        for(Partition *part : router->parts)
+            roots.push_back(part->root.load());
+        if(_router.load() == router)
+            break;
+    }
+
+    // nodes have no parent links, so the in-order walk keeps its own stack
+    std::vector<const Node*> stack;
+    for(const Node *p : roots) {
+        while(p != nullptr || !stack.empty()) {
+            for(; p != nullptr; p = p->left)
+                stack.push_back(p);
+            p = stack.back();
+            stack.pop_back();
+            func(p->key, p->val);
+            p = p->right;
+        }
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+int ConcurrentAVL_Tree<T,V,Compare,Allocator>::height() const
+{
+    ReadGuard guard(*this);
+    int ret = 0;
+    for(Partition *part : _router.load()->parts)
+        ret = std::max(ret, _height(part->root.load()));
+    return ret;
+}
+
+// A reader that loaded the epoch before a root swap pins a value no greater
+// than the epoch its retired nodes are tagged with, and its pin is visible
+// to the writer's scan; a reader pinned after the scan only sees the new root.
+template <typename T, typename V, typename Compare, typename Allocator>
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::ReadGuard::ReadGuard(const ConcurrentAVL_Tree &tree)
+{
+    size_t i = std::hash<std::thread::id>()(std::this_thread::get_id()) % reader_slots;
+    while(true) {
+        uint64_t epoch = tree._epoch.load();
+        uint64_t expected = 0;
+        if(tree._slots[i].pin.compare_exchange_strong(expected, epoch)) {
+            _slot = &tree._slots[i].pin;
+            return;
+        }
+
+        i = (i + 1) % reader_slots;
+        if(i == 0)
+            std::this_thread::yield();
+    }
+}
+
+// The node is listed before it is made, so an update that throws later
+// can destroy everything it built.
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+const typename ConcurrentAVL_Tree<T,V,Compare,Allocator>::Node *
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::_make(Update &u, TT&& key, VV&& val, const Node *l, const Node *r)
+{
+    u.created.push_back(nullptr);
+    u.created.back() = u.part->pool.create(std::forward<TT>(key), std::forward<VV>(val), l, r);
+    return u.created.back();
+}
+
+// Builds the node (key, val, l, r), rotating when the heights of l and r
+// differ by two. Children replaced by a rotation are retired.
+template <typename T, typename V, typename Compare, typename Allocator>
+const typename ConcurrentAVL_Tree<T,V,Compare,Allocator>::Node *
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::_balance(Update &u, const T &key, const V &val, const Node *l, const Node *r)
+{
+    int hl = _height(l), hr = _height(r);
+    if(hl > hr + 1) {
+        _retire(u, l);
+        if(_height(l->left) >= _height(l->right))
+            return _make(u, l->key, l->val, l->left, _make(u, key, val, l->right, r));
+
+        const Node *lr = l->right;
+        _retire(u, lr);
+        return _make(u, lr->key, lr->val, _make(u, l->key, l->val, l->left, lr->left), _make(u, key, val, lr->right, r));
+    }
+    if(hr > hl + 1) {
+        _retire(u, r);
+        if(_height(r->right) >= _height(r->left))
+            return _make(u, r->key, r->val, _make(u, key, val, l, r->left), r->right);
+
+        const Node *rl = r->left;
+        _retire(u, rl);
+        return _make(u, rl->key, rl->val, _make(u, key, val, l, rl->left), _make(u, r->key, r->val, rl->right, r->right));
+    }
+    return _make(u, key, val, l, r);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+const typename ConcurrentAVL_Tree<T,V,Compare,Allocator>::Node *
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::_insert(Update &u, const Node *p, TT&& key, VV&& val, bool assign)
+{
+    if(p == nullptr) {
+        u.delta = 1;
+        return _make(u, std::forward<TT>(key), std::forward<VV>(val), nullptr, nullptr);
+    }
+
+    if(_comp(key, p->key)) {
+        const Node *l = _insert<TT, VV>(u, p->left, std::forward<TT>(key), std::forward<VV>(val), assign);
+        if(l == p->left)
+            return p;
+        _retire(u, p);
+        return _balance(u, p->key, p->val, l, p->right);
+    }
+    if(_comp(p->key, key)) {
+        const Node *r = _insert<TT, VV>(u, p->right, std::forward<TT>(key), std::forward<VV>(val), assign);
+        if(r == p->right)
+            return p;
+        _retire(u, p);
+        return _balance(u, p->key, p->val, p->left, r);
+    }
+
+    if(!assign)
+        return p;
+    _retire(u, p);
+    return _make(u, p->key, std::forward<VV>(val), p->left, p->right);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+const typename ConcurrentAVL_Tree<T,V,Compare,Allocator>::Node *
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::_erase(Update &u, const Node *p, const T &key)
+{
+    if(p == nullptr)
+        return nullptr;
+
+    if(_comp(key, p->key)) {
+        const Node *l = _erase(u, p->left, key);
+        if(u.delta == 0)
+            return p;
+        _retire(u, p);
+        return _balance(u, p->key, p->val, l, p->right);
+    }
+    if(_comp(p->key, key)) {
+        const Node *r = _erase(u, p->right, key);
+        if(u.delta == 0)
+            return p;
+        _retire(u, p);
+        return _balance(u, p->key, p->val, p->left, r);
+    }
+
+    u.delta = -1;
+    _retire(u, p);
+    if(p->left == nullptr)
+        return p->right;
+    if(p->right == nullptr)
+        return p->left;
+
+    const Node *m;
+    const Node *r = _erase_min(u, p->right, m);
+    return _balance(u, m->key, m->val, p->left, r);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+const typename ConcurrentAVL_Tree<T,V,Compare,Allocator>::Node *
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::_erase_min(Update &u, const Node *p, const Node *&min)
+{
+    _retire(u, p);
+    if(p->left == nullptr) {
+        min = p;
+        return p->right;
+    }
+    const Node *l = _erase_min(u, p->left, min);
+    return _balance(u, p->key, p->val, l, p->right);
+}
+
+// Same shape, nodes made in u's partition.
+template <typename T, typename V, typename Compare, typename Allocator>
+const typename ConcurrentAVL_Tree<T,V,Compare,Allocator>::Node *
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::_copy(Update &u, const Node *p)
+{
+    if(p == nullptr)
+        return nullptr;
+    const Node *l = _copy(u, p->left);
+    const Node *r = _copy(u, p->right);
+    return _make(u, p->key, p->val, l, r);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+const typename ConcurrentAVL_Tree<T,V,Compare,Allocator>::Node *
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::_find(const Node *p, const T &key) const
+{
+    while(p != nullptr) {
+        if(_comp(key, p->key))
+            p = p->left;
+        else if(_comp(p->key, key))
+            p = p->right;
+        else
+            return p;
+    }
+    return nullptr;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename ConcurrentAVL_Tree<T,V,Compare,Allocator>::Partition *
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::_route(const Router *router, const T &key) const
+{
+    return router->parts[std::upper_bound(router->bounds.begin(), router->bounds.end(), key, _comp) - router->bounds.begin()];
+}
+
+// A split stores the new router before it shrinks the old partition, so a
+// root that lost keys to a new partition is only ever seen together with a
+// router change, and the lookup is retried.
+template <typename T, typename V, typename Compare, typename Allocator>
+const typename ConcurrentAVL_Tree<T,V,Compare,Allocator>::Node *
+ConcurrentAVL_Tree<T,V,Compare,Allocator>::_root_of(const T &key) const
+{
+    while(true) {
+        const Router *router = _router.load();
+        const Node *root = _route(router, key)->root.load();
+        if(_router.load() == router)
+            return root;
+    }
+}
+
+// Runs func(u, root) on the partition of key under its mutex and publishes
+// the root it returns. The guard keeps the router and partition alive while
+// the writer waits for the mutex; once it holds it, the partition is checked
+// to still own the key. If func throws, the old root stays published and
+// everything func made is destroyed.
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::_update(const T &key, Func func)
+{
+    bool repartition;
+    {
+        ReadGuard guard(*this);
+        Partition *part;
+        std::unique_lock<std::mutex> lock;
+        while(true) {
+            part = _route(_router.load(), key);
+            lock = std::unique_lock<std::mutex>(part->mutex);
+            if(_route(_router.load(), key) == part)
+                break;
+            lock.unlock();
+        }
+
+        Update u(part);
+        const Node *root = part->root.load(std::memory_order_relaxed);
+        const Node *ret;
+        try {
+            ret = func(u, root);
+            part->limbo.reserve(part->limbo.size() + 1);
+        }
+        catch (...) {
+            _discard(u);
+            throw;
+        }
+
+        if(ret != root) {
+            part->root.store(ret);
+            part->size += u.delta;
+            _size += u.delta;
+            if(!u.retired.empty())
+                part->limbo.push_back({_epoch.fetch_add(1), std::move(u.retired)});
+        }
+        _reclaim(part);
+        repartition = part->size > partition_size || (part->size == 0 && u.delta < 0 && _router.load()->parts.size() > 1);
+    }
+
+    if(repartition)
+        _repartition(key);
+}
+
+// Splitting and dropping only keep the partitions small and few: the update
+// that triggered them has already been published, so a failure here is
+// left for a later update to retry.
+template <typename T, typename V, typename Compare, typename Allocator>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::_repartition(const T &key)
+{
+    std::lock_guard<std::mutex> router_lock(_router_mutex);
+    const Router *router = _router.load();
+    size_t i = std::upper_bound(router->bounds.begin(), router->bounds.end(), key, _comp) - router->bounds.begin();
+
+    std::unique_lock<std::mutex> lock(router->parts[i]->mutex);
+    try {
+        if(router->parts[i]->size > partition_size)
+            _split(router, i);
+        else if(router->parts[i]->size == 0 && router->parts.size() > 1)
+            _drop(router, i);
+    }
+    catch (...) {
+    }
+    lock.unlock();
+    _reclaim_routers();
+}
+
+// The root's left subtree plus the root stay, the right subtree is copied
+// into a new partition. The new partition and router are published before
+// the shrunk root, see _root_of().
+template <typename T, typename V, typename Compare, typename Allocator>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::_split(const Router *router, size_t i)
+{
+    Partition *part = router->parts[i];
+    const Node *root = part->root.load(std::memory_order_relaxed);
+
+    std::unique_ptr<Partition> next(new Partition(_alloc));
+    Update low(part), high(next.get());
+    std::unique_ptr<Router> split(new Router());
+    const Node *l;
+    try {
+        l = _insert(low, root->left, root->key, root->val, false);
+        next->root.store(_copy(high, root->right));
+
+        _retire(low, root);
+        std::vector<const Node*> stack(1, root->right);
+        while(!stack.empty()) {
+            const Node *p = stack.back();
+            stack.pop_back();
+            _retire(low, p);
+            if(p->left)
+                stack.push_back(p->left);
+            if(p->right)
+                stack.push_back(p->right);
+        }
+
+        const Node *first = root->right;
+        while(first->left != nullptr)
+            first = first->left;
+
+        split->bounds = router->bounds;
+        split->bounds.insert(split->bounds.begin() + i, first->key);
+        split->parts = router->parts;
+        split->parts.insert(split->parts.begin() + i + 1, next.get());
+        part->limbo.reserve(part->limbo.size() + 1);
+        _router_limbo.reserve(_router_limbo.size() + 1);
+    }
+    catch (...) {
+        _discard(low);
+        next->root.store(nullptr);
+        _discard(high);
+        throw;
+    }
+
+    next->size = high.created.size();
+    part->size -= next->size;
+    next.release();
+    _publish_router(split.release(), {});
+
+    part->root.store(l);
+    part->limbo.push_back({_epoch.fetch_add(1), std::move(low.retired)});
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::_drop(const Router *router, size_t i)
+{
+    std::unique_ptr<Router> dropped(new Router());
+    dropped->bounds = router->bounds;
+    dropped->bounds.erase(dropped->bounds.begin() + (i > 0 ? i - 1 : 0));
+    dropped->parts = router->parts;
+    dropped->parts.erase(dropped->parts.begin() + i);
+    std::vector<Partition*> gone(1, router->parts[i]);
+    _router_limbo.reserve(_router_limbo.size() + 1);
+
+    _publish_router(dropped.release(), std::move(gone));
+}
+
+// Needs _router_mutex and room for one more entry in _router_limbo.
+template <typename T, typename V, typename Compare, typename Allocator>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::_publish_router(const Router *router, std::vector<Partition*> &&gone)
+{
+    const Router *old = _router.load();
+    _router.store(router);
+    _router_limbo.push_back({_epoch.fetch_add(1), old, std::move(gone)});
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+uint64_t ConcurrentAVL_Tree<T,V,Compare,Allocator>::_oldest_pin() const
+{
+    uint64_t oldest = _epoch.load();
+    for(size_t i = 0; i < reader_slots; ++i) {
+        uint64_t pin = _slots[i].pin.load();
+        if(pin != 0 && pin < oldest)
+            oldest = pin;
+    }
+    return oldest;
+}
+
+// Frees every batch of part retired before the oldest epoch still pinned.
+template <typename T, typename V, typename Compare, typename Allocator>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::_reclaim(Partition *part)
+{
+    if(part->limbo.empty())
+        return;
+
+    uint64_t oldest = _oldest_pin();
+    size_t kept = 0;
+    for(auto &batch : part->limbo) {
+        if(batch.epoch < oldest) {
+            for(const Node *p : batch.nodes)
+                part->pool.destroy(const_cast<Node*>(p));
+        }
+        else {
+            // moving a vector onto itself would empty it
+            if(&part->limbo[kept] != &batch)
+                part->limbo[kept] = std::move(batch);
+            ++kept;
+        }
+    }
+    part->limbo.resize(kept);
+}
+
+// Needs _router_mutex.
+template <typename T, typename V, typename Compare, typename Allocator>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::_reclaim_routers()
+{
+    uint64_t oldest = _oldest_pin();
+    size_t kept = 0;
+    for(auto &retired : _router_limbo) {
+        if(retired.epoch < oldest) {
+            for(Partition *part : retired.parts)
+                delete part;
+            delete retired.router;
+        }
+        else {
+            // moving a vector onto itself would empty it
+            if(&_router_limbo[kept] != &retired)
+                _router_limbo[kept] = std::move(retired);
+            ++kept;
+        }
+    }
+    _router_limbo.resize(kept);
+}
+
+// Destroys the nodes of an update that was never published.
+template <typename T, typename V, typename Compare, typename Allocator>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::_discard(Update &u)
+{
+    for(const Node *p : u.created) {
+        if(p != nullptr)
+            u.part->pool.destroy(const_cast<Node*>(p));
+    }
+    u.created.clear();
+    u.retired.clear();
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void ConcurrentAVL_Tree<T,V,Compare,Allocator>::_free(NodePool<Node, node_allocator> &pool, const Node *p)
+{
+    std::vector<const Node*> stack;
+    if(p != nullptr)
+        stack.push_back(p);
+    while(!stack.empty()) {
+        p = stack.back();
+        stack.pop_back();
+        if(p->left)
+            stack.push_back(p->left);
+        if(p->right)
+            stack.push_back(p->right);
+        pool.destroy(const_cast<Node*>(p));
+    }
+}
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef CONCURRENT_PRIORITY_QUEUE_HPP
+#define CONCURRENT_PRIORITY_QUEUE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "priority_queue.hpp"
+
+
+// Multi-producer/multi-consumer max-queue built as a MultiQueue: entries are
+// spread over independently locked shards, each an ordinary PriorityQueue
+// backend. A pop locks two random shards and takes the better of their tops,
+// so it returns one of the highest entries rather than the highest one;
+// with a single shard the order is strict (and equal priorities stay FIFO).
+template <typename V, typename T=size_t, typename Compare = std::less<T>, typename Allocator = std::allocator<std::pair<const T, V>>,
+          typename Backend = DaryHeapBackend<4>>
+class ConcurrentPriorityQueue {
+public:
+    // Two shards per hardware thread keep lock collisions rare.
+    static size_t default_shards();
+
+    explicit ConcurrentPriorityQueue(size_t shards = default_shards(), const Compare &comp = Compare(), const Allocator &alloc = Allocator());
+
+    ConcurrentPriorityQueue(const ConcurrentPriorityQueue&) = delete;
+    ConcurrentPriorityQueue& operator=(const ConcurrentPriorityQueue&) = delete;
+
+    // Returns false once the queue is closed.
+    template <typename TT, typename VV>
+    bool try_push(TT&& priority, VV&& val);
+
+    // Moves a top entry to val; returns false when the queue looked empty.
+    bool try_pop(V &val);
+
+    // Blocks until an entry can be popped; returns false when the queue is
+    // closed and drained.
+    bool pop_wait(V &val);
+
+    // Rejects further pushes and wakes every pop_wait().
+    void close();
+
+    bool closed() const noexcept {return _closed.load();}
+    size_t shards() const noexcept {return _shards.size();}
+    bool strict() const noexcept {return _shards.size() == 1;}
+
+    // Exact only while no other thread touches the queue.
+    size_t size() const noexcept {return _size.load();}
+    bool empty() const noexcept {return _size.load() == 0;}
+
+private:
+    using queue_type = typename Backend::template queue<T,V,Compare,Allocator>;
+
+    // one cache line per shard so neighbouring locks do not false-share
+    struct alignas(64) Shard {
+        Shard(const Compare &comp, const Allocator &alloc) : queue(comp, alloc) {}
+
+        std::mutex mutex;
+        queue_type queue;
+    };
+
+    static size_t _random();
+
+    bool _pop_from(Shard &a, Shard &b, V &val);
+
+    std::vector<std::unique_ptr<Shard>> _shards;
+    Compare _comp;
+    std::atomic<size_t> _size;
+    std::atomic<bool> _closed;
+
+    std::mutex _wait_mutex;
+    std::condition_variable _wait;
+    std::atomic<size_t> _waiters;
+};
+
+
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
+size_t ConcurrentPriorityQueue<V,T,Compare,Allocator,Backend>::default_shards()
+{
+    size_t n = std::thread::hardware_concurrency();
+    return n == 0 ? 2 : 2 * n;
+}
+
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
+ConcurrentPriorityQueue<V,T,Compare,Allocator,Backend>::ConcurrentPriorityQueue(size_t shards, const Compare &comp, const Allocator &alloc):
+        _comp(comp),
+        _size(0),
+        _closed(false),
+        _waiters(0)
+{
+    if(shards == 0)
+        throw std::invalid_argument("ConcurrentPriorityQueue needs at least one shard");
+
+    _shards.reserve(shards);
+    for(size_t i = 0; i < shards; ++i)
+        _shards.push_back(std::make_unique<Shard>(comp, alloc));
+}
+
+// Goes for the first free shard starting from a random one and only blocks
+// when every shard is busy.
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
+template <typename TT, typename VV>
+bool ConcurrentPriorityQueue<V,T,Compare,Allocator,Backend>::try_push(TT&& priority, VV&& val)
+{
+    if(_closed.load())
+        return false;
+
+    size_t n = _shards.size();
+    size_t start = n == 1 ? 0 : _random() % n;
+    for(size_t i = 0; ; ++i) {
+        Shard &s = *_shards[(start + i) % n];
+        std::unique_lock<std::mutex> lock(s.mutex, std::defer_lock);
+        if(i + 1 < n) {
+            if(!lock.try_lock())
+                continue;
+        }
+        else {
+            lock.lock();
+        }
+
+        s.queue.push(std::forward<TT>(priority), std::forward<VV>(val));
+        ++_size;
+        break;
+    }
+
+    // pairs with the increment of _waiters in pop_wait(): one of the two
+    // sides always sees the other, so no wakeup is lost
+    if(_waiters.load() > 0) {
+        std::lock_guard<std::mutex> lock(_wait_mutex);
+        _wait.notify_one();
+    }
+    return true;
+}
+
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
+bool ConcurrentPriorityQueue<V,T,Compare,Allocator,Backend>::try_pop(V &val)
+{
+    size_t n = _shards.size();
+    if(n == 1)
+        return _pop_from(*_shards[0], *_shards[0], val);
+
+    // random two-choice attempts, then one sweep so that a nearly empty
+    // queue is not reported empty by bad luck
+    for(size_t attempt = 0; attempt < n && _size.load() > 0; ++attempt) {
+        size_t i = _random() % n, j = _random() % (n - 1);
+        if(j >= i)
+            ++j;
+        if(_pop_from(*_shards[i], *_shards[j], val))
+            return true;
+    }
+
+    for(size_t i = 0; i < n && _size.load() > 0; ++i) {
+        if(_pop_from(*_shards[i], *_shards[i], val))
+            return true;
+    }
+    return false;
+}
+
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
+bool ConcurrentPriorityQueue<V,T,Compare,Allocator,Backend>::pop_wait(V &val)
+{
+    while(true) {
+        if(try_pop(val))
+            return true;
+
+        std::unique_lock<std::mutex> lock(_wait_mutex);
+        ++_waiters;
+        _wait.wait(lock, [this](){return _size.load() > 0 || _closed.load();});
+        --_waiters;
+
+        if(_size.load() == 0 && _closed.load())
+            return false;
+    }
+}
+
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
+void ConcurrentPriorityQueue<V,T,Compare,Allocator,Backend>::close()
+{
+    std::lock_guard<std::mutex> lock(_wait_mutex);
+    _closed.store(true);
+    _wait.notify_all();
+}
+
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
+size_t ConcurrentPriorityQueue<V,T,Compare,Allocator,Backend>::_random()
+{
+    // xorshift, seeded per thread
+    thread_local size_t state = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Locks a and b (which may be the same shard) and pops from the one whose
+// top is higher.
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
+bool ConcurrentPriorityQueue<V,T,Compare,Allocator,Backend>::_pop_from(Shard &a, Shard &b, V &val)
+{
+    std::unique_lock<std::mutex> la(a.mutex, std::defer_lock), lb;
+    if(&a == &b) {
+        la.lock();
+    }
+    else {
+        lb = std::unique_lock<std::mutex>(b.mutex, std::defer_lock);
+        std::lock(la, lb);
+    }
+
+    queue_type *q;
+    if(a.queue.size() == 0)
+        q = &b.queue;
+    else if(b.queue.size() == 0 || !_comp(a.queue.top_priority(), b.queue.top_priority()))
+        q = &a.queue;
+    else
+        q = &b.queue;
+
+    if(q->size() == 0)
+        return false;
+
+    val = q->pop();
+    --_size;
+    return true;
+}
+
+#endif
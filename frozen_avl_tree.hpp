@@ -0,0 +1,237 @@
+#ifndef FROZEN_AVL_TREE_HPP
+#define FROZEN_AVL_TREE_HPP
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+
+// Immutable index over a sorted set of keys, laid out as an implicit B+-tree
+// (AVL_Tree::freeze() builds one). Keys sit in 64-byte blocks: the leaf layer
+// is the sorted key array itself, every upper layer holds the greatest key of
+// each child block, and a node's children are found by arithmetic instead of
+// pointers. A search reads one block per layer and picks the child by
+// counting the keys below the target without branching, which the compiler
+// turns into vector compares for arithmetic keys. Values are kept in a
+// separate array in key order, so ranks index both.
+template <typename T, typename V, typename Compare = std::less<T>>
+class FrozenAVL_Tree {
+public:
+    using key_type = T;
+    using mapped_type = V;
+    using key_compare = Compare;
+
+    // Keys per block: a cache line's worth, at least two.
+    static constexpr size_t block_keys = sizeof(T) * 2 > 64 ? 2 : 64 / sizeof(T);
+
+    explicit FrozenAVL_Tree(const Compare &comp = Compare()) : _size(0), _comp(comp) {}
+
+    // Builds the index from key/value pairs given in strictly increasing key
+    // order.
+    template <typename It>
+    static FrozenAVL_Tree from_sorted(It first, It last, const Compare &comp = Compare());
+
+    template <typename TT>
+    bool find(const TT &key) const {return _find(key) != _size;}
+
+    template <typename TT>
+    const V& get(const TT &key) const;
+
+    // Rank of the first key not less (greater) than key, or size().
+    template <typename TT>
+    size_t lower_bound(const TT &key) const;
+
+    template <typename TT>
+    size_t upper_bound(const TT &key) const;
+
+    // Number of keys in [lo, hi).
+    template <typename TT1, typename TT2>
+    size_t count_range(const TT1 &lo, const TT2 &hi) const;
+
+    // Calls func(key, val) for every entry in ascending key order.
+    template <typename Func>
+    void for_each(Func func) const {_scan(0, func, [](const T&){return true;});}
+
+    // Calls func(key, val) for every key in [lo, hi) in ascending order.
+    template <typename TT1, typename TT2, typename Func>
+    void for_each_in_range(const TT1 &lo, const TT2 &hi, Func func) const;
+
+    const T& key_at(size_t i) const {return _blocks[_leaves + i / block_keys].keys[i % block_keys];}
+    const V& value_at(size_t i) const {return _vals[i];}
+
+    size_t size() const noexcept {return _size;}
+    bool empty() const noexcept {return _size == 0;}
+
+    // Number of block layers, leaves included.
+    size_t depth() const noexcept {return _offsets.size();}
+
+    key_compare key_comp() const {return _comp;}
+
+private:
+    struct alignas(64) Block {
+        T keys[block_keys];
+    };
+
+    // Rank of the first key for which before(key) is false; before must be
+    // monotone over the sorted keys.
+    template <typename Before>
+    size_t _descend(Before before) const;
+
+    template <typename Before>
+    static size_t _count(const Block &block, Before before);
+
+    template <typename TT>
+    size_t _find(const TT &key) const;
+
+    template <typename Func, typename Keep>
+    void _scan(size_t from, Func func, Keep keep) const;
+
+    // Layers are stored root first; _offsets[l] is where layer l starts and
+    // the leaves start at _leaves.
+    std::vector<Block> _blocks;
+    std::vector<size_t> _offsets;
+    std::vector<V> _vals;
+    size_t _size;
+    size_t _leaves = 0;
+    Compare _comp;
+};
+
+
+template <typename T, typename V, typename Compare>
+template <typename It>
+FrozenAVL_Tree<T,V,Compare> FrozenAVL_Tree<T,V,Compare>::from_sorted(It first, It last, const Compare &comp)
+{
+    FrozenAVL_Tree ret(comp);
+    std::vector<T> keys;
+    for(; first != last; ++first) {
+        auto &&kv = *first;
+        if(!keys.empty() && !comp(keys.back(), std::get<0>(kv)))
+            throw std::runtime_error("AVL_Tree sorted input is not strictly increasing");
+        keys.push_back(std::get<0>(kv));
+        ret._vals.push_back(std::get<1>(kv));
+    }
+
+    size_t n = keys.size();
+    ret._size = n;
+    if(n == 0)
+        return ret;
+
+    // layer sizes from the leaves up, until a single root block
+    std::vector<size_t> counts = {(n + block_keys - 1) / block_keys};
+    while(counts.back() > 1)
+        counts.push_back((counts.back() + block_keys - 1) / block_keys);
+
+    std::vector<size_t> offsets(counts.size());
+    size_t total = 0;
+    for(size_t l = counts.size(); l-- > 0; ) {
+        offsets[l] = total;
+        total += counts[l];
+    }
+    ret._blocks.resize(total);
+    ret._leaves = offsets[0];
+    ret._offsets.assign(offsets.rbegin(), offsets.rend());
+
+    // padding repeats the greatest key, which no search goes past
+    const T max = keys.back();
+    for(size_t i = 0; i < counts[0] * block_keys; ++i)
+        ret._blocks[offsets[0] + i / block_keys].keys[i % block_keys] = i < n ? std::move(keys[i]) : max;
+
+    for(size_t l = 1; l < counts.size(); ++l) {
+        for(size_t i = 0; i < counts[l] * block_keys; ++i) {
+            const Block &child = ret._blocks[offsets[l - 1] + std::min(i, counts[l - 1] - 1)];
+            ret._blocks[offsets[l] + i / block_keys].keys[i % block_keys] = child.keys[block_keys - 1];
+        }
+    }
+    return ret;
+}
+
+template <typename T, typename V, typename Compare>
+template <typename TT>
+const V& FrozenAVL_Tree<T,V,Compare>::get(const TT &key) const
+{
+    size_t i = _find(key);
+    if(i == _size)
+        throw std::out_of_range("AVL_Tree out of range!");
+    return _vals[i];
+}
+
+template <typename T, typename V, typename Compare>
+template <typename TT>
+size_t FrozenAVL_Tree<T,V,Compare>::lower_bound(const TT &key) const
+{
+    return _descend([this, &key](const T &k){return _comp(k, key);});
+}
+
+template <typename T, typename V, typename Compare>
+template <typename TT>
+size_t FrozenAVL_Tree<T,V,Compare>::upper_bound(const TT &key) const
+{
+    return _descend([this, &key](const T &k){return !_comp(key, k);});
+}
+
+template <typename T, typename V, typename Compare>
+template <typename TT1, typename TT2>
+size_t FrozenAVL_Tree<T,V,Compare>::count_range(const TT1 &lo, const TT2 &hi) const
+{
+    size_t l = lower_bound(lo), h = lower_bound(hi);
+    return h > l ? h - l : 0;
+}
+
+template <typename T, typename V, typename Compare>
+template <typename TT1, typename TT2, typename Func>
+void FrozenAVL_Tree<T,V,Compare>::for_each_in_range(const TT1 &lo, const TT2 &hi, Func func) const
+{
+    _scan(lower_bound(lo), func, [this, &hi](const T &k){return _comp(k, hi);});
+}
+
+// Separators are the greatest key of each child, so the child holding the
+// answer is the first one whose separator is not before the target. Only
+// the root needs a bound check: below it the answer is always in range.
+template <typename T, typename V, typename Compare>
+template <typename Before>
+size_t FrozenAVL_Tree<T,V,Compare>::_descend(Before before) const
+{
+    if(_size == 0 || before(key_at(_size - 1)))
+        return _size;
+
+    size_t b = 0;
+    for(size_t l = 0; l + 1 < _offsets.size(); ++l)
+        b = b * block_keys + _count(_blocks[_offsets[l] + b], before);
+    return b * block_keys + _count(_blocks[_leaves + b], before);
+}
+
+template <typename T, typename V, typename Compare>
+template <typename Before>
+size_t FrozenAVL_Tree<T,V,Compare>::_count(const Block &block, Before before)
+{
+    size_t c = 0;
+    for(size_t i = 0; i < block_keys; ++i)
+        c += before(block.keys[i]);
+    return c;
+}
+
+template <typename T, typename V, typename Compare>
+template <typename TT>
+size_t FrozenAVL_Tree<T,V,Compare>::_find(const TT &key) const
+{
+    size_t i = lower_bound(key);
+    return i < _size && !_comp(key, key_at(i)) ? i : _size;
+}
+
+template <typename T, typename V, typename Compare>
+template <typename Func, typename Keep>
+void FrozenAVL_Tree<T,V,Compare>::_scan(size_t from, Func func, Keep keep) const
+{
+    for(size_t i = from; i < _size; ++i) {
+        const T &key = key_at(i);
+        if(!keep(key))
+            return;
+        func(key, _vals[i]);
+    }
+}
+
+#endif
@@ -50,8 +50,32 @@ int main() {
             {"avl_tree_map", test_avl_tree_map},
             {"avl_tree_where", test_avl_tree_where},
             {"avl_tree_reduce", test_avl_tree_reduce},
-
-            {"priority_queue", test_priority_queue}
+            {"avl_tree_view", test_avl_tree_view},
+            {"avl_tree_parallel", test_avl_tree_parallel},
+            {"avl_tree_pool", test_avl_tree_pool},
+            {"avl_tree_iterators", test_avl_tree_iterators},
+            {"avl_tree_range", test_avl_tree_range},
+            {"avl_tree_pop", test_avl_tree_pop},
+            {"avl_tree_stats", test_avl_tree_stats},
+            {"avl_tree_find_many", test_avl_tree_find_many},
+            {"avl_tree_order_statistics", test_avl_tree_order_statistics},
+            {"avl_tree_set_operations", test_avl_tree_set_operations},
+            {"avl_tree_degenerate", test_avl_tree_degenerate},
+            {"avl_tree_from_sorted", test_avl_tree_from_sorted},
+            {"avl_tree_serialization", test_avl_tree_serialization},
+            {"avl_tree_emplace", test_avl_tree_emplace},
+            {"avl_tree_compare", test_avl_tree_compare},
+            {"frozen_avl_tree", test_frozen_avl_tree},
+            {"compact_avl_tree", test_compact_avl_tree},
+            {"concurrent_avl_tree", test_concurrent_avl_tree},
+            {"persistent_avl_tree", test_persistent_avl_tree},
+            {"avl_tree_extract", test_avl_tree_extract},
+
+            {"priority_queue", test_priority_queue},
+            {"priority_queue_backends", test_priority_queue_backends},
+            {"priority_queue_batch", test_priority_queue_batch},
+            {"priority_queue_handles", test_priority_queue_handles},
+            {"concurrent_priority_queue", test_concurrent_priority_queue}
     };
 
     run_tests(functions, sizeof(functions) / sizeof (TestFunction<void>));
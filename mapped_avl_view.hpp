@@ -0,0 +1,196 @@
+#ifndef MAPPED_AVL_VIEW_HPP
+#define MAPPED_AVL_VIEW_HPP
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "avl_tree_format.hpp"
+
+
+// Read-only view of a file written by AVL_Tree::save(). The file is mapped
+// and queried in place: lookups binary-search the sorted key array, so
+// opening costs O(1) whatever the size and pages are faulted in on demand.
+// Compare must order keys as the tree that saved them did.
+// Built on mmap, so it is only available on POSIX systems.
+template <typename T, typename V, typename Compare = std::less<T>>
+class MappedAVL_View {
+    static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_copyable<V>::value,
+                  "MappedAVL_View needs trivially copyable keys and values");
+public:
+    explicit MappedAVL_View(const std::string &path, const Compare &comp = Compare());
+
+    MappedAVL_View(const MappedAVL_View&) = delete;
+    MappedAVL_View& operator=(const MappedAVL_View&) = delete;
+
+    MappedAVL_View(MappedAVL_View &&view) noexcept;
+    MappedAVL_View& operator=(MappedAVL_View &&view) noexcept;
+
+    ~MappedAVL_View() {_unmap();}
+
+    template <typename TT>
+    bool find(const TT &key) const {return _find(key) != _size;}
+
+    template <typename TT>
+    const V& get(const TT &key) const;
+
+    // Index of the first key not less (greater) than key, or size().
+    template <typename TT>
+    size_t lower_bound(const TT &key) const {return std::lower_bound(_keys, _keys + _size, key, _comp) - _keys;}
+
+    template <typename TT>
+    size_t upper_bound(const TT &key) const {return std::upper_bound(_keys, _keys + _size, key, _comp) - _keys;}
+
+    // Number of keys in [lo, hi).
+    template <typename TT1, typename TT2>
+    size_t count_range(const TT1 &lo, const TT2 &hi) const;
+
+    // Calls func(key, val) for every key in [lo, hi) in ascending order.
+    template <typename TT1, typename TT2, typename Func>
+    void for_each_in_range(const TT1 &lo, const TT2 &hi, Func func) const;
+
+    const T& key_at(size_t i) const {return _keys[i];}
+    const V& value_at(size_t i) const {return _values[i];}
+
+    size_t size() const noexcept {return _size;}
+
+private:
+    template <typename TT>
+    size_t _find(const TT &key) const;
+
+    void _unmap();
+
+    void *_data;
+    size_t _length;
+    const T *_keys;
+    const V *_values;
+    size_t _size;
+    Compare _comp;
+};
+
+
+template <typename T, typename V, typename Compare>
+MappedAVL_View<T,V,Compare>::MappedAVL_View(const std::string &path, const Compare &comp):
+        _data(nullptr),
+        _length(0),
+        _keys(nullptr),
+        _values(nullptr),
+        _size(0),
+        _comp(comp)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("AVL_Tree cannot open " + path);
+
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(AVL_FileHeader)) {
+        ::close(fd);
+        throw std::runtime_error("AVL_Tree bad file header");
+    }
+
+    _length = st.st_size;
+    _data = ::mmap(nullptr, _length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(_data == MAP_FAILED) {
+        _data = nullptr;
+        throw std::runtime_error("AVL_Tree cannot map " + path);
+    }
+
+    try {
+        const AVL_FileHeader &header = *static_cast<const AVL_FileHeader*>(_data);
+        header.validate<T, V>();
+        if(header.file_size > _length)
+            throw std::runtime_error("AVL_Tree file is truncated");
+
+        const char *base = static_cast<const char*>(_data);
+        _keys = reinterpret_cast<const T*>(base + header.keys_offset);
+        _values = reinterpret_cast<const V*>(base + header.values_offset);
+        _size = header.count;
+    }
+    catch (...) {
+        _unmap();
+        throw;
+    }
+}
+
+template <typename T, typename V, typename Compare>
+MappedAVL_View<T,V,Compare>::MappedAVL_View(MappedAVL_View &&view) noexcept:
+        _data(view._data),
+        _length(view._length),
+        _keys(view._keys),
+        _values(view._values),
+        _size(view._size),
+        _comp(std::move(view._comp))
+{
+    view._data = nullptr;
+    view._keys = nullptr;
+    view._values = nullptr;
+    view._length = view._size = 0;
+}
+
+template <typename T, typename V, typename Compare>
+MappedAVL_View<T,V,Compare>& MappedAVL_View<T,V,Compare>::operator=(MappedAVL_View &&view) noexcept
+{
+    if(this != &view) {
+        _unmap();
+        std::swap(_data, view._data);
+        std::swap(_length, view._length);
+        std::swap(_keys, view._keys);
+        std::swap(_values, view._values);
+        std::swap(_size, view._size);
+        std::swap(_comp, view._comp);
+    }
+    return *this;
+}
+
+template <typename T, typename V, typename Compare>
+template <typename TT>
+const V& MappedAVL_View<T,V,Compare>::get(const TT &key) const
+{
+    size_t i = _find(key);
+    if(i == _size)
+        throw std::out_of_range("AVL_Tree out of range!");
+    return _values[i];
+}
+
+template <typename T, typename V, typename Compare>
+template <typename TT1, typename TT2>
+size_t MappedAVL_View<T,V,Compare>::count_range(const TT1 &lo, const TT2 &hi) const
+{
+    size_t l = lower_bound(lo), h = lower_bound(hi);
+    return h > l ? h - l : 0;
+}
+
+template <typename T, typename V, typename Compare>
+template <typename TT1, typename TT2, typename Func>
+void MappedAVL_View<T,V,Compare>::for_each_in_range(const TT1 &lo, const TT2 &hi, Func func) const
+{
+    for(size_t i = lower_bound(lo); i < _size && _comp(_keys[i], hi); ++i)
+        func(_keys[i], _values[i]);
+}
+
+template <typename T, typename V, typename Compare>
+template <typename TT>
+size_t MappedAVL_View<T,V,Compare>::_find(const TT &key) const
+{
+    size_t i = lower_bound(key);
+    return i < _size && !_comp(key, _keys[i]) ? i : _size;
+}
+
+template <typename T, typename V, typename Compare>
+void MappedAVL_View<T,V,Compare>::_unmap()
+{
+    if(_data != nullptr)
+        ::munmap(_data, _length);
+    _data = nullptr;
+}
+
+#endif
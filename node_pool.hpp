@@ -0,0 +1,249 @@
+#ifndef NODE_POOL_HPP
+#define NODE_POOL_HPP
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <utility>
+
+#include "avl_tree_stats.hpp"
+
+
+// Slab allocator for fixed-size tree nodes.
+// Memory is requested from Allocator in growing slabs, freed nodes are kept
+// in an intrusive free list and reused, so steady-state churn never touches
+// the upstream allocator. release() gives all slabs back at once.
+template <typename Node, typename Allocator = std::allocator<Node>>
+class NodePool {
+private:
+    union Slot {
+        Slot *next;
+        alignas(Node) unsigned char storage[sizeof(Node)];
+    };
+
+    using slot_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Slot>;
+    using slot_traits = std::allocator_traits<slot_allocator>;
+    using slab_type = std::pair<Slot*, size_t>;
+    using slab_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<slab_type>;
+
+public:
+    static constexpr size_t min_slab = 32;
+    static constexpr size_t max_slab = 4096;
+
+    explicit NodePool(const Allocator &alloc = Allocator()) :
+            _alloc(alloc),
+            _slabs(slab_allocator(alloc)),
+            _free(nullptr),
+            _fresh(nullptr),
+            _fresh_end(nullptr),
+            _in_use(0)
+    {}
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    NodePool(NodePool &&pool) noexcept;
+    NodePool& operator=(NodePool &&pool) noexcept;
+
+    ~NodePool() {release();}
+
+    template <typename ...Args>
+    Node *create(Args&& ...args);
+
+    void destroy(Node *p);
+
+    void release();
+
+    void reserve(size_t n);
+
+    void swap(NodePool &pool) noexcept;
+
+    void splice(NodePool &pool);
+
+    Allocator get_allocator() const {return Allocator(_alloc);}
+
+    size_t in_use() const noexcept {return _in_use;}
+    size_t capacity() const noexcept;
+
+#ifdef AVL_TREE_STATS
+    // Nodes created and destroyed through this pool.
+    size_t created() const noexcept {return _created;}
+    size_t destroyed() const noexcept {return _destroyed;}
+    void reset_counts() noexcept {_created = _destroyed = 0;}
+#endif
+
+private:
+    Slot *_allocate_slot();
+
+    slot_allocator _alloc;
+    std::vector<slab_type, slab_allocator> _slabs;
+    Slot *_free;
+    Slot *_fresh, *_fresh_end;
+    size_t _in_use;
+#ifdef AVL_TREE_STATS
+    size_t _created = 0, _destroyed = 0;
+#endif
+};
+
+
+template <typename Node, typename Allocator>
+NodePool<Node, Allocator>::NodePool(NodePool &&pool) noexcept:
+        _alloc(std::move(pool._alloc)),
+        _slabs(std::move(pool._slabs)),
+        _free(pool._free),
+        _fresh(pool._fresh),
+        _fresh_end(pool._fresh_end),
+        _in_use(pool._in_use)
+{
+    pool._slabs.clear();
+    pool._free = pool._fresh = pool._fresh_end = nullptr;
+    pool._in_use = 0;
+    AVL_TREE_STAT(std::swap(_created, pool._created); std::swap(_destroyed, pool._destroyed);)
+}
+
+template <typename Node, typename Allocator>
+NodePool<Node, Allocator>& NodePool<Node, Allocator>::operator=(NodePool &&pool) noexcept
+{
+    if(this != &pool) {
+        release();
+        swap(pool);
+    }
+    return *this;
+}
+
+template <typename Node, typename Allocator>
+template <typename ...Args>
+Node *NodePool<Node, Allocator>::create(Args&& ...args)
+{
+    Slot *s = _allocate_slot();
+    Node *p;
+    try {
+        p = ::new (static_cast<void*>(s->storage)) Node(std::forward<Args>(args)...);
+    }
+    catch (...) {
+        s->next = _free;
+        _free = s;
+        throw;
+    }
+
+    ++_in_use;
+    AVL_TREE_STAT(++_created;)
+    return p;
+}
+
+template <typename Node, typename Allocator>
+void NodePool<Node, Allocator>::destroy(Node *p)
+{
+    p->~Node();
+
+    Slot *s = reinterpret_cast<Slot*>(p);
+    s->next = _free;
+    _free = s;
+    --_in_use;
+    AVL_TREE_STAT(++_destroyed;)
+}
+
+template <typename Node, typename Allocator>
+void NodePool<Node, Allocator>::release()
+{
+    for(auto &slab : _slabs)
+        slot_traits::deallocate(_alloc, slab.first, slab.second);
+
+    _slabs.clear();
+    _free = _fresh = _fresh_end = nullptr;
+    _in_use = 0;
+}
+
+// Makes sure the next n creations need no further upstream allocation,
+// taking them from one slab (slots left in the current one go to the free list).
+template <typename Node, typename Allocator>
+void NodePool<Node, Allocator>::reserve(size_t n)
+{
+    if(static_cast<size_t>(_fresh_end - _fresh) >= n)
+        return;
+
+    for(; _fresh != _fresh_end; ++_fresh) {
+        _fresh->next = _free;
+        _free = _fresh;
+    }
+
+    _slabs.reserve(_slabs.size() + 1);
+    _fresh = slot_traits::allocate(_alloc, n);
+    _fresh_end = _fresh + n;
+    _slabs.emplace_back(_fresh, n);
+}
+
+template <typename Node, typename Allocator>
+void NodePool<Node, Allocator>::swap(NodePool &pool) noexcept
+{
+    using std::swap;
+    swap(_alloc, pool._alloc);
+    swap(_slabs, pool._slabs);
+    swap(_free, pool._free);
+    swap(_fresh, pool._fresh);
+    swap(_fresh_end, pool._fresh_end);
+    swap(_in_use, pool._in_use);
+    AVL_TREE_STAT(swap(_created, pool._created); swap(_destroyed, pool._destroyed);)
+}
+
+// Takes over all slabs of pool, so nodes created by it may be destroyed
+// through this one. Both pools must use equal allocators.
+template <typename Node, typename Allocator>
+void NodePool<Node, Allocator>::splice(NodePool &pool)
+{
+    if(this == &pool)
+        return;
+    if(_alloc != pool._alloc)
+        throw std::invalid_argument("NodePool splice with unequal allocators");
+
+    _slabs.reserve(_slabs.size() + pool._slabs.size());
+    _slabs.insert(_slabs.end(), pool._slabs.begin(), pool._slabs.end());
+
+    for(; pool._fresh != pool._fresh_end; ++pool._fresh) {
+        pool._fresh->next = pool._free;
+        pool._free = pool._fresh;
+    }
+    while(pool._free != nullptr) {
+        Slot *s = pool._free;
+        pool._free = s->next;
+        s->next = _free;
+        _free = s;
+    }
+
+    _in_use += pool._in_use;
+    pool._slabs.clear();
+    pool._fresh = pool._fresh_end = nullptr;
+    pool._in_use = 0;
+}
+
+template <typename Node, typename Allocator>
+size_t NodePool<Node, Allocator>::capacity() const noexcept
+{
+    size_t ret = 0;
+    for(const auto &slab : _slabs)
+        ret += slab.second;
+    return ret;
+}
+
+template <typename Node, typename Allocator>
+typename NodePool<Node, Allocator>::Slot *NodePool<Node, Allocator>::_allocate_slot()
+{
+    if(_free != nullptr) {
+        Slot *s = _free;
+        _free = s->next;
+        return s;
+    }
+
+    if(_fresh == _fresh_end) {
+        size_t n = _slabs.empty() ? min_slab : std::min(_slabs.back().second * 2, max_slab);
+        _slabs.reserve(_slabs.size() + 1);
+        _fresh = slot_traits::allocate(_alloc, n);
+        _fresh_end = _fresh + n;
+        _slabs.emplace_back(_fresh, n);
+    }
+
+    return _fresh++;
+}
+
+#endif
@@ -0,0 +1,513 @@
+#ifndef PERSISTENT_AVL_TREE_HPP
+#define PERSISTENT_AVL_TREE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+// AVL tree whose copies share structure. Nodes are reference counted: a copy
+// (or snapshot(), or subtree()) only takes a reference to the root, and an
+// update copies just the nodes on its path that are shared with another
+// tree, O(log n) per update; nodes owned by this tree alone change in place.
+// Distinct trees sharing nodes may be used from different threads.
+template <typename T, typename V, typename Compare = std::less<T>, typename Allocator = std::allocator<std::pair<const T, V>>>
+class PersistentAVL_Tree {
+public:
+    using key_type = T;
+    using mapped_type = V;
+    using key_compare = Compare;
+    using allocator_type = Allocator;
+
+    PersistentAVL_Tree() : _root(nullptr) {}
+    explicit PersistentAVL_Tree(const Compare &comp, const Allocator &alloc = Allocator()) :
+            _root(nullptr), _comp(comp), _alloc(alloc) {}
+
+    PersistentAVL_Tree(const PersistentAVL_Tree &Tree) noexcept;
+    // Shares the nodes of Tree when the allocators are equal (after
+    // propagation), copies them otherwise.
+    PersistentAVL_Tree& operator=(const PersistentAVL_Tree &Tree);
+
+    PersistentAVL_Tree(PersistentAVL_Tree &&Tree) noexcept;
+    PersistentAVL_Tree& operator=(PersistentAVL_Tree &&Tree) noexcept(_takes_nodes_on_move);
+
+    ~PersistentAVL_Tree() {_release(_root);}
+
+    template <typename It>
+    static PersistentAVL_Tree from_sorted(It first, It last, const Compare &comp = Compare(), const Allocator &alloc = Allocator());
+
+    // O(1): the returned tree shares every node with this one.
+    PersistentAVL_Tree snapshot() const noexcept {return *this;}
+
+    template <typename TT, typename VV>
+    void insert(TT&& key, VV&& val);
+
+    // Returns true when the key was inserted, false when it was assigned.
+    template <typename TT, typename VV>
+    bool insert_or_assign(TT&& key, VV&& val);
+
+    void erase(const T &key);
+
+    void clear() noexcept {_release(_root); _root = nullptr;}
+
+    // The reference stays valid until this tree is next modified.
+    const V& get(const T &key) const;
+
+    bool find(const T &key) const {return _find(key) != nullptr;}
+
+    // O(1) view of the subtree rooted at key, sharing its nodes.
+    PersistentAVL_Tree subtree(const T &key) const;
+
+    template <typename Func>
+    void for_each(Func func) const;
+
+    size_t size() const noexcept {return _count(_root);}
+    int height() const noexcept {return _height(_root);}
+
+    key_compare key_comp() const {return _comp;}
+    allocator_type get_allocator() const {return allocator_type(_alloc);}
+
+private:
+    struct Node {
+        template <typename TT, typename VV>
+        Node(TT&& k, VV&& v):
+                key(std::forward<TT>(k)),
+                val(std::forward<VV>(v)),
+                height(1),
+                count(1),
+                left(nullptr),
+                right(nullptr),
+                refs(1)
+        {}
+
+        T key;
+        V val;
+        int height;
+        size_t count;
+        Node *left, *right;
+        std::atomic<size_t> refs;
+    };
+
+    using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using node_traits = std::allocator_traits<node_allocator>;
+
+    static constexpr bool _takes_nodes_on_move = node_traits::propagate_on_container_move_assignment::value || node_traits::is_always_equal::value;
+
+    template <typename TT, typename VV>
+    Node *_create(TT&& key, VV&& val);
+
+    static Node *_acquire(Node *p) {if(p) p->refs.fetch_add(1, std::memory_order_relaxed); return p;}
+    void _release(Node *p);
+
+    Node *_unique(Node *p);
+
+    static int _height(const Node *p) {return p ? p->height : 0;}
+    static size_t _count(const Node *p) {return p ? p->count : 0;}
+    static void _fixheight(Node *p);
+
+    Node *_rotate_right(Node *p);
+    Node *_rotate_left(Node *q);
+    Node *_balance(Node *p);
+
+    template <typename TT, typename VV>
+    Node *_insert(Node *p, TT&& key, VV&& val, bool &inserted);
+
+    Node *_erase(Node *p, const T &key);
+    Node *_erase_min(Node *p, Node *&min);
+
+    template <typename Src>
+    Node *_build(size_t n, Src &src);
+
+    Node *_copy(const Node *p);
+
+    Node *_find(const T &key) const;
+
+    Node *_root;
+    Compare _comp;
+    node_allocator _alloc;
+};
+
+
+template <typename T, typename V, typename Compare, typename Allocator>
+PersistentAVL_Tree<T,V,Compare,Allocator>::PersistentAVL_Tree(const PersistentAVL_Tree &Tree) noexcept:
+        _root(_acquire(Tree._root)),
+        _comp(Tree._comp),
+        _alloc(Tree._alloc)
+{}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+PersistentAVL_Tree<T,V,Compare,Allocator>& PersistentAVL_Tree<T,V,Compare,Allocator>::operator=(const PersistentAVL_Tree &Tree)
+{
+    // a node is freed by whichever tree drops it last, so trees may only
+    // share nodes when their allocators can free each other's memory
+    Node *root;
+    if(node_traits::propagate_on_container_copy_assignment::value || _alloc == Tree._alloc)
+        root = _acquire(Tree._root);
+    else
+        root = _copy(Tree._root);
+
+    _release(_root);
+    _root = root;
+    _comp = Tree._comp;
+    if constexpr (node_traits::propagate_on_container_copy_assignment::value)
+        _alloc = Tree._alloc;
+    return *this;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+PersistentAVL_Tree<T,V,Compare,Allocator>::PersistentAVL_Tree(PersistentAVL_Tree &&Tree) noexcept:
+        _root(Tree._root),
+        _comp(std::move(Tree._comp)),
+        _alloc(std::move(Tree._alloc))
+{
+    Tree._root = nullptr;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+PersistentAVL_Tree<T,V,Compare,Allocator>& PersistentAVL_Tree<T,V,Compare,Allocator>::operator=(PersistentAVL_Tree &&Tree) noexcept(_takes_nodes_on_move)
+{
+    if(this == &Tree)
+        return *this;
+
+    if(!_takes_nodes_on_move && _alloc != Tree._alloc) {
+        // the nodes may be shared with other trees, so they are copied, not moved from
+        Node *root = _copy(Tree._root);
+        _release(_root);
+        _root = root;
+        _comp = std::move(Tree._comp);
+        Tree.clear();
+        return *this;
+    }
+
+    _release(_root);
+    _root = Tree._root;
+    _comp = std::move(Tree._comp);
+    if constexpr (node_traits::propagate_on_container_move_assignment::value)
+        _alloc = std::move(Tree._alloc);
+    Tree._root = nullptr;
+    return *this;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename It>
+PersistentAVL_Tree<T,V,Compare,Allocator> PersistentAVL_Tree<T,V,Compare,Allocator>::from_sorted(It first, It last, const Compare &comp, const Allocator &alloc)
+{
+    PersistentAVL_Tree ret(comp, alloc);
+    std::vector<typename std::iterator_traits<It>::value_type> buf(first, last);
+
+    auto it = std::make_move_iterator(buf.begin());
+    Node *prev = nullptr;
+    auto src = [&ret, &it, &prev](){
+        auto &&kv = *it;
+        if(prev != nullptr && !ret._comp(prev->key, std::get<0>(kv)))
+            throw std::runtime_error("AVL_Tree sorted input is not strictly increasing");
+        prev = ret._create(std::get<0>(std::move(kv)), std::get<1>(std::move(kv)));
+        ++it;
+        return prev;
+    };
+
+    ret._root = ret._build(buf.size(), src);
+    return ret;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+void PersistentAVL_Tree<T,V,Compare,Allocator>::insert(TT&& key, VV&& val)
+{
+    if(_find(key) != nullptr)
+        throw std::runtime_error("AVL_Tree trying to insert by existing key");
+
+    bool inserted;
+    _root = _insert<TT, VV>(_root, std::forward<TT>(key), std::forward<VV>(val), inserted);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+bool PersistentAVL_Tree<T,V,Compare,Allocator>::insert_or_assign(TT&& key, VV&& val)
+{
+    bool inserted = false;
+    _root = _insert<TT, VV>(_root, std::forward<TT>(key), std::forward<VV>(val), inserted);
+    return inserted;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void PersistentAVL_Tree<T,V,Compare,Allocator>::erase(const T &key)
+{
+    if(_find(key) == nullptr)
+        throw std::out_of_range("AVL_Tree out of range!");
+
+    _root = _erase(_root, key);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+const V& PersistentAVL_Tree<T,V,Compare,Allocator>::get(const T &key) const
+{
+    Node *p = _find(key);
+    if(p == nullptr)
+        throw std::out_of_range("AVL_Tree out of range!");
+    return p->val;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+PersistentAVL_Tree<T,V,Compare,Allocator> PersistentAVL_Tree<T,V,Compare,Allocator>::subtree(const T &key) const
+{
+    PersistentAVL_Tree ret(_comp, get_allocator());
+    ret._root = _acquire(_find(key));
+    return ret;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void PersistentAVL_Tree<T,V,Compare,Allocator>::for_each(Func func) const
+{
+    std::vector<const Node*> stack;
+    const Node *p = _root;
+    while(p != nullptr || !stack.empty()) {
+        for(; p != nullptr; p = p->left)
+            stack.push_back(p);
+        p = stack.back();
+        stack.pop_back();
+        func(p->key, p->val);
+        p = p->right;
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *PersistentAVL_Tree<T,V,Compare,Allocator>::_create(TT&& key, VV&& val)
+{
+    Node *p = node_traits::allocate(_alloc, 1);
+    try {
+        node_traits::construct(_alloc, p, std::forward<TT>(key), std::forward<VV>(val));
+    }
+    catch (...) {
+        node_traits::deallocate(_alloc, p, 1);
+        throw;
+    }
+    return p;
+}
+
+// Drops one reference; nodes that reach zero are destroyed and drop their
+// children in turn.
+template <typename T, typename V, typename Compare, typename Allocator>
+void PersistentAVL_Tree<T,V,Compare,Allocator>::_release(Node *p)
+{
+    std::vector<Node*> stack;
+    while(p != nullptr) {
+        if(p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if(p->left)
+                stack.push_back(p->left);
+            if(p->right)
+                stack.push_back(p->right);
+            node_traits::destroy(_alloc, p);
+            node_traits::deallocate(_alloc, p, 1);
+        }
+
+        if(stack.empty())
+            break;
+        p = stack.back();
+        stack.pop_back();
+    }
+}
+
+// Takes an owned reference to p and returns a node that only this tree
+// references: p itself if nothing else holds it, a copy otherwise.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *PersistentAVL_Tree<T,V,Compare,Allocator>::_unique(Node *p)
+{
+    if(p->refs.load(std::memory_order_acquire) == 1)
+        return p;
+
+    Node *q = _create(p->key, p->val);
+    q->height = p->height;
+    q->count = p->count;
+    q->left = _acquire(p->left);
+    q->right = _acquire(p->right);
+    _release(p);
+    return q;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void PersistentAVL_Tree<T,V,Compare,Allocator>::_fixheight(Node *p)
+{
+    p->height = std::max(_height(p->left), _height(p->right)) + 1;
+    p->count = _count(p->left) + _count(p->right) + 1;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *PersistentAVL_Tree<T,V,Compare,Allocator>::_rotate_right(Node *p)
+{
+    Node *q = p->left = _unique(p->left);
+    p->left = q->right;
+    q->right = p;
+    _fixheight(p);
+    _fixheight(q);
+    return q;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *PersistentAVL_Tree<T,V,Compare,Allocator>::_rotate_left(Node *q)
+{
+    Node *p = q->right = _unique(q->right);
+    q->right = p->left;
+    p->left = q;
+    _fixheight(q);
+    _fixheight(p);
+    return p;
+}
+
+// p must be unique; children are made unique before a rotation touches them.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *PersistentAVL_Tree<T,V,Compare,Allocator>::_balance(Node *p)
+{
+    _fixheight(p);
+    int factor = _height(p->right) - _height(p->left);
+    if(factor == 2) {
+        if(_height(p->right->right) < _height(p->right->left)) {
+            p->right = _unique(p->right);
+            p->right = _rotate_right(p->right);
+        }
+        return _rotate_left(p);
+    }
+    if(factor == -2) {
+        if(_height(p->left->left) < _height(p->left->right)) {
+            p->left = _unique(p->left);
+            p->left = _rotate_left(p->left);
+        }
+        return _rotate_right(p);
+    }
+    return p;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *
+PersistentAVL_Tree<T,V,Compare,Allocator>::_insert(Node *p, TT&& key, VV&& val, bool &inserted)
+{
+    if(p == nullptr) {
+        inserted = true;
+        return _create(std::forward<TT>(key), std::forward<VV>(val));
+    }
+
+    p = _unique(p);
+    if(_comp(key, p->key)) {
+        p->left = _insert<TT, VV>(p->left, std::forward<TT>(key), std::forward<VV>(val), inserted);
+    }
+    else if(_comp(p->key, key)) {
+        p->right = _insert<TT, VV>(p->right, std::forward<TT>(key), std::forward<VV>(val), inserted);
+    }
+    else {
+        p->val = std::forward<VV>(val);
+        return p;
+    }
+    return _balance(p);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *
+PersistentAVL_Tree<T,V,Compare,Allocator>::_erase(Node *p, const T &key)
+{
+    p = _unique(p);
+    if(_comp(key, p->key)) {
+        p->left = _erase(p->left, key);
+        return _balance(p);
+    }
+    if(_comp(p->key, key)) {
+        p->right = _erase(p->right, key);
+        return _balance(p);
+    }
+
+    Node *l = p->left, *r = p->right;
+    p->left = p->right = nullptr;
+    _release(p);
+    if(r == nullptr)
+        return l;
+
+    Node *m;
+    r = _erase_min(r, m);
+    m->left = l;
+    m->right = r;
+    return _balance(m);
+}
+
+// Detaches the (now unique) minimum node of p into min.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *
+PersistentAVL_Tree<T,V,Compare,Allocator>::_erase_min(Node *p, Node *&min)
+{
+    p = _unique(p);
+    if(p->left == nullptr) {
+        Node *r = p->right;
+        p->right = nullptr;
+        min = p;
+        return r;
+    }
+    p->left = _erase_min(p->left, min);
+    return _balance(p);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Src>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *PersistentAVL_Tree<T,V,Compare,Allocator>::_build(size_t n, Src &src)
+{
+    if(n == 0)
+        return nullptr;
+
+    Node *left = _build(n / 2, src);
+    Node *p;
+    try {
+        p = src();
+    }
+    catch (...) {
+        _release(left);
+        throw;
+    }
+    p->left = left;
+    try {
+        p->right = _build(n - n / 2 - 1, src);
+    }
+    catch (...) {
+        _release(p);
+        throw;
+    }
+    _fixheight(p);
+    return p;
+}
+
+// Copies the entries of p into fresh nodes from this tree's allocator.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *PersistentAVL_Tree<T,V,Compare,Allocator>::_copy(const Node *p)
+{
+    std::vector<const Node*> stack;
+    auto src = [this, &p, &stack](){
+        for(; p != nullptr; p = p->left)
+            stack.push_back(p);
+        const Node *q = stack.back();
+        stack.pop_back();
+        p = q->right;
+        return _create(q->key, q->val);
+    };
+    return _build(_count(p), src);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+typename PersistentAVL_Tree<T,V,Compare,Allocator>::Node *PersistentAVL_Tree<T,V,Compare,Allocator>::_find(const T &key) const
+{
+    Node *p = _root;
+    while(p != nullptr) {
+        if(_comp(key, p->key))
+            p = p->left;
+        else if(_comp(p->key, key))
+            p = p->right;
+        else
+            return p;
+    }
+    return nullptr;
+}
+
+#endif
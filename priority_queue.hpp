@@ -2,53 +2,97 @@
 #define PRIORITY_QUEUE_HPP
 
 #include "avl_tree.hpp"
+#include "queue_backends.hpp"
 
 
-template <typename V, typename T=size_t>
+// Max-queue keyed by priority; equal priorities are popped first in, first out.
+// Backend picks the storage: AVL_Backend keeps the entries ordered,
+// DaryHeapBackend<D> and PairingHeapBackend are plain heaps.
+template <typename V, typename T=size_t, typename Compare = std::less<T>, typename Allocator = std::allocator<std::pair<const T, V>>,
+          typename Backend = AVL_Backend>
 class PriorityQueue {
 public:
+    using backend_type = typename Backend::template queue<T,V,Compare,Allocator>;
+    using handle = QueueHandle;
+
     PriorityQueue() = default;
-    PriorityQueue(const PriorityQueue<V,T> &queue);
+    explicit PriorityQueue(const Compare &comp, const Allocator &alloc = Allocator()) : _queue(comp, alloc) {}
+    explicit PriorityQueue(const Allocator &alloc) : _queue(Compare(), alloc) {}
+    PriorityQueue(const PriorityQueue &queue);
     PriorityQueue(PriorityQueue &&queue) noexcept;
 
+    PriorityQueue& operator=(const PriorityQueue &queue) = default;
+    PriorityQueue& operator=(PriorityQueue &&queue) = default;
+
     template <typename TT, typename VV>
-    void push(TT&& priority, VV&& val);
+    void push(TT&& priority, VV&& val) {_queue.push(std::forward<TT>(priority), std::forward<VV>(val));}
+
+    // Like push(), but returns a handle to the new entry for
+    // update_priority(), erase() and contains(). Only these entries take a
+    // slot in the backend's handle table.
+    template <typename TT, typename VV>
+    handle push_tracked(TT&& priority, VV&& val);
+
+    // Pushes every (priority, value) pair of [first, last); a large batch is
+    // merged in bulk instead of one descent per entry. These entries get no
+    // handles.
+    template <typename It>
+    void push_range(It first, It last) {_queue.push_range(first, last);}
+
+    V& top() {return _queue.top();}
+    const V& top() const {return _queue.top();}
+    const T& top_priority() const {return _queue.top_priority();}
+    V pop() {return _queue.pop();}
+
+    // Pops up to k values into out in priority order, returns the end of the output.
+    template <typename OutIt>
+    OutIt pop_n(size_t k, OutIt out) {return _queue.pop_n(k, out);}
+
+    // Moves the entry of h to a new priority in O(log n); among equal
+    // priorities it then counts as the latest push. The handle stays valid.
+    // A handle whose entry has left the queue throws std::out_of_range.
+    template <typename TT>
+    void update_priority(const handle &h, TT&& priority) {_queue.update_priority(h, std::forward<TT>(priority));}
+
+    // Removes the entry of h in O(log n) and returns its value.
+    V erase(const handle &h) {return _queue.erase(h);}
 
-    V& top() const {return _tree.find_max().second;}
-    V pop();
-    void clear() {_tree.clear();}
+    // Whether the entry of h is still in the queue.
+    bool contains(const handle &h) const noexcept {return _queue.contains(h);}
 
-    size_t size() const noexcept {return _tree.size();}
-    bool empty() const noexcept {return _tree.size() == 0;}
+    // Moves all entries of queue into this one, leaving it empty; handles
+    // to them are no longer valid.
+    void merge(PriorityQueue &queue) {_queue.merge(queue._queue);}
+
+    void clear() {_queue.clear();}
+
+    size_t size() const noexcept {return _queue.size();}
+    bool empty() const noexcept {return _queue.size() == 0;}
+
+    // Operation counters of the backend, see avl_tree_stats.hpp.
+    AVL_TreeStats stats() const {return _queue.stats();}
+    void reset_stats() noexcept {_queue.reset_stats();}
+
+    const backend_type& backend() const noexcept {return _queue;}
 private:
-    AVL_Tree<T,V> _tree;
+    backend_type _queue;
 };
 
-template <typename V, typename T>
-PriorityQueue<V,T>::PriorityQueue(const PriorityQueue<V,T> &queue):
-        _tree(queue._tree)
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
+PriorityQueue<V,T,Compare,Allocator,Backend>::PriorityQueue(const PriorityQueue &queue):
+        _queue(queue._queue)
 {}
 
-template <typename V, typename T>
-PriorityQueue<V,T>::PriorityQueue(PriorityQueue<V,T> &&queue) noexcept:
-        _tree(std::move(queue._tree))
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
+PriorityQueue<V,T,Compare,Allocator,Backend>::PriorityQueue(PriorityQueue &&queue) noexcept:
+        _queue(std::move(queue._queue))
 {}
 
-template <typename V, typename T>
+template <typename V, typename T, typename Compare, typename Allocator, typename Backend>
 template <typename TT, typename VV>
-void PriorityQueue<V,T>::push(TT &&priority, VV &&val)
+typename PriorityQueue<V,T,Compare,Allocator,Backend>::handle PriorityQueue<V,T,Compare,Allocator,Backend>::push_tracked(TT &&priority, VV &&val)
 {
-    _tree[std::forward<TT>(priority)] = std::forward<VV>(val);
-}
-
-template <typename V, typename T>
-V PriorityQueue<V,T>::pop()
-{
-    std::pair<const T&, V&> mx = _tree.find_max();
-    V ret(std::move(mx.second));
-    _tree.erase(mx.first);
-
-    return ret;
+    return _queue.push_tracked(std::forward<TT>(priority), std::forward<VV>(val));
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1120 @@
+#ifndef QUEUE_BACKENDS_HPP
+#define QUEUE_BACKENDS_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "avl_tree.hpp"
+#include "node_pool.hpp"
+
+// Storage backends for PriorityQueue. Each selector exposes
+// queue<T, V, Compare, Allocator> with the same interface:
+// push(priority, val) -> QueueHandle, push_range(first, last), top(),
+// top_priority(), pop(), pop_n(k, out), update_priority(h, priority),
+// erase(h), contains(h), merge(), clear(), size(), stats(), reset_stats().
+// The entry with the greatest priority according to Compare is on top;
+// entries with equal priorities come out in the order they were pushed.
+
+
+// Index into a queue's handle table; 32 bits so that it fits in the
+// padding after a small priority.
+using QueueSlot = uint32_t;
+
+// Priority tagged with the push sequence number. QueueKeyCompare orders
+// equal priorities so that the earlier push is the greater one. slot is
+// the entry's place in the queue's handle table, npos for entries without
+// a handle; it takes no part in the order.
+template <typename T>
+struct QueueKey {
+    static constexpr QueueSlot npos = static_cast<QueueSlot>(-1);
+
+    template <typename TT>
+    QueueKey(TT&& p, size_t s, QueueSlot sl = npos) : priority(std::forward<TT>(p)), slot(sl), seq(s) {}
+
+    T priority;
+    QueueSlot slot;
+    size_t seq;
+};
+
+template <typename T, typename Compare>
+struct QueueKeyCompare {
+    bool operator()(const QueueKey<T> &a, const QueueKey<T> &b) const
+    {
+        if(comp(a.priority, b.priority))
+            return true;
+        if(comp(b.priority, a.priority))
+            return false;
+        return a.seq > b.seq;
+    }
+
+    Compare comp;
+};
+
+
+// Handle to an entry, returned by push(). It refers to the entry until the
+// entry leaves the queue (popped, erased, cleared or merged into another
+// queue); after that contains() is false for it.
+struct QueueHandle {
+    QueueSlot slot;
+    uint32_t generation;
+};
+
+// Slot table behind the handles: every slot holds where its entry is (Ref
+// depends on the backend). Freed slots are reused through a free list and
+// their generation is bumped on every acquire and release, so it is odd
+// while the slot is taken and a handle to an earlier entry no longer
+// matches it (until the generation wraps around, 2^31 reuses later).
+template <typename Ref, typename Allocator>
+class QueueHandleTable {
+public:
+    static constexpr QueueSlot npos = static_cast<QueueSlot>(-1);
+
+    explicit QueueHandleTable(const Allocator &alloc = Allocator()) : _slots(slot_allocator(alloc)), _free(npos) {}
+
+    QueueHandle acquire(const Ref &ref);
+
+    // Frees a slot taken by acquire(); npos is ignored.
+    void release(QueueSlot slot);
+
+    // Slot of the entry h refers to; throws if h is stale.
+    QueueSlot find(const QueueHandle &h) const;
+
+    bool contains(const QueueHandle &h) const noexcept
+    {
+        return h.slot < _slots.size() && _slots[h.slot].generation == h.generation;
+    }
+
+    Ref& operator[](QueueSlot slot) {return _slots[slot].ref;}
+    const Ref& operator[](QueueSlot slot) const {return _slots[slot].ref;}
+
+    // Frees every slot.
+    void clear();
+
+private:
+    struct Slot {
+        Ref ref;
+        uint32_t generation;
+        QueueSlot next;
+    };
+
+    using slot_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Slot>;
+
+    std::vector<Slot, slot_allocator> _slots;
+    QueueSlot _free;
+};
+
+
+// Ordered AVL_Tree storage, for when the queue must also be walked in
+// priority order.
+struct AVL_Backend {
+    template <typename T, typename V, typename Compare, typename Allocator>
+    class queue {
+    public:
+        queue() : _seq(0) {}
+        explicit queue(const Compare &comp, const Allocator &alloc = Allocator()) :
+                _tree(key_compare{comp}, tree_allocator(alloc)), _seq(0), _handles(alloc) {}
+
+        template <typename TT, typename VV>
+        void push(TT&& priority, VV&& val);
+
+        template <typename TT, typename VV>
+        QueueHandle push_tracked(TT&& priority, VV&& val);
+
+        template <typename It>
+        void push_range(It first, It last);
+
+        V& top() {return _tree.find_max().second;}
+        const V& top() const {return _tree.find_max().second;}
+        const T& top_priority() const {return _tree.find_max().first.priority;}
+
+        V pop();
+
+        template <typename OutIt>
+        OutIt pop_n(size_t k, OutIt out);
+
+        template <typename TT>
+        void update_priority(const QueueHandle &h, TT&& priority);
+
+        V erase(const QueueHandle &h);
+        bool contains(const QueueHandle &h) const noexcept {return _handles.contains(h);}
+
+        void merge(queue &other);
+
+        void clear() {_tree.clear(); _handles.clear();}
+        size_t size() const noexcept {return _tree.size();}
+
+        AVL_TreeStats stats() const {return _tree.stats();}
+        void reset_stats() noexcept {_tree.reset_stats();}
+
+        // Calls func(priority, val) for every entry in pop order.
+        template <typename Func>
+        void for_each(Func func) const;
+
+    private:
+        using key_type = QueueKey<T>;
+        using key_compare = QueueKeyCompare<T, Compare>;
+        using tree_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<std::pair<const key_type, V>>;
+
+        AVL_Tree<key_type, V, key_compare, tree_allocator> _tree;
+        size_t _seq;
+        // a handled entry is found again by its priority and sequence number
+        QueueHandleTable<std::pair<T, size_t>, Allocator> _handles;
+    };
+};
+
+// Implicit array-based d-ary max-heap: no per-entry allocation and good
+// locality; a wider node trades more comparisons per level for fewer levels.
+template <size_t D = 4>
+struct DaryHeapBackend {
+    static_assert(D >= 2, "DaryHeapBackend needs at least two children per node");
+
+    template <typename T, typename V, typename Compare, typename Allocator>
+    class queue {
+    public:
+        queue() : _seq(0), _tracking(false) {}
+        explicit queue(const Compare &comp, const Allocator &alloc = Allocator()) :
+                _comp(QueueKeyCompare<T, Compare>{comp}), _heap(entry_allocator(alloc)), _seq(0), _handles(alloc), _tracking(false) {}
+
+        template <typename TT, typename VV>
+        void push(TT&& priority, VV&& val);
+
+        template <typename TT, typename VV>
+        QueueHandle push_tracked(TT&& priority, VV&& val);
+
+        template <typename It>
+        void push_range(It first, It last);
+
+        V& top() {_assert_empty(); return _heap.front().second;}
+        const V& top() const {_assert_empty(); return _heap.front().second;}
+        const T& top_priority() const {_assert_empty(); return _heap.front().first.priority;}
+
+        V pop();
+
+        template <typename OutIt>
+        OutIt pop_n(size_t k, OutIt out);
+
+        template <typename TT>
+        void update_priority(const QueueHandle &h, TT&& priority);
+
+        V erase(const QueueHandle &h);
+        bool contains(const QueueHandle &h) const noexcept {return _handles.contains(h);}
+
+        void merge(queue &other);
+
+        void clear() noexcept {_heap.clear(); _handles.clear(); _tracking = false;}
+        size_t size() const noexcept {return _heap.size();}
+
+        // Counts comparisons; entries live in one array, not in nodes.
+        AVL_TreeStats stats() const;
+        void reset_stats() noexcept {AVL_TREE_STAT(_comp.reset();)}
+
+    private:
+        using entry = std::pair<QueueKey<T>, V>;
+        using entry_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<entry>;
+
+        // Every move inside the heap goes through _set so that handled
+        // entries keep their position up to date once _track() has run.
+        void _set(size_t i, entry &&e);
+        void _track();
+        void _sift_up(size_t i);
+        void _sift_down(size_t i);
+        // Sifts the entry at i whichever way its key needs.
+        void _restore(size_t i);
+        void _heapify();
+        void _assert_empty() const;
+
+        AVL_TreeCompare<QueueKeyCompare<T, Compare>> _comp;
+        std::vector<entry, entry_allocator> _heap;
+        size_t _seq;
+        QueueHandleTable<size_t, Allocator> _handles;
+        // Positions are only kept from the first update_priority() or
+        // erase() on, so a queue that never uses them skips a scattered
+        // write for every entry a sift moves.
+        bool _tracking;
+    };
+};
+
+// Pairing heap over pooled nodes: O(1) push and merge, O(log n) amortized
+// pop. Nodes keep a back link (parent for a first child, left sibling
+// otherwise) so an entry can be cut out of the heap in place.
+struct PairingHeapBackend {
+    template <typename T, typename V, typename Compare, typename Allocator>
+    class queue {
+    public:
+        queue() : _root(nullptr), _size(0), _seq(0) {}
+        explicit queue(const Compare &comp, const Allocator &alloc = Allocator()) :
+                _root(nullptr), _size(0), _seq(0), _comp(QueueKeyCompare<T, Compare>{comp}), _pool(node_allocator(alloc)),
+                _handles(alloc) {}
+
+        queue(const queue &other);
+        queue(queue &&other) noexcept;
+        queue& operator=(queue other) noexcept {swap(other); return *this;}
+        ~queue() {clear();}
+
+        template <typename TT, typename VV>
+        void push(TT&& priority, VV&& val);
+
+        template <typename TT, typename VV>
+        QueueHandle push_tracked(TT&& priority, VV&& val);
+
+        template <typename It>
+        void push_range(It first, It last);
+
+        V& top() {_assert_empty(); return _root->val;}
+        const V& top() const {_assert_empty(); return _root->val;}
+        const T& top_priority() const {_assert_empty(); return _root->key.priority;}
+
+        V pop();
+
+        template <typename OutIt>
+        OutIt pop_n(size_t k, OutIt out);
+
+        template <typename TT>
+        void update_priority(const QueueHandle &h, TT&& priority);
+
+        V erase(const QueueHandle &h);
+        bool contains(const QueueHandle &h) const noexcept {return _handles.contains(h);}
+
+        void merge(queue &other);
+
+        void clear();
+        size_t size() const noexcept {return _size;}
+
+        AVL_TreeStats stats() const;
+        void reset_stats() noexcept {AVL_TREE_STAT(_comp.reset(); _pool.reset_counts();)}
+
+        void swap(queue &other) noexcept;
+
+    private:
+        struct Node {
+            template <typename TT, typename VV>
+            Node(TT&& p, size_t seq, QueueSlot slot, VV&& v):
+                    key{std::forward<TT>(p), seq, slot},
+                    val(std::forward<VV>(v)),
+                    child(nullptr),
+                    next(nullptr),
+                    prev(nullptr)
+            {}
+
+            QueueKey<T> key;
+            V val;
+            Node *child, *next, *prev;
+        };
+
+        using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+
+        Node *_meld(Node *a, Node *b);
+        Node *_merge_pairs(Node *first);
+        // Unlinks n together with its subtree; n must not be the root.
+        void _cut(Node *n);
+        // Takes n alone out of the heap, its children stay in.
+        void _detach(Node *n);
+        void _assert_empty() const;
+
+        Node *_root;
+        size_t _size;
+        size_t _seq;
+        AVL_TreeCompare<QueueKeyCompare<T, Compare>> _comp;
+        NodePool<Node, node_allocator> _pool;
+        QueueHandleTable<Node*, Allocator> _handles;
+    };
+};
+
+
+template <typename Ref, typename Allocator>
+QueueHandle QueueHandleTable<Ref,Allocator>::acquire(const Ref &ref)
+{
+    if(_free == npos) {
+        if(_slots.size() == npos)
+            throw std::length_error("PriorityQueue too many handles");
+        _slots.push_back(Slot{ref, 1, npos});
+        return {static_cast<QueueSlot>(_slots.size() - 1), 1};
+    }
+
+    QueueSlot slot = _free;
+    Slot &s = _slots[slot];
+    _free = s.next;
+    s.ref = ref;
+    ++s.generation;
+    return {slot, s.generation};
+}
+
+template <typename Ref, typename Allocator>
+void QueueHandleTable<Ref,Allocator>::release(QueueSlot slot)
+{
+    if(slot == npos)
+        return;
+
+    Slot &s = _slots[slot];
+    ++s.generation;
+    s.next = _free;
+    _free = slot;
+}
+
+template <typename Ref, typename Allocator>
+QueueSlot QueueHandleTable<Ref,Allocator>::find(const QueueHandle &h) const
+{
+    if(!contains(h))
+        throw std::out_of_range("PriorityQueue stale handle");
+    return h.slot;
+}
+
+template <typename Ref, typename Allocator>
+void QueueHandleTable<Ref,Allocator>::clear()
+{
+    _free = npos;
+    for(QueueSlot i = static_cast<QueueSlot>(_slots.size()); i-- > 0;) {
+        Slot &s = _slots[i];
+        if(s.generation % 2 == 1)
+            ++s.generation;
+        s.next = _free;
+        _free = i;
+    }
+}
+
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+void AVL_Backend::queue<T,V,Compare,Allocator>::push(TT&& priority, VV&& val)
+{
+    _tree.try_emplace(key_type{std::forward<TT>(priority), _seq}, std::forward<VV>(val));
+    ++_seq;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+QueueHandle AVL_Backend::queue<T,V,Compare,Allocator>::push_tracked(TT&& priority, VV&& val)
+{
+    QueueHandle h = _handles.acquire({priority, _seq});
+    try {
+        _tree.try_emplace(key_type{std::forward<TT>(priority), _seq, h.slot}, std::forward<VV>(val));
+    }
+    catch (...) {
+        _handles.release(h.slot);
+        throw;
+    }
+    ++_seq;
+    return h;
+}
+
+// A batch at least as large as the queue is sorted and merged with the
+// tree contents, then the tree is rebuilt in O(n); a smaller one is inserted.
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename It>
+void AVL_Backend::queue<T,V,Compare,Allocator>::push_range(It first, It last)
+{
+    std::vector<std::pair<key_type, V>> batch;
+    for(; first != last; ++first) {
+        auto &&e = *first;
+        batch.emplace_back(std::piecewise_construct,
+                           std::forward_as_tuple(std::get<0>(std::forward<decltype(e)>(e)), _seq++),
+                           std::forward_as_tuple(std::get<1>(std::forward<decltype(e)>(e))));
+    }
+
+    if(batch.size() < _tree.size()) {
+        for(auto &e : batch)
+            _tree.try_emplace(std::move(e.first), std::move(e.second));
+        return;
+    }
+
+    key_compare comp = _tree.key_comp();
+    std::sort(batch.begin(), batch.end(), [&comp](const std::pair<key_type, V> &a, const std::pair<key_type, V> &b){
+        return comp(a.first, b.first);
+    });
+
+    std::vector<std::pair<key_type, V>> merged;
+    merged.reserve(_tree.size() + batch.size());
+    auto b = batch.begin();
+    for(auto kv : _tree) {
+        for(; b != batch.end() && comp(b->first, kv.first); ++b)
+            merged.push_back(std::move(*b));
+        merged.emplace_back(kv.first, std::move(kv.second));
+    }
+    std::move(b, batch.end(), std::back_inserter(merged));
+
+    _tree.assign_sorted(std::make_move_iterator(merged.begin()), std::make_move_iterator(merged.end()));
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+V AVL_Backend::queue<T,V,Compare,Allocator>::pop()
+{
+    auto kv = _tree.pop_max();
+    _handles.release(kv.first.slot);
+    return std::move(kv.second);
+}
+
+// Takes the top k by walking back from the rightmost node. When more than
+// half of the queue goes, the rest is rebuilt instead of erasing one by one.
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename OutIt>
+OutIt AVL_Backend::queue<T,V,Compare,Allocator>::pop_n(size_t k, OutIt out)
+{
+    size_t n = std::min(k, _tree.size());
+    if(n * 2 <= _tree.size()) {
+        for(size_t i = 0; i < n; ++i)
+            *out++ = pop();
+        return out;
+    }
+
+    auto top = _tree.rbegin();
+    for(size_t i = 0; i < n; ++i, ++top) {
+        _handles.release((*top).first.slot);
+        *out++ = std::move((*top).second);
+    }
+
+    std::vector<std::pair<key_type, V>> rest;
+    rest.reserve(_tree.size() - n);
+    for(auto it = _tree.begin(); rest.size() < _tree.size() - n; ++it)
+        rest.emplace_back((*it).first, std::move((*it).second));
+
+    _tree.assign_sorted(std::make_move_iterator(rest.begin()), std::make_move_iterator(rest.end()));
+    return out;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void AVL_Backend::queue<T,V,Compare,Allocator>::merge(queue &other)
+{
+    if(this == &other)
+        return;
+
+    // re-tagged in pop order, so ties keep their order behind ours
+    for(auto it = other._tree.rbegin(); it != other._tree.rend(); ++it)
+        _tree.try_emplace(key_type{it->first.priority, _seq++}, std::move(it->second));
+    other.clear();
+}
+
+// The entry is inserted under its new key, with a fresh sequence number,
+// before the old one goes: among equal priorities it now counts as the
+// latest push. If the insert throws, the entry and its slot are untouched.
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT>
+void AVL_Backend::queue<T,V,Compare,Allocator>::update_priority(const QueueHandle &h, TT&& priority)
+{
+    QueueSlot slot = _handles.find(h);
+    std::pair<T, size_t> &ref = _handles[slot];
+    key_type old{ref.first, ref.second};
+    std::pair<T, size_t> next(priority, _seq);
+
+    _tree.try_emplace(key_type{std::forward<TT>(priority), _seq, slot}, std::move(_tree.get(old)));
+    ++_seq;
+    _tree.erase(old);
+    ref = std::move(next);
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+V AVL_Backend::queue<T,V,Compare,Allocator>::erase(const QueueHandle &h)
+{
+    QueueSlot slot = _handles.find(h);
+    V ret(std::move(_tree.extract(key_type{_handles[slot].first, _handles[slot].second}).second));
+    _handles.release(slot);
+    return ret;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename Func>
+void AVL_Backend::queue<T,V,Compare,Allocator>::for_each(Func func) const
+{
+    for(auto it = _tree.rbegin(); it != _tree.rend(); ++it)
+        func(it->first.priority, it->second);
+}
+
+
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::push(TT&& priority, VV&& val)
+{
+    _heap.emplace_back(std::piecewise_construct,
+                       std::forward_as_tuple(QueueKey<T>{std::forward<TT>(priority), _seq}),
+                       std::forward_as_tuple(std::forward<VV>(val)));
+    ++_seq;
+    _sift_up(_heap.size() - 1);
+}
+
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+QueueHandle DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::push_tracked(TT&& priority, VV&& val)
+{
+    QueueHandle h = _handles.acquire(_heap.size());
+    try {
+        _heap.emplace_back(std::piecewise_construct,
+                           std::forward_as_tuple(QueueKey<T>{std::forward<TT>(priority), _seq, h.slot}),
+                           std::forward_as_tuple(std::forward<VV>(val)));
+    }
+    catch (...) {
+        _handles.release(h.slot);
+        throw;
+    }
+    ++_seq;
+    _sift_up(_heap.size() - 1);
+    return h;
+}
+
+// Sifts each new entry up, or rebuilds the heap bottom-up when the batch
+// is at least as large as what was already there.
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename It>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::push_range(It first, It last)
+{
+    size_t old = _heap.size();
+    for(; first != last; ++first) {
+        auto &&e = *first;
+        _heap.emplace_back(std::piecewise_construct,
+                           std::forward_as_tuple(std::get<0>(std::forward<decltype(e)>(e)), _seq++),
+                           std::forward_as_tuple(std::get<1>(std::forward<decltype(e)>(e))));
+    }
+
+    if(_heap.size() - old >= old) {
+        _heapify();
+    }
+    else {
+        for(size_t i = old; i < _heap.size(); ++i)
+            _sift_up(i);
+    }
+}
+
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+V DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::pop()
+{
+    _assert_empty();
+
+    _handles.release(_heap.front().first.slot);
+    V ret(std::move(_heap.front().second));
+    if(_heap.size() > 1)
+        _set(0, std::move(_heap.back()));
+    _heap.pop_back();
+
+    if(!_heap.empty())
+        _sift_down(0);
+
+    return ret;
+}
+
+// Draining the whole heap is a single sort instead of n sift-downs.
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename OutIt>
+OutIt DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::pop_n(size_t k, OutIt out)
+{
+    if(k < _heap.size()) {
+        for(size_t i = 0; i < k; ++i)
+            *out++ = pop();
+        return out;
+    }
+
+    std::sort(_heap.begin(), _heap.end(), [this](const entry &a, const entry &b){return _comp(b.first, a.first);});
+    for(auto &e : _heap)
+        *out++ = std::move(e.second);
+    clear();
+    return out;
+}
+
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::merge(queue &other)
+{
+    if(this == &other)
+        return;
+
+    // the other queue's entries keep their relative order behind ours
+    _heap.reserve(_heap.size() + other._heap.size());
+    for(auto &e : other._heap) {
+        e.first.seq += _seq;
+        e.first.slot = QueueKey<T>::npos;
+        _heap.push_back(std::move(e));
+    }
+    _seq += other._seq;
+    other.clear();
+
+    _heapify();
+}
+
+// Takes a fresh sequence number, as AVL_Backend does.
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::update_priority(const QueueHandle &h, TT&& priority)
+{
+    QueueSlot slot = _handles.find(h);
+    _track();
+    size_t i = _handles[slot];
+    _heap[i].first = QueueKey<T>{std::forward<TT>(priority), _seq++, slot};
+    _restore(i);
+}
+
+// The last entry fills the hole and is sifted from there.
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+V DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::erase(const QueueHandle &h)
+{
+    QueueSlot slot = _handles.find(h);
+    _track();
+    size_t i = _handles[slot];
+    _handles.release(slot);
+
+    V ret(std::move(_heap[i].second));
+    if(i + 1 < _heap.size()) {
+        _set(i, std::move(_heap.back()));
+        _heap.pop_back();
+        _restore(i);
+    }
+    else {
+        _heap.pop_back();
+    }
+    return ret;
+}
+
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::_set(size_t i, entry &&e)
+{
+    _heap[i] = std::move(e);
+    if(_tracking && _heap[i].first.slot != QueueKey<T>::npos)
+        _handles[_heap[i].first.slot] = i;
+}
+
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::_track()
+{
+    if(_tracking)
+        return;
+
+    for(size_t i = 0; i < _heap.size(); ++i) {
+        if(_heap[i].first.slot != QueueKey<T>::npos)
+            _handles[_heap[i].first.slot] = i;
+    }
+    _tracking = true;
+}
+
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::_restore(size_t i)
+{
+    if(i > 0 && _comp(_heap[(i - 1) / D].first, _heap[i].first))
+        _sift_up(i);
+    else
+        _sift_down(i);
+}
+
+// Floyd's bottom-up heap construction
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::_heapify()
+{
+    if(_heap.size() > 1) {
+        for(size_t i = (_heap.size() - 2) / D + 1; i-- > 0;)
+            _sift_down(i);
+    }
+}
+
+// Moves the entry up with a hole instead of swapping at every level.
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::_sift_up(size_t i)
+{
+    entry e = std::move(_heap[i]);
+    while(i > 0) {
+        size_t parent = (i - 1) / D;
+        if(!_comp(_heap[parent].first, e.first))
+            break;
+        _set(i, std::move(_heap[parent]));
+        i = parent;
+    }
+    _set(i, std::move(e));
+}
+
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::_sift_down(size_t i)
+{
+    size_t n = _heap.size();
+    entry e = std::move(_heap[i]);
+    while(true) {
+        size_t first = i * D + 1;
+        if(first >= n)
+            break;
+
+        size_t last = first + D < n ? first + D : n;
+        size_t best = first;
+        for(size_t c = first + 1; c < last; ++c) {
+            if(_comp(_heap[best].first, _heap[c].first))
+                best = c;
+        }
+
+        if(!_comp(e.first, _heap[best].first))
+            break;
+        _set(i, std::move(_heap[best]));
+        i = best;
+    }
+    _set(i, std::move(e));
+}
+
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+AVL_TreeStats DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::stats() const
+{
+    AVL_TreeStats ret;
+#ifdef AVL_TREE_STATS
+    ret.comparisons = _comp.count();
+    ret.bytes_in_use = _heap.size() * sizeof(entry);
+#endif
+    return ret;
+}
+
+template <size_t D>
+template <typename T, typename V, typename Compare, typename Allocator>
+void DaryHeapBackend<D>::queue<T,V,Compare,Allocator>::_assert_empty() const
+{
+    if(_heap.empty())
+        throw std::logic_error("PriorityQueue assert empty");
+}
+
+
+template <typename T, typename V, typename Compare, typename Allocator>
+PairingHeapBackend::queue<T,V,Compare,Allocator>::queue(const queue &other):
+        _root(nullptr),
+        _size(0),
+        _seq(0),
+        _comp(other._comp),
+        _pool(std::allocator_traits<node_allocator>::select_on_container_copy_construction(other._pool.get_allocator())),
+        _handles(other._handles)
+{
+    std::vector<const Node*> stack;
+    if(other._root != nullptr)
+        stack.push_back(other._root);
+
+    try {
+        while(!stack.empty()) {
+            const Node *p = stack.back();
+            stack.pop_back();
+            Node *n = _pool.create(p->key.priority, p->key.seq, p->key.slot, p->val);
+            if(n->key.slot != QueueKey<T>::npos)
+                _handles[n->key.slot] = n;
+            _root = _meld(_root, n);
+            ++_size;
+
+            if(p->child != nullptr)
+                stack.push_back(p->child);
+            if(p->next != nullptr)
+                stack.push_back(p->next);
+        }
+        _seq = other._seq;
+    }
+    catch (...) {
+        clear();
+        throw;
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+PairingHeapBackend::queue<T,V,Compare,Allocator>::queue(queue &&other) noexcept:
+        _root(other._root),
+        _size(other._size),
+        _seq(other._seq),
+        _comp(std::move(other._comp)),
+        _pool(std::move(other._pool)),
+        _handles(std::move(other._handles))
+{
+    other._root = nullptr;
+    other._size = 0;
+    other._seq = 0;
+    other._handles.clear();
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+void PairingHeapBackend::queue<T,V,Compare,Allocator>::push(TT&& priority, VV&& val)
+{
+    Node *n = _pool.create(std::forward<TT>(priority), _seq, QueueKey<T>::npos, std::forward<VV>(val));
+    ++_seq;
+    _root = _meld(_root, n);
+    ++_size;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT, typename VV>
+QueueHandle PairingHeapBackend::queue<T,V,Compare,Allocator>::push_tracked(TT&& priority, VV&& val)
+{
+    QueueHandle h = _handles.acquire(nullptr);
+    Node *n;
+    try {
+        n = _pool.create(std::forward<TT>(priority), _seq, h.slot, std::forward<VV>(val));
+    }
+    catch (...) {
+        _handles.release(h.slot);
+        throw;
+    }
+    _handles[h.slot] = n;
+    ++_seq;
+    _root = _meld(_root, n);
+    ++_size;
+    return h;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename It>
+void PairingHeapBackend::queue<T,V,Compare,Allocator>::push_range(It first, It last)
+{
+    for(; first != last; ++first) {
+        auto &&e = *first;
+        Node *n = _pool.create(std::get<0>(std::forward<decltype(e)>(e)), _seq, QueueKey<T>::npos,
+                               std::get<1>(std::forward<decltype(e)>(e)));
+        ++_seq;
+        _root = _meld(_root, n);
+        ++_size;
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+V PairingHeapBackend::queue<T,V,Compare,Allocator>::pop()
+{
+    _assert_empty();
+
+    Node *old = _root;
+    V ret(std::move(old->val));
+    _root = _merge_pairs(old->child);
+    if(_root != nullptr)
+        _root->prev = nullptr;
+
+    _handles.release(old->key.slot);
+    _pool.destroy(old);
+    --_size;
+    return ret;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename OutIt>
+OutIt PairingHeapBackend::queue<T,V,Compare,Allocator>::pop_n(size_t k, OutIt out)
+{
+    for(; k > 0 && _root != nullptr; --k)
+        *out++ = pop();
+    return out;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void PairingHeapBackend::queue<T,V,Compare,Allocator>::merge(queue &other)
+{
+    if(this == &other)
+        return;
+
+    _pool.splice(other._pool);
+
+    // shifts the other queue's sequence numbers behind ours
+    std::vector<Node*> stack;
+    if(other._root != nullptr)
+        stack.push_back(other._root);
+    while(!stack.empty()) {
+        Node *p = stack.back();
+        stack.pop_back();
+        p->key.seq += _seq;
+        p->key.slot = QueueKey<T>::npos;
+        if(p->child != nullptr)
+            stack.push_back(p->child);
+        if(p->next != nullptr)
+            stack.push_back(p->next);
+    }
+
+    _root = _meld(_root, other._root);
+    _size += other._size;
+    _seq += other._seq;
+
+    other._root = nullptr;
+    other._size = 0;
+    other._seq = 0;
+    other._handles.clear();
+}
+
+// A raised key keeps its subtree in heap order, so the node is cut out with
+// it and melded back; a lowered one has to hand its children over first.
+// Takes a fresh sequence number, as AVL_Backend does.
+template <typename T, typename V, typename Compare, typename Allocator>
+template <typename TT>
+void PairingHeapBackend::queue<T,V,Compare,Allocator>::update_priority(const QueueHandle &h, TT&& priority)
+{
+    QueueSlot slot = _handles.find(h);
+    Node *n = _handles[slot];
+    QueueKey<T> key{std::forward<TT>(priority), _seq++, slot};
+
+    if(_comp(n->key, key)) {
+        n->key = std::move(key);
+        if(n != _root) {
+            _cut(n);
+            _root = _meld(_root, n);
+        }
+    }
+    else {
+        _detach(n);
+        n->key = std::move(key);
+        _root = _meld(_root, n);
+    }
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+V PairingHeapBackend::queue<T,V,Compare,Allocator>::erase(const QueueHandle &h)
+{
+    QueueSlot slot = _handles.find(h);
+    Node *n = _handles[slot];
+
+    _detach(n);
+    V ret(std::move(n->val));
+    _handles.release(slot);
+    _pool.destroy(n);
+    --_size;
+    return ret;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void PairingHeapBackend::queue<T,V,Compare,Allocator>::clear()
+{
+    if(!std::is_trivially_destructible<Node>::value) {
+        // Walks the child/sibling links without recursion by splicing every
+        // child list in front of the remaining siblings.
+        Node *p = _root;
+        while(p != nullptr) {
+            Node *next = p->next;
+            if(p->child != nullptr) {
+                Node *last = p->child;
+                while(last->next != nullptr)
+                    last = last->next;
+                last->next = next;
+                next = p->child;
+            }
+            _pool.destroy(p);
+            p = next;
+        }
+    }
+
+    _pool.release();
+    _root = nullptr;
+    _size = 0;
+    _handles.clear();
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void PairingHeapBackend::queue<T,V,Compare,Allocator>::swap(queue &other) noexcept
+{
+    using std::swap;
+    swap(_root, other._root);
+    swap(_size, other._size);
+    swap(_seq, other._seq);
+    swap(_comp, other._comp);
+    _pool.swap(other._pool);
+    swap(_handles, other._handles);
+}
+
+// Links the smaller root as the first child of the greater one.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename PairingHeapBackend::queue<T,V,Compare,Allocator>::Node *
+PairingHeapBackend::queue<T,V,Compare,Allocator>::_meld(Node *a, Node *b)
+{
+    if(a == nullptr)
+        return b;
+    if(b == nullptr)
+        return a;
+    if(_comp(a->key, b->key))
+        std::swap(a, b);
+
+    b->next = a->child;
+    if(a->child != nullptr)
+        a->child->prev = b;
+    b->prev = a;
+    a->child = b;
+    a->next = nullptr;
+    a->prev = nullptr;
+    return a;
+}
+
+// Standard two-pass pairing: meld siblings pairwise left to right, then
+// fold the pairs right to left. The pairs are chained through `prev`
+// so no extra storage is needed.
+template <typename T, typename V, typename Compare, typename Allocator>
+typename PairingHeapBackend::queue<T,V,Compare,Allocator>::Node *
+PairingHeapBackend::queue<T,V,Compare,Allocator>::_merge_pairs(Node *first)
+{
+    Node *pairs = nullptr;
+    while(first != nullptr) {
+        Node *a = first;
+        Node *b = a->next;
+        first = b ? b->next : nullptr;
+
+        a->next = a->prev = nullptr;
+        if(b != nullptr)
+            b->next = b->prev = nullptr;
+
+        Node *m = _meld(a, b);
+        m->prev = pairs;
+        pairs = m;
+    }
+
+    Node *ret = nullptr;
+    while(pairs != nullptr) {
+        Node *prev = pairs->prev;
+        pairs->prev = nullptr;
+        ret = _meld(pairs, ret);
+        pairs = prev;
+    }
+    return ret;
+}
+
+// A first child's back link is its parent, whose child pointer leads back.
+template <typename T, typename V, typename Compare, typename Allocator>
+void PairingHeapBackend::queue<T,V,Compare,Allocator>::_cut(Node *n)
+{
+    if(n->prev->child == n)
+        n->prev->child = n->next;
+    else
+        n->prev->next = n->next;
+    if(n->next != nullptr)
+        n->next->prev = n->prev;
+    n->next = n->prev = nullptr;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void PairingHeapBackend::queue<T,V,Compare,Allocator>::_detach(Node *n)
+{
+    Node *children = _merge_pairs(n->child);
+    n->child = nullptr;
+
+    if(n == _root) {
+        _root = children;
+    }
+    else {
+        _cut(n);
+        _root = _meld(_root, children);
+    }
+    if(_root != nullptr)
+        _root->prev = nullptr;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+AVL_TreeStats PairingHeapBackend::queue<T,V,Compare,Allocator>::stats() const
+{
+    AVL_TreeStats ret;
+#ifdef AVL_TREE_STATS
+    ret.comparisons = _comp.count();
+    ret.allocations = _pool.created();
+    ret.deallocations = _pool.destroyed();
+    ret.bytes_in_use = _pool.in_use() * sizeof(Node);
+#endif
+    return ret;
+}
+
+template <typename T, typename V, typename Compare, typename Allocator>
+void PairingHeapBackend::queue<T,V,Compare,Allocator>::_assert_empty() const
+{
+    if(_root == nullptr)
+        throw std::logic_error("PriorityQueue assert empty");
+}
+
+#endif
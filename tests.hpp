@@ -2,9 +2,28 @@
 
 
 #include <algorithm> //for std::sort
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+#include <thread>
 #include "avl_tree.hpp"
 #include "priority_queue.hpp"
+#include "concurrent_priority_queue.hpp"
+#include "concurrent_avl_tree.hpp"
+#include "persistent_avl_tree.hpp"
+#include "compact_avl_tree.hpp"
+#if defined(__unix__) || defined(__APPLE__)
+#include "mapped_avl_view.hpp"
+#endif
 
 template<typename T1, typename T2>
 void assert_equal(const T1 &a, const T2 &b, const char* msg = "Not equal in assert_equal!"){
@@ -216,6 +235,974 @@ void test_avl_tree_reduce()
     assert_equal(psum, sum);
 }
 
+void test_avl_tree_parallel()
+{
+    size_t n = randint(50000, 100000);
+    AVL_Tree<int, long long> tree;
+    for(size_t i = 0; i < n; ++i)
+        tree[randint(0, 1000000)] = randint(0, 1000);
+
+    auto mapped = parallel_map(tree, [](long long v){return v * 3;});
+    auto expected_map = map(tree, [](long long v){return v * 3;});
+    assert_equal(mapped.size(), expected_map.size());
+    assert_equal(std::equal(mapped.begin(), mapped.end(), expected_map.begin()), true, "parallel_map differs");
+
+    auto kept = parallel_where(tree, [](long long v){return v % 3 == 0;});
+    auto expected_where = where(tree, [](long long v){return v % 3 == 0;});
+    assert_equal(kept.size(), expected_where.size());
+    assert_equal(std::equal(kept.begin(), kept.end(), expected_where.begin()), true, "parallel_where differs");
+
+    long long sum = parallel_reduce(tree, 0, std::plus<>(), std::plus<>());
+    assert_equal(sum, reduce(tree, 0, std::plus<>()));
+
+    //small grain forces forking even on small trees
+    std::vector<int> order = tree.parallel_fold(std::vector<int>(),
+        [](std::vector<int> acc, const int &k, const long long &){acc.push_back(k); return acc;},
+        [](std::vector<int> l, std::vector<int> r){l.insert(l.end(), r.begin(), r.end()); return l;},
+        16);
+    assert_equal(order.size(), tree.size());
+    assert_equal(std::is_sorted(order.begin(), order.end()), true, "parallel_fold lost key order");
+
+    auto moved = parallel_map(std::move(mapped), [](long long v){return v + 1;});
+    assert_equal(moved.size(), expected_map.size());
+}
+
+static size_t counting_allocations = 0;
+
+template <typename U>
+struct CountingAllocator {
+    using value_type = U;
+
+    CountingAllocator() = default;
+    template <typename W>
+    CountingAllocator(const CountingAllocator<W>&) {}
+
+    U *allocate(size_t n) {++counting_allocations; return std::allocator<U>().allocate(n);}
+    void deallocate(U *p, size_t n) {std::allocator<U>().deallocate(p, n);}
+
+    template <typename W>
+    bool operator==(const CountingAllocator<W>&) const {return true;}
+    template <typename W>
+    bool operator!=(const CountingAllocator<W>&) const {return false;}
+};
+
+void test_avl_tree_pool()
+{
+    AVL_Tree<int, std::string, std::less<int>, CountingAllocator<std::pair<const int, std::string>>> tree;
+
+    for(int i = 0; i < 1000; ++i)
+        tree[i] = std::to_string(i);
+
+    //churn after warm-up must be served from the free list
+    size_t before = counting_allocations;
+    for(int i = 0; i < 1000; ++i) {
+        tree.erase(i);
+        tree[i + 1000] = std::to_string(i);
+    }
+    assert_equal(counting_allocations, before, "Node churn reached the allocator");
+    assert_equal(tree.size(), 1000);
+
+    auto copy = tree;
+    tree.clear();
+    assert_equal(tree.size(), 0);
+    assert_equal(copy.get(1500), std::string("500"));
+
+    tree = copy;
+    assert_equal(tree.size(), 1000);
+    assert_equal(tree.get(1999), std::string("999"));
+
+    //split rebuilds the half it gives away, so either one may outlive the other
+    {
+        auto high = tree.split(1500);
+        assert_equal(tree.size(), 500);
+        assert_equal(high.size(), 500);
+        tree.clear();
+        for(int i = 0; i < 1000; ++i)
+            high[i] = std::to_string(i);
+        assert_equal(high.get(1999), std::string("999"));
+        tree = std::move(high);
+    }
+    auto high = tree.split(500);
+    tree = decltype(tree)();
+    high.erase(1999);
+    high[2000] = "2000";
+    assert_equal(high.size(), 1000);
+    assert_equal(high.get(1500), std::string("500"));
+}
+
+void test_avl_tree_view()
+{
+    using Tree = AVL_Tree<int, int, std::less<int>, CountingAllocator<std::pair<const int, int>>>;
+    Tree tree;
+    size_t n = randint(0, 2000);
+    for(size_t i = 0; i < n; ++i)
+        tree[randint(-1000, 1000)] = randint(-100, 100);
+
+    auto is_even = [](int v){return v % 2 == 0;};
+    auto square = [](int v){return v * v;};
+    Tree expected = map(where(tree, is_even), square);
+
+    //running a pipeline allocates nothing
+    counting_allocations = 0;
+    auto pipeline = tree.view().where(is_even).map(square);
+    int sum = pipeline.reduce(0, [](int v, int acc){return v + acc;});
+    size_t count = pipeline.count();
+    assert_equal(counting_allocations, 0, "view pipeline allocated");
+    assert_equal(sum, reduce(expected, 0, std::plus<>()));
+    assert_equal(count, expected.size());
+
+    auto it = expected.begin();
+    pipeline.for_each([&it](const int &key, const int &val){
+        assert_equal(key, (*it).first);
+        assert_equal(val, (*it).second);
+        ++it;
+    });
+    assert_equal(it == expected.end(), true);
+
+    //stages apply in order and may change the value type
+    auto strings = tree.view()
+            .map([](int v){return v + 1000;})
+            .where([](int v){return v % 3 == 0;})
+            .map([](int v){return std::to_string(v);})
+            .to_tree();
+    size_t i = 0;
+    for(auto kv : tree) {
+        if((kv.second + 1000) % 3 == 0) {
+            assert_equal(strings.get(kv.first), std::to_string(kv.second + 1000));
+            ++i;
+        }
+    }
+    assert_equal(strings.size(), i);
+
+    auto copy = tree.view().to_tree();
+    assert_equal(copy.size(), tree.size());
+    assert_equal(std::equal(copy.begin(), copy.end(), tree.begin()), true, "view copy differs");
+}
+
+void test_avl_tree_iterators()
+{
+    AVL_Tree<int, int> tree;
+    std::vector<int> keys;
+
+    size_t n = randint(100, 1000);
+    for(size_t i = 0; i < n; ++i) {
+        int t = randint(0, 5000);
+        if(!tree.find(t)) {
+            tree[t] = -t;
+            keys.push_back(t);
+        }
+    }
+    for(size_t i = 0; i < keys.size() / 3; ++i) {
+        tree.erase(keys.back());
+        keys.pop_back();
+    }
+    std::sort(keys.begin(), keys.end());
+
+    size_t i = 0;
+    for(auto kv : tree) {
+        assert_equal(kv.first, keys[i]);
+        assert_equal(kv.second, -keys[i++]);
+    }
+    assert_equal(i, keys.size());
+
+    auto rit = tree.rbegin();
+    for(auto it = keys.rbegin(); it != keys.rend(); ++it, ++rit)
+        assert_equal(rit->first, *it);
+    assert_equal(rit == tree.rend(), true);
+
+    const AVL_Tree<int, int> &ctree = tree;
+    assert_equal((*--ctree.end()).first, keys.back());
+    assert_equal(std::distance(ctree.begin(), ctree.end()), (long)keys.size());
+
+    auto found = std::find_if(tree.begin(), tree.end(), [&keys](auto kv){return kv.first == keys[keys.size() / 2];});
+    found->second = 1;
+    assert_equal(tree.get(keys[keys.size() / 2]), 1);
+}
+
+void test_avl_tree_range()
+{
+    AVL_Tree<int, int> tree;
+    for(int i = 0; i < 100; ++i)
+        tree[2*i] = i;
+
+    assert_equal((*tree.lower_bound(10)).first, 10);
+    assert_equal((*tree.lower_bound(11)).first, 12);
+    assert_equal((*tree.upper_bound(10)).first, 12);
+    assert_equal(tree.lower_bound(199) == tree.end(), true);
+    assert_equal(tree.lower_bound(-5) == tree.begin(), true);
+
+    auto eq = tree.equal_range(20);
+    assert_equal(std::distance(eq.first, eq.second), 1);
+    eq = tree.equal_range(21);
+    assert_equal(eq.first == eq.second, true);
+
+    int lo = randint(-10, 100), hi = randint(lo, 210);
+    int cnt = 0, last = lo - 1;
+    tree.for_each_in_range(lo, hi, [&cnt, &last, hi](const int &k, int &){
+        assert_equal(k > last && k < hi, true);
+        last = k;
+        ++cnt;
+    });
+
+    int expected = 0;
+    for(int i = 0; i < 100; ++i)
+        if(2*i >= lo && 2*i < hi)
+            ++expected;
+    assert_equal(cnt, expected);
+}
+
+template <typename Q>
+void check_priority_queue_stats(size_t expected_nodes)
+{
+    Q queue;
+    for(int i = 0; i < 100; ++i)
+        queue.push(randint(0, 50), i);
+    for(int i = 0; i < 40; ++i)
+        queue.pop();
+
+    AVL_TreeStats s = queue.stats();
+    assert_equal(s.comparisons > 0, AVL_TreeStats::enabled);
+    assert_equal(s.allocations, AVL_TreeStats::enabled ? expected_nodes : 0);
+    assert_equal(s.deallocations, AVL_TreeStats::enabled && expected_nodes > 0 ? 40 : 0);
+    assert_equal(s.bytes_in_use > 0, AVL_TreeStats::enabled);
+
+    queue.reset_stats();
+    assert_equal(queue.stats().comparisons, 0);
+}
+
+void test_avl_tree_stats()
+{
+    AVL_Tree<int, int> tree;
+    size_t n = randint(100, 1000);
+    for(size_t i = 0; i < n; ++i)
+        tree.insert(i, i);
+
+    //ascending inserts keep rotating the right flank
+    AVL_TreeStats s = tree.stats();
+    if(AVL_TreeStats::enabled) {
+        assert_equal(s.allocations, n);
+        assert_equal(s.deallocations, 0);
+        assert_equal(s.rotations > 0, true, "no rotations counted");
+        assert_equal(s.balances >= s.rotations / 2, true);
+        assert_equal(s.comparisons >= n, true, "comparisons not counted");
+        assert_equal(s.max_depth >= 1 && s.max_depth <= (size_t)tree.height(), true, "bad max_depth");
+        assert_equal(s.bytes_in_use >= n * (sizeof(int) * 2), true);
+    }
+    else {
+        assert_equal(s.comparisons + s.rotations + s.balances + s.allocations + s.deallocations + s.max_depth + s.bytes_in_use, 0,
+                     "stats counted while disabled");
+    }
+
+    tree.reset_stats();
+    tree.erase(0);
+    s = tree.stats();
+    assert_equal(s.rotations, 0, "reset_stats kept rotations");
+    assert_equal(s.deallocations, AVL_TreeStats::enabled ? 1 : 0);
+    assert_equal(s.comparisons > 0, AVL_TreeStats::enabled);
+
+    check_priority_queue_stats<PriorityQueue<int, int>>(100);
+    check_priority_queue_stats<PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, PairingHeapBackend>>(100);
+    check_priority_queue_stats<PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, DaryHeapBackend<4>>>(0);
+}
+
+void test_avl_tree_pop()
+{
+    AVL_Tree<int, std::string> tree;
+    std::map<int, std::string> reference;
+
+    for(int i = 0; i < 20000; ++i) {
+        int op = randint(0, 5);
+        if(op <= 2 || reference.empty()) {
+            int k = randint(-5000, 5000);
+            tree.insert_or_assign(k, std::to_string(k));
+            reference[k] = std::to_string(k);
+        }
+        else if(op == 3) {
+            auto kv = tree.pop_min();
+            assert_equal(kv.first, reference.begin()->first);
+            assert_equal(kv.second, reference.begin()->second);
+            reference.erase(reference.begin());
+        }
+        else if(op == 4) {
+            auto kv = tree.pop_max();
+            assert_equal(kv.first, reference.rbegin()->first);
+            assert_equal(kv.second, reference.rbegin()->second);
+            reference.erase(std::prev(reference.end()));
+        }
+        else {
+            int k = randint(-5000, 5000);
+            if(tree.find(k)) {
+                tree.erase(k);
+                reference.erase(k);
+            }
+        }
+
+        assert_equal(tree.size(), reference.size());
+        if(!reference.empty()) {
+            assert_equal(tree.find_min().first, reference.begin()->first);
+            assert_equal(tree.find_max().first, reference.rbegin()->first);
+            assert_equal(tree.begin()->first, reference.begin()->first);
+            assert_equal(tree.rbegin()->first, reference.rbegin()->first);
+        }
+    }
+
+    AVL_Tree<int, std::string> copy(tree);
+    assert_equal(copy.find_min().first, tree.find_min().first);
+    assert_equal(copy.find_max().first, tree.find_max().first);
+
+    while(tree.size() > 0)
+        tree.pop_max();
+    assert_equal(tree.begin() == tree.end(), true);
+
+    bool thrown = false;
+    try {
+        tree.pop_min();
+    }
+    catch (std::logic_error&) {
+        thrown = true;
+    }
+    assert_equal(thrown, true);
+}
+
+template <typename Tree, typename Reference>
+void check_tree_matches(const Tree &tree, const Reference &reference)
+{
+    assert_equal(tree.size(), reference.size());
+    assert_equal(tree.height() <= 1.45 * std::log2(tree.size() + 2), true, "AVL_Tree unbalanced");
+
+    size_t i = 0;
+    auto it = reference.begin();
+    for(auto kv : tree) {
+        assert_equal(kv.first, it->first);
+        assert_equal(kv.second, it->second);
+        assert_equal(tree.rank(kv.first), i++);
+        ++it;
+    }
+    assert_equal(it == reference.end(), true);
+
+    auto rit = reference.rbegin();
+    for(auto r = tree.rbegin(); r != tree.rend(); ++r, ++rit)
+        assert_equal((*r).first, rit->first);
+    assert_equal(rit == reference.rend(), true);
+}
+
+void test_avl_tree_set_operations()
+{
+    using Tree = AVL_Tree<int, int>;
+
+    for(int round = 0; round < 20; ++round) {
+        // sizes from tiny to large and lopsided, with small grains so the
+        // forked recursion is exercised too
+        int n = randint(0, 3000), m = round % 2 ? randint(0, 30) : randint(0, 3000);
+        std::map<int, int> ra, rb;
+        Tree a, b;
+        for(int i = 0; i < n; ++i) {
+            int k = randint(0, 5000);
+            a.insert_or_assign(k, k);
+            ra[k] = k;
+        }
+        for(int i = 0; i < m; ++i) {
+            int k = randint(0, 5000);
+            b.insert_or_assign(k, -k);
+            rb[k] = -k;
+        }
+        size_t grain = round % 3 == 0 ? 16 : Tree::parallel_grain;
+
+        Tree u(a), ub(b);
+        std::map<int, int> ru = ra;
+        ru.insert(rb.begin(), rb.end());
+        u.merge(ub, grain);
+        check_tree_matches(u, ru);
+        assert_equal(ub.size(), size_t(0));
+        ub.insert(1, 1);
+        assert_equal(ub.get(1), 1);
+
+        Tree in(a);
+        std::map<int, int> ri;
+        for(auto &kv : ra)
+            if(rb.count(kv.first))
+                ri.insert(kv);
+        in.intersect(b, grain);
+        check_tree_matches(in, ri);
+
+        Tree d(a);
+        std::map<int, int> rd;
+        for(auto &kv : ra)
+            if(!rb.count(kv.first))
+                rd.insert(kv);
+        d.difference(b, grain);
+        check_tree_matches(d, rd);
+        d.insert(-1, -1);
+        assert_equal(d.find_min().first, -1);
+
+        int key = randint(-10, 5010);
+        Tree low(a);
+        Tree high = low.split(key);
+        std::map<int, int> rl(ra.begin(), ra.lower_bound(key)), rh(ra.lower_bound(key), ra.end());
+        check_tree_matches(low, rl);
+        check_tree_matches(high, rh);
+
+        low.join(high);
+        check_tree_matches(low, ra);
+        assert_equal(high.size(), size_t(0));
+    }
+
+    Tree a, b;
+    a.insert(1, 1);
+    a.insert(5, 5);
+    b.insert(3, 3);
+    bool thrown = false;
+    try {
+        a.join(b);
+    }
+    catch (std::runtime_error&) {
+        thrown = true;
+    }
+    assert_equal(thrown, true);
+    assert_equal(a.size() + b.size(), size_t(3));
+}
+
+// Sorted, reversed and zigzag orders keep inserting and erasing at the
+// edges, which sends every rebalance up the longest parent chains.
+void test_avl_tree_degenerate()
+{
+    const int n = 1 << 14;
+    std::vector<std::vector<int>> orders(3);
+    for(int i = 0; i < n; ++i) {
+        orders[0].push_back(i);
+        orders[1].push_back(n - 1 - i);
+        orders[2].push_back(i % 2 ? n - 1 - i / 2 : i / 2);
+    }
+
+    for(const auto &insert_order : orders) {
+        for(const auto &erase_order : orders) {
+            AVL_Tree<int, int> tree;
+            std::map<int, int> reference;
+            for(int k : insert_order) {
+                tree.insert(k, -k);
+                reference[k] = -k;
+            }
+            check_tree_matches(tree, reference);
+
+            // half of the keys from one end (or both ends)
+            for(int i = 0; i < n / 2; ++i) {
+                int k = erase_order[i];
+                tree.erase(k);
+                reference.erase(k);
+                if(i % 1024 == 0) {
+                    assert_equal(tree.height() <= 1.45 * std::log2(tree.size() + 2), true, "AVL_Tree unbalanced");
+                    assert_equal(tree.find_min().first, reference.begin()->first);
+                    assert_equal(tree.find_max().first, reference.rbegin()->first);
+                }
+            }
+            check_tree_matches(tree, reference);
+
+            // the median usually has two children, so its successor is spliced in
+            while(tree.size() > 0) {
+                int k = (*tree.select(tree.size() / 2)).first;
+                tree.erase(k);
+                reference.erase(k);
+                assert_equal(tree.find(k), false);
+                if(tree.size() % 1024 == 0)
+                    check_tree_matches(tree, reference);
+            }
+            assert_equal(reference.empty(), true);
+        }
+    }
+
+    // random churn: heights and sizes stay right when rebalancing stops early
+    AVL_Tree<int, int> tree;
+    std::map<int, int> reference;
+    for(int i = 0; i < 8 * n; ++i) {
+        int k = randint(0, n);
+        if(randint(0, 2) == 0 && reference.count(k)) {
+            tree.erase(k);
+            reference.erase(k);
+        }
+        else {
+            tree.insert_or_assign(k, k);
+            reference[k] = k;
+        }
+        if(i % 4096 == 0 && !reference.empty()) {
+            assert_equal(tree.height() <= 1.45 * std::log2(tree.size() + 2), true, "AVL_Tree unbalanced");
+            size_t j = randint(0, int(reference.size()) - 1);
+            assert_equal((*tree.select(j)).first, std::next(reference.begin(), j)->first);
+        }
+    }
+    check_tree_matches(tree, reference);
+}
+
+void test_avl_tree_find_many()
+{
+    AVL_Tree<int, int> tree;
+    std::map<int, int> m;
+    size_t n = randint(0, 5000);
+    for(size_t i = 0; i < n; ++i) {
+        int key = randint(0, 20000);
+        tree[key] = m[key] = -key;
+    }
+
+    //unsorted batch of any size, and the same batch sorted with duplicates
+    std::vector<int> keys(randint(0, 1000));
+    for(int &k : keys)
+        k = randint(-10, 20010);
+    std::vector<int> sorted = keys;
+    sorted.insert(sorted.end(), keys.begin(), keys.begin() + keys.size() / 2);
+    std::sort(sorted.begin(), sorted.end());
+
+    for(const std::vector<int> *batch : {&keys, &sorted}) {
+        std::vector<bool> found;
+        std::vector<int*> vals;
+        tree.find_many(batch->begin(), batch->end(), std::back_inserter(found));
+        tree.get_many(batch->begin(), batch->end(), std::back_inserter(vals));
+        assert_equal(found.size(), batch->size());
+        assert_equal(vals.size(), batch->size());
+
+        for(size_t i = 0; i < batch->size(); ++i) {
+            int k = (*batch)[i];
+            assert_equal(found[i], m.count(k) == 1, "find_many differs from find");
+            assert_equal(vals[i] == nullptr, m.count(k) == 0, "get_many differs from find");
+            if(vals[i] != nullptr)
+                assert_equal(vals[i], &tree.get(k), "get_many points at another value");
+        }
+    }
+
+    //keys converted to T once per lookup
+    AVL_Tree<std::string, int> strings;
+    strings["a"] = 1;
+    strings["c"] = 3;
+    const char *names[] = {"c", "b", "a"};
+    const int *vals[3];
+    std::as_const(strings).get_many(std::begin(names), std::end(names), vals);
+    assert_equal(*vals[0], 3);
+    assert_equal(vals[1] == nullptr, true);
+    assert_equal(*vals[2], 1);
+}
+
+void test_avl_tree_order_statistics()
+{
+    AVL_Tree<int, int> tree;
+    std::vector<int> keys;
+
+    size_t n = randint(100, 1000);
+    for(size_t i = 0; i < n; ++i) {
+        int t = randint(0, 5000);
+        if(!tree.find(t)) {
+            tree[t] = t;
+            keys.push_back(t);
+        }
+    }
+    for(size_t i = 0; i < keys.size() / 4; ++i) {
+        tree.erase(keys.back());
+        keys.pop_back();
+    }
+    std::sort(keys.begin(), keys.end());
+
+    for(size_t i = 0; i < keys.size(); ++i) {
+        assert_equal((*tree.select(i)).first, keys[i]);
+        assert_equal(tree.rank(keys[i]), i);
+        assert_equal(tree.rank(keys[i] + 1), i + 1);
+    }
+    assert_equal(tree.select(keys.size()) == tree.end(), true);
+
+    int lo = randint(0, 2500), hi = randint(lo, 5000);
+    size_t expected = std::lower_bound(keys.begin(), keys.end(), hi) - std::lower_bound(keys.begin(), keys.end(), lo);
+    assert_equal(tree.count_range(lo, hi), expected);
+    assert_equal(tree.count_range(hi, lo), 0);
+
+    auto sub = tree.subtree((*tree.select(keys.size() / 2)).first);
+    assert_equal(sub.size(), (size_t)std::distance(sub.begin(), sub.end()));
+}
+
+void test_avl_tree_from_sorted()
+{
+    size_t n = randint(1, 5000);
+    std::vector<std::pair<int, std::string>> items;
+    for(size_t i = 0; i < n; ++i)
+        items.emplace_back(3*i, std::to_string(i));
+
+    auto tree = AVL_Tree<int, std::string>::from_sorted(items.begin(), items.end());
+    assert_equal(tree.size(), n);
+
+    int max_height = 1;
+    while((size_t(1) << max_height) <= n)
+        ++max_height;
+    assert_equal(tree.height(), max_height, "from_sorted tree is not perfectly balanced");
+
+    size_t i = 0;
+    for(auto kv : tree) {
+        assert_equal(kv.first, items[i].first);
+        assert_equal(kv.second, items[i++].second);
+    }
+
+    //the result must stay a valid AVL tree
+    tree.erase(0);
+    tree[1] = "x";
+    assert_equal(tree.size(), n);
+
+    auto copy = AVL_Tree<int, std::string>::from_sorted(tree.begin(), tree.end());
+    assert_equal(copy.size(), n);
+    assert_equal(copy.get(1), std::string("x"));
+
+    std::swap(items[0], items[n - 1]);
+    bool thrown = false;
+    try {
+        tree.assign_sorted(items.begin(), items.end());
+    }
+    catch (std::runtime_error &) {
+        thrown = true;
+    }
+    assert_equal(thrown || n == 1, true, "unsorted input accepted");
+
+    //where() on an rvalue relinks the kept nodes without allocating
+    using Counted = AVL_Tree<int, std::string, std::less<int>, CountingAllocator<std::pair<const int, std::string>>>;
+    Counted counted;
+    for(size_t i = 0; i < n; ++i)
+        counted.insert(int(i), std::to_string(i));
+    size_t before = counting_allocations;
+    Counted odd = where(std::move(counted), [](const std::string &v){return (v.back() - '0') % 2 == 1;});
+    assert_equal(counting_allocations, before, "where copied the kept entries");
+    assert_equal(odd.size(), n / 2);
+    assert_equal(odd.height() <= max_height, true, "where result is not balanced");
+    int k = 1;
+    for(auto kv : odd) {
+        assert_equal(kv.first, k);
+        assert_equal(kv.second, std::to_string(k));
+        k += 2;
+    }
+    odd.insert(-1, "-1");
+    assert_equal(odd.find_min().first, -1);
+
+    thrown = false;
+    try {
+        odd = where(std::move(odd), [](const std::string &v){if(v == "1") throw std::runtime_error("where"); return true;});
+    }
+    catch (std::runtime_error &) {
+        thrown = true;
+    }
+    assert_equal(thrown || n == 1, true);
+}
+
+struct alignas(128) WideKey {
+    int v;
+
+    bool operator<(const WideKey &other) const {return v < other.v;}
+};
+
+void test_avl_tree_serialization()
+{
+    AVL_Tree<int, double> tree, loaded;
+    std::map<int, double> m;
+    size_t n = randint(0, 5000);
+    for(size_t i = 0; i < n; ++i) {
+        int key = randint(-10000, 10000);
+        tree[key] = key / 2.0;
+        m[key] = key / 2.0;
+    }
+
+    std::stringstream stream;
+    tree.save(stream);
+    loaded[1] = 1;
+    loaded.load(stream);
+    check_tree_matches(loaded, m);
+
+    //a damaged image is rejected and leaves the tree empty
+    std::string image = stream.str();
+    bool thrown = false;
+    try {
+        std::stringstream bad(std::string("X") + image.substr(1));
+        loaded.load(bad);
+    }
+    catch (std::runtime_error &) {
+        thrown = true;
+    }
+    assert_equal(thrown, true, "bad header accepted");
+    assert_equal(loaded.size(), 0);
+
+    if(m.size() > 1) {
+        AVL_FileHeader header;
+        std::memcpy(&header, image.data(), sizeof(header));
+        std::swap(image[header.keys_offset], image[header.keys_offset + sizeof(int)]);
+        std::swap(image[header.keys_offset + 1], image[header.keys_offset + sizeof(int) + 1]);
+        std::swap(image[header.keys_offset + 2], image[header.keys_offset + sizeof(int) + 2]);
+        std::swap(image[header.keys_offset + 3], image[header.keys_offset + sizeof(int) + 3]);
+        thrown = false;
+        try {
+            std::stringstream bad(image);
+            loaded.load(bad);
+        }
+        catch (std::runtime_error &) {
+            thrown = true;
+        }
+        assert_equal(thrown, true, "unsorted image accepted");
+        assert_equal(loaded.size(), 0);
+    }
+
+    //a huge count over a short stream fails as a bad image, not as an allocation
+    for(uint64_t count : {uint64_t(1) << 50, uint64_t(m.size() + 1)}) {
+        AVL_FileHeader header = AVL_FileHeader::make<int, double>(count);
+        std::string truncated(reinterpret_cast<const char*>(&header), sizeof(header));
+        truncated += image.substr(sizeof(header));
+        thrown = false;
+        try {
+            std::stringstream bad(truncated);
+            loaded.load(bad);
+        }
+        catch (std::runtime_error &) {
+            thrown = true;
+        }
+        assert_equal(thrown, true, "truncated image accepted");
+        assert_equal(loaded.size(), 0);
+    }
+
+    //padding longer than 64 bytes for an over-aligned key
+    AVL_Tree<WideKey, int> wide, wide_loaded;
+    for(int i = 0; i < 10; ++i)
+        wide.insert(WideKey{i}, -i);
+    std::stringstream wide_stream;
+    wide.save(wide_stream);
+    wide_loaded.load(wide_stream);
+    assert_equal(wide_loaded.size(), size_t(10));
+    assert_equal(wide_loaded.get(WideKey{7}), -7);
+
+#if defined(__unix__) || defined(__APPLE__)
+    std::string path = (std::filesystem::temp_directory_path() / ("avl_tree_" + std::to_string(randint(0, 1 << 30)))).string();
+    {
+        std::ofstream file(path, std::ios::binary);
+        tree.save(file);
+    }
+
+    {
+        MappedAVL_View<int, double> view(path);
+        assert_equal(view.size(), m.size());
+        for(int i = 0; i < 100; ++i) {
+            int key = randint(-10000, 10000);
+            assert_equal(view.find(key), m.count(key) == 1);
+            if(m.count(key))
+                assert_equal(view.get(key), m[key]);
+        }
+
+        int lo = randint(-10000, 10000), hi = randint(lo, 10000);
+        auto it = m.lower_bound(lo);
+        assert_equal(view.count_range(lo, hi), (size_t)std::distance(it, m.lower_bound(hi)));
+        view.for_each_in_range(lo, hi, [&it](const int &key, const double &val){
+            assert_equal(key, it->first);
+            assert_equal(val, it->second);
+            ++it;
+        });
+        assert_equal(it == m.lower_bound(hi), true);
+
+        MappedAVL_View<int, double> moved(std::move(view));
+        assert_equal(moved.size(), m.size());
+        assert_equal(view.size(), 0);
+    }
+
+    thrown = false;
+    try {
+        MappedAVL_View<long long, double> wrong(path);
+    }
+    catch (std::runtime_error &) {
+        thrown = true;
+    }
+    assert_equal(thrown, true, "view opened with other key type");
+    std::filesystem::remove(path);
+#endif
+}
+
+void test_avl_tree_emplace()
+{
+    AVL_Tree<int, std::string> tree;
+
+    auto r = tree.try_emplace(1, 3, 'a');
+    assert_equal(r.second, true);
+    assert_equal((*r.first).second, std::string("aaa"));
+
+    r = tree.try_emplace(1, 5, 'b');
+    assert_equal(r.second, false);
+    assert_equal(tree.get(1), std::string("aaa"));
+
+    r = tree.insert_or_assign(1, "x");
+    assert_equal(r.second, false);
+    assert_equal(tree.get(1), std::string("x"));
+
+    r = tree.emplace(2, "y");
+    assert_equal(r.second, true);
+    assert_equal(tree.size(), 2);
+
+    //an existing key must leave a movable argument untouched
+    std::string s = "keep";
+    tree.try_emplace(2, std::move(s));
+    assert_equal(s, std::string("keep"));
+
+    for(int i = 0; i < 1000; ++i)
+        tree[randint(0, 500)] += "z";
+    assert_equal(tree.size(), (size_t)std::distance(tree.begin(), tree.end()));
+    assert_equal(tree.height() <= 1.45 * std::log2(tree.size() + 2), true, "AVL_Tree height is out of bounds");
+}
+
+struct CountingLess {
+    using is_transparent = void;
+
+    template <typename A, typename B>
+    bool operator()(const A &a, const B &b) const {++calls; return a < b;}
+
+    static size_t calls;
+};
+size_t CountingLess::calls = 0;
+
+void test_avl_tree_compare()
+{
+    //descending order through a custom comparator
+    AVL_Tree<int, int, std::greater<int>> desc;
+    for(int i = 0; i < 100; ++i)
+        desc[randint(0, 1000)] = 0;
+    int last = 1001;
+    for(auto kv : desc) {
+        assert_equal(kv.first < last, true);
+        last = kv.first;
+    }
+
+    //heterogeneous lookup: string_view keys are not turned into strings
+    AVL_Tree<std::string, int, CountingLess> tree;
+    for(int i = 0; i < 1000; ++i)
+        tree[std::to_string(i)] = i;
+
+    std::string_view key = "500";
+    assert_equal(tree.find(key), true);
+    assert_equal(tree.get(key), 500);
+    assert_equal((*tree.lower_bound(std::string_view("5000"))).first, std::string("501"));
+
+    //a lookup costs one comparison per level plus the final equality check
+    CountingLess::calls = 0;
+    tree.find(key);
+    assert_equal(CountingLess::calls <= (size_t)tree.height() + 1, true, "too many comparisons per level");
+}
+
+template <typename Frozen, typename Reference>
+void check_frozen_matches(const Frozen &frozen, const Reference &reference, int lo, int hi)
+{
+    using K = typename Reference::key_type;
+    assert_equal(frozen.size(), reference.size());
+
+    auto it = reference.begin();
+    frozen.for_each([&it](const K &key, const auto &val){
+        assert_equal(key, it->first);
+        assert_equal(val, it->second);
+        ++it;
+    });
+    assert_equal(it == reference.end(), true, "FrozenAVL_Tree lost entries");
+
+    for(int i = 0; i < 200; ++i) {
+        K key = K(randint(lo, hi));
+        size_t expected = std::distance(reference.begin(), reference.lower_bound(key));
+        assert_equal(frozen.lower_bound(key), expected, "FrozenAVL_Tree lower_bound differs");
+        expected = std::distance(reference.begin(), reference.upper_bound(key));
+        assert_equal(frozen.upper_bound(key), expected, "FrozenAVL_Tree upper_bound differs");
+        assert_equal(frozen.find(key), reference.count(key) == 1);
+        if(reference.count(key))
+            assert_equal(frozen.get(key), reference.at(key));
+    }
+
+    K a = K(randint(lo, hi)), b = K(randint(lo, hi));
+    if(b < a)
+        std::swap(a, b);
+    it = reference.lower_bound(a);
+    assert_equal(frozen.count_range(a, b), (size_t)std::distance(it, reference.lower_bound(b)));
+    frozen.for_each_in_range(a, b, [&it](const K &key, const auto &){
+        assert_equal(key, it->first);
+        ++it;
+    });
+    assert_equal(it == reference.lower_bound(b), true);
+}
+
+void test_frozen_avl_tree()
+{
+    //sizes around block boundaries and deep enough for several layers
+    for(size_t n : {size_t(0), size_t(1), size_t(16), size_t(17), size_t(randint(1, 300)), size_t(randint(5000, 20000))}) {
+        AVL_Tree<int, int> tree;
+        std::map<int, int> m;
+        while(tree.size() < n) {
+            int key = randint(-50000, 50000);
+            tree[key] = key * 3;
+            m[key] = key * 3;
+        }
+
+        auto frozen = tree.freeze();
+        check_frozen_matches(frozen, m, -60000, 60000);
+        tree.clear();
+        assert_equal(frozen.size(), m.size(), "FrozenAVL_Tree shares state with the tree");
+    }
+
+    AVL_Tree<long long, std::string> strings;
+    std::map<long long, std::string> ms;
+    for(int i = 0; i < 1000; ++i) {
+        long long key = randint(0, 10000);
+        strings[key] = ms[key] = std::to_string(key);
+    }
+    check_frozen_matches(strings.freeze(), ms, -10, 10010);
+
+    bool thrown = false;
+    std::vector<std::pair<int, int>> unsorted = {{1, 1}, {3, 3}, {2, 2}};
+    try {
+        FrozenAVL_Tree<int, int>::from_sorted(unsorted.begin(), unsorted.end());
+    }
+    catch (std::runtime_error &) {
+        thrown = true;
+    }
+    assert_equal(thrown, true, "unsorted input accepted");
+}
+
+
+void test_compact_avl_tree()
+{
+    CompactAVL_Tree<int, std::string> tree;
+    std::map<int, std::string> reference;
+
+    for(int i = 0; i < 20000; ++i) {
+        int k = randint(0, 2000);
+        if(randint(0, 2) == 0 && reference.count(k)) {
+            tree.erase(k);
+            reference.erase(k);
+        }
+        else {
+            tree[k] += "a";
+            reference[k] += "a";
+        }
+    }
+
+    assert_equal(tree.size(), reference.size());
+    assert_equal(tree.height() <= 1.45 * std::log2(tree.size() + 2), true, "CompactAVL_Tree height is out of bounds");
+
+    auto it = reference.begin();
+    tree.for_each([&it](const int &k, std::string &v){
+        assert_equal(k, it->first);
+        assert_equal(v, it->second);
+        ++it;
+    });
+    assert_equal(it == reference.end(), true);
+
+    assert_equal(tree.find_min().first, reference.begin()->first);
+    assert_equal(tree.find_max().first, reference.rbegin()->first);
+    assert_equal(tree.find(-1), false);
+    assert_equal(tree.insert_or_assign(-1, "x").second, true);
+    assert_equal(tree.get(-1), std::string("x"));
+
+    // custom comparator orders the tree the same way as AVL_Tree's does
+    CompactAVL_Tree<int, int, std::greater<int>> desc;
+    for(int i = 0; i < 100; ++i)
+        desc.insert(i, i);
+    desc.erase(50);
+    int prev = 100;
+    desc.for_each([&prev](const int &k, int &v){
+        assert_equal(k < prev, true);
+        assert_equal(v, k);
+        prev = k;
+    });
+    assert_equal(desc.find_min().first, 99);
+    assert_equal(desc.find_max().first, 0);
+    assert_equal(desc.size(), size_t(99));
+}
+
 
 void test_priority_queue()
 {
@@ -233,4 +1220,722 @@ void test_priority_queue()
     assert_equal(i, 4);
 }
 
+template <typename Queue>
+void check_priority_queue_backend()
+{
+    std::vector<int> priorities;
+    for(int i = 0; i < 1000; ++i)
+        priorities.push_back(randint(0, 100000));
+
+    Queue queue;
+    for(int p : priorities)
+        queue.push(p, -p);
+    assert_equal(queue.size(), priorities.size());
+
+    Queue copy(queue);
+
+    std::sort(priorities.begin(), priorities.end(), std::greater<int>());
+    for(size_t i = 0; i < priorities.size() / 2; ++i) {
+        assert_equal(queue.top_priority(), priorities[i]);
+        assert_equal(queue.pop(), -priorities[i]);
+    }
+
+    Queue other;
+    for(size_t i = 0; i < priorities.size() / 2; ++i)
+        other.push(priorities[i], -priorities[i]);
+    queue.merge(other);
+    assert_equal(other.empty(), true);
+    assert_equal(queue.size(), priorities.size());
+
+    for(int p : priorities)
+        assert_equal(queue.pop(), -p);
+    assert_equal(queue.empty(), true);
+
+    for(int p : priorities)
+        assert_equal(copy.pop(), -p);
+    assert_equal(copy.empty(), true);
+
+    bool thrown = false;
+    try {
+        copy.pop();
+    }
+    catch (std::logic_error&) {
+        thrown = true;
+    }
+    assert_equal(thrown, true);
+}
+
+template <typename Queue>
+void check_priority_queue_batch()
+{
+    for(size_t initial : {0, 10, 500}) {
+        Queue batched, single;
+        std::vector<std::pair<int, int>> items;
+        for(size_t i = 0; i < initial; ++i) {
+            int p = randint(0, 50);
+            batched.push(p, int(i));
+            single.push(p, int(i));
+        }
+        for(size_t i = 0; i < 200; ++i)
+            items.emplace_back(randint(0, 50), int(initial + i));
+
+        batched.push_range(items.begin(), items.end());
+        for(auto &e : items)
+            single.push(e.first, e.second);
+        assert_equal(batched.size(), single.size());
+
+        std::vector<int> out(batched.size() + 5, -1);
+        size_t chunk = initial == 500 ? 600 : 7;
+        auto it = out.begin();
+        while(!batched.empty())
+            it = batched.pop_n(chunk, it);
+        assert_equal(it - out.begin(), std::ptrdiff_t(single.size()));
+
+        for(auto o = out.begin(); o != it; ++o)
+            assert_equal(*o, single.pop());
+        assert_equal(*it, -1);
+    }
+}
+
+void test_priority_queue_batch()
+{
+    check_priority_queue_batch<PriorityQueue<int, int>>();
+    check_priority_queue_batch<PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, DaryHeapBackend<4>>>();
+    check_priority_queue_batch<PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, PairingHeapBackend>>();
+
+    // pop_n on a large share of the tree keeps the rest intact
+    PriorityQueue<std::string, int> queue;
+    std::vector<std::pair<int, std::string>> items;
+    for(int i = 0; i < 100; ++i)
+        items.emplace_back(i, std::to_string(i));
+    queue.push_range(std::make_move_iterator(items.begin()), std::make_move_iterator(items.end()));
+
+    std::vector<std::string> top;
+    queue.pop_n(80, std::back_inserter(top));
+    assert_equal(top.front(), std::string("99"));
+    assert_equal(top.back(), std::string("20"));
+    assert_equal(queue.size(), size_t(20));
+    assert_equal(queue.pop(), std::string("19"));
+    queue.push(5, "x");
+    queue.pop_n(100, std::back_inserter(top));
+    assert_equal(top.size(), size_t(100));
+    assert_equal(queue.empty(), true);
+}
+
+void test_priority_queue_backends()
+{
+    using string_queue = PriorityQueue<std::string, int, std::less<int>, std::allocator<std::pair<const int, std::string>>, PairingHeapBackend>;
+
+    check_priority_queue_backend<PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, DaryHeapBackend<2>>>();
+    check_priority_queue_backend<PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, DaryHeapBackend<4>>>();
+    check_priority_queue_backend<PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, PairingHeapBackend>>();
+
+    // equal priorities pop in push order on every backend
+    string_queue heap;
+    PriorityQueue<std::string, int> tree;
+    PriorityQueue<std::string, int, std::less<int>, std::allocator<std::pair<const int, std::string>>, DaryHeapBackend<4>> dary;
+    for(int i = 0; i < 10; ++i) {
+        heap.push(i % 3, std::to_string(i));
+        tree.push(i % 3, std::to_string(i));
+        dary.push(i % 3, std::to_string(i));
+    }
+    assert_equal(heap.size(), size_t(10));
+    assert_equal(tree.size(), size_t(10));
+
+    std::string order;
+    tree.backend().for_each([&order](int, const std::string &v){order += v;});
+    assert_equal(order, std::string("2581470369"));
+
+    for(char c : order) {
+        assert_equal(heap.top(), std::string(1, c));
+        assert_equal(heap.pop(), std::string(1, c));
+        assert_equal(tree.pop(), std::string(1, c));
+        assert_equal(dary.pop(), std::string(1, c));
+    }
+
+    // ties across a merge keep the receiving queue's entries first
+    string_queue other;
+    for(int i = 0; i < 4; ++i) {
+        heap.push(0, "a" + std::to_string(i));
+        other.push(0, "b" + std::to_string(i));
+    }
+    heap.merge(other);
+    for(int i = 0; i < 4; ++i)
+        assert_equal(heap.pop(), "a" + std::to_string(i));
+    for(int i = 0; i < 4; ++i)
+        heap.push(1, std::to_string(i));
+
+    heap.top() += "!";
+    assert_equal(heap.top().back(), '!');
+    heap.clear();
+    assert_equal(heap.empty(), true);
+}
+
+void test_avl_tree_extract()
+{
+    AVL_Tree<int, std::string> tree;
+    std::map<int, std::string> ref;
+    for(int i = 0; i < 1000; ++i) {
+        int t = randint(0, 2000);
+        tree[t] = std::to_string(t);
+        ref[t] = std::to_string(t);
+    }
+
+    while(!ref.empty()) {
+        auto it = ref.begin();
+        std::advance(it, randint(0, int(ref.size()) - 1));
+        auto kv = tree.extract(it->first);
+        assert_equal(kv.first, it->first);
+        assert_equal(kv.second, it->second);
+        assert_equal(tree.find(it->first), false);
+        ref.erase(it);
+        assert_equal(tree.size(), ref.size());
+    }
+
+    bool thrown = false;
+    try {
+        tree.extract(1);
+    }
+    catch (std::logic_error &) {
+        thrown = true;
+    }
+    assert_equal(thrown, true);
+
+    tree[1] = "1";
+    thrown = false;
+    try {
+        tree.extract(2);
+    }
+    catch (std::out_of_range &) {
+        thrown = true;
+    }
+    assert_equal(thrown, true);
+    assert_equal(tree.get(1), std::string("1"));
+}
+
+template <typename Queue>
+void check_priority_queue_handles()
+{
+    // reference: (priority, -seq, id), the greatest pops first
+    Queue queue;
+    std::set<std::tuple<int, long, int>> ref;
+    std::map<int, std::tuple<int, long, int>> live;
+    std::vector<typename Queue::handle> handles;
+    long seq = 0;
+
+    for(int i = 0; i < 3000; ++i) {
+        int op = randint(0, 9);
+        if(op < 4 || live.empty()) {
+            int id = int(handles.size()), p = randint(0, 50);
+            handles.push_back(queue.push_tracked(p, id));
+            live[id] = std::make_tuple(p, -seq++, id);
+            ref.insert(live[id]);
+        }
+        else if(op < 9) {
+            auto it = live.begin();
+            std::advance(it, randint(0, int(live.size()) - 1));
+            int id = it->first;
+            assert_equal(queue.contains(handles[id]), true);
+            ref.erase(it->second);
+            if(op < 7) {
+                int p = randint(0, 50);
+                queue.update_priority(handles[id], p);
+                it->second = std::make_tuple(p, -seq++, id);
+                ref.insert(it->second);
+            }
+            else {
+                assert_equal(queue.erase(handles[id]), id);
+                assert_equal(queue.contains(handles[id]), false);
+                live.erase(it);
+            }
+        }
+        else {
+            int id = std::get<2>(*ref.rbegin());
+            assert_equal(queue.top_priority(), std::get<0>(*ref.rbegin()));
+            assert_equal(queue.pop(), id);
+            assert_equal(queue.contains(handles[id]), false);
+            ref.erase(std::prev(ref.end()));
+            live.erase(id);
+        }
+        assert_equal(queue.size(), ref.size());
+    }
+
+    // a copy keeps working handles of its own
+    Queue copy(queue);
+    if(!live.empty()) {
+        int id = live.begin()->first;
+        copy.update_priority(handles[id], 1000);
+        assert_equal(copy.top(), id);
+        assert_equal(queue.contains(handles[id]), true);
+    }
+
+    while(!ref.empty()) {
+        assert_equal(queue.pop(), std::get<2>(*ref.rbegin()));
+        ref.erase(std::prev(ref.end()));
+    }
+
+    // stale handles: popped, cleared or merged away; a freed slot that gets
+    // reused does not revive them
+    auto a = queue.push_tracked(1, 1);
+    queue.pop();
+    auto b = queue.push_tracked(2, 2);
+    assert_equal(queue.contains(a), false);
+    assert_equal(queue.contains(b), true);
+    bool thrown = false;
+    try {
+        queue.update_priority(a, 5);
+    }
+    catch (std::out_of_range &) {
+        thrown = true;
+    }
+    assert_equal(thrown, true);
+
+    queue.clear();
+    assert_equal(queue.contains(b), false);
+
+    Queue other;
+    auto c = other.push_tracked(3, 3);
+    b = queue.push_tracked(2, 2);
+    queue.merge(other);
+    assert_equal(other.contains(c), false);
+    assert_equal(queue.contains(b), true);
+    queue.update_priority(b, 4);
+    assert_equal(queue.pop(), 2);
+    assert_equal(queue.pop(), 3);
+
+    // entries from push and push_range have no handles but sift around
+    // handled ones
+    std::vector<std::pair<int, int>> items;
+    for(int i = 0; i < 100; ++i)
+        items.emplace_back(i, i);
+    auto d = queue.push_tracked(50, -1);
+    queue.push_range(items.begin(), items.end());
+    queue.push(150, -2);
+    queue.update_priority(d, 200);
+    assert_equal(queue.pop(), -1);
+    assert_equal(queue.pop(), -2);
+    assert_equal(queue.pop(), 99);
+    queue.update_priority(d = queue.push_tracked(10, -3), 120);
+    assert_equal(queue.erase(d), -3);
+    assert_equal(queue.pop(), 98);
+}
+
+// Priority whose copy throws once fail_after more copies have been made,
+// to fail an update half way.
+struct FailingCopy {
+    FailingCopy(int v) : v(v) {++live;}
+    FailingCopy(const FailingCopy &other) : v(other.v) {if(fail_after >= 0 && fail_after-- == 0) throw std::runtime_error("FailingCopy"); ++live;}
+    FailingCopy(FailingCopy &&other) : v(other.v) {++live;}
+    ~FailingCopy() {--live;}
+    FailingCopy& operator=(const FailingCopy &other) = default;
+    FailingCopy& operator=(FailingCopy &&other) = default;
+
+    bool operator<(const FailingCopy &other) const {return v < other.v;}
+
+    int v;
+    static int fail_after;
+    // constructed and not yet destroyed
+    static int live;
+};
+int FailingCopy::fail_after = -1;
+int FailingCopy::live = 0;
+
+void test_priority_queue_handles()
+{
+    // a throwing update leaves the entry and its handle as they were
+    PriorityQueue<int, FailingCopy> failing;
+    auto h = failing.push_tracked(1, 7);
+    failing.push(5, 8);
+    FailingCopy priority(10);
+    bool thrown = false;
+    FailingCopy::fail_after = 1;
+    try {
+        failing.update_priority(h, priority);
+    }
+    catch (std::runtime_error &) {
+        thrown = true;
+    }
+    FailingCopy::fail_after = -1;
+    assert_equal(thrown, true);
+    assert_equal(failing.contains(h), true);
+    assert_equal(failing.size(), size_t(2));
+    assert_equal(failing.top(), 8);
+    failing.update_priority(h, priority);
+    assert_equal(failing.top(), 7);
+    assert_equal(failing.erase(h), 7);
+
+    check_priority_queue_handles<PriorityQueue<int, int>>();
+    check_priority_queue_handles<PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, DaryHeapBackend<2>>>();
+    check_priority_queue_handles<PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, DaryHeapBackend<4>>>();
+    check_priority_queue_handles<PriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, PairingHeapBackend>>();
+}
+
+void test_concurrent_priority_queue()
+{
+    // a single shard pops in strict priority order
+    ConcurrentPriorityQueue<int, int> strict(1);
+    assert_equal(strict.strict(), true);
+    std::vector<int> priorities;
+    for(int i = 0; i < 1000; ++i) {
+        priorities.push_back(randint(0, 100));
+        strict.try_push(priorities.back(), i);
+    }
+    int prev = -1, val;
+    while(strict.try_pop(val)) {
+        if(prev != -1) {
+            assert_equal(priorities[prev] > priorities[val] ||
+                         (priorities[prev] == priorities[val] && prev < val), true, "strict order broken");
+        }
+        prev = val;
+    }
+    assert_equal(strict.size(), size_t(0));
+
+    // relaxed multi-producer/multi-consumer stress: every value comes out once
+    const int producers = 4, consumers = 4, per_producer = 20000;
+    ConcurrentPriorityQueue<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, PairingHeapBackend> queue(8);
+    std::vector<std::vector<int>> popped(consumers);
+
+    std::vector<std::thread> threads;
+    for(int c = 0; c < consumers; ++c) {
+        threads.emplace_back([&queue, &popped, c](){
+            int v;
+            while(queue.pop_wait(v))
+                popped[c].push_back(v);
+        });
+    }
+    std::vector<std::thread> pushers;
+    for(int p = 0; p < producers; ++p) {
+        pushers.emplace_back([&queue, p](){
+            for(int i = 0; i < per_producer; ++i)
+                queue.try_push((i * 7919) % 1000, p * per_producer + i);
+        });
+    }
+    for(auto &t : pushers)
+        t.join();
+    queue.close();
+    for(auto &t : threads)
+        t.join();
+
+    assert_equal(queue.try_push(0, 0), false);
+    assert_equal(queue.empty(), true);
+
+    std::vector<char> seen(producers * per_producer, 0);
+    size_t total = 0;
+    for(auto &list : popped) {
+        for(int v : list) {
+            assert_equal(seen[v], char(0), "value popped twice");
+            seen[v] = 1;
+        }
+        total += list.size();
+    }
+    assert_equal(total, seen.size());
+}
+
+
+void test_concurrent_avl_tree()
+{
+    ConcurrentAVL_Tree<int, std::string> tree;
+    std::map<int, std::string> reference;
+    for(int i = 0; i < 20000; ++i) {
+        int k = randint(0, 2000);
+        if(randint(0, 2) > 0) {
+            assert_equal(tree.insert_or_assign(k, std::to_string(i)), reference.count(k) == 0);
+            reference[k] = std::to_string(i);
+        }
+        else if(reference.count(k)) {
+            tree.erase(k);
+            reference.erase(k);
+        }
+        assert_equal(tree.size(), reference.size());
+    }
+    assert_equal(tree.height() <= 1.45 * std::log2(tree.size() + 2), true, "ConcurrentAVL_Tree unbalanced");
+
+    auto it = reference.begin();
+    tree.for_each([&it](const int &k, const std::string &v){
+        assert_equal(k, it->first);
+        assert_equal(v, it->second);
+        ++it;
+    });
+    assert_equal(it == reference.end(), true);
+
+    for(int k = 0; k <= 2000; ++k) {
+        assert_equal(tree.find(k), reference.count(k) == 1);
+        if(reference.count(k))
+            assert_equal(tree.get(k), reference[k]);
+    }
+
+    bool thrown = false;
+    try {
+        tree.insert(reference.begin()->first, "dup");
+    }
+    catch (std::runtime_error&) {
+        thrown = true;
+    }
+    assert_equal(thrown, true);
+    assert_equal(tree.get(reference.begin()->first), reference.begin()->second);
+
+    // lvalue arguments are copied, not moved from
+    ConcurrentAVL_Tree<std::string, std::string> strings;
+    std::string key = "key", val = "val";
+    strings.insert(key, val);
+    assert_equal(key, std::string("key"));
+    assert_equal(val, std::string("val"));
+    val = "other";
+    assert_equal(strings.insert_or_assign(key, val), false);
+    assert_equal(key, std::string("key"));
+    assert_equal(val, std::string("other"));
+    assert_equal(strings.get(key), std::string("other"));
+
+    // lock-free readers against a writer: even keys are never erased and
+    // always map to twice the key, odd keys come and go
+    ConcurrentAVL_Tree<int, long long> shared;
+    for(int k = 0; k < 4000; k += 2)
+        shared.insert(k, 2LL * k);
+
+    std::atomic<bool> done(false);
+    std::atomic<int> failures(0);
+    std::vector<std::thread> readers;
+    for(int r = 0; r < 3; ++r) {
+        readers.emplace_back([&shared, &done, &failures, r](){
+            std::mt19937 gen(r);
+            while(!done.load()) {
+                int k = static_cast<int>(gen() % 2000) * 2;
+                if(!shared.visit(k, [&failures, k](const long long &v){if(v != 2LL * k) ++failures;}))
+                    ++failures;
+
+                long long prev = -1;
+                size_t seen = 0;
+                shared.for_each([&](const int &key, const long long &v){
+                    if(key <= prev || v != 2LL * key)
+                        ++failures;
+                    prev = key;
+                    seen += key % 2 == 0;
+                });
+                if(seen != 2000)
+                    ++failures;
+            }
+        });
+    }
+
+    for(int i = 0; i < 20000; ++i) {
+        int k = randint(0, 1999) * 2 + 1;
+        if(!shared.find(k))
+            shared.insert(k, 2LL * k);
+        else
+            shared.erase(k);
+    }
+    done = true;
+    for(auto &t : readers)
+        t.join();
+    assert_equal(failures.load(), 0, "ConcurrentAVL_Tree reader saw an inconsistent tree");
+
+    shared.clear();
+    assert_equal(shared.size(), size_t(0));
+    assert_equal(shared.find(0), false);
+
+    // writers on different partitions run side by side; enough keys to
+    // split the tree several times, then erase half to drop partitions
+    ConcurrentAVL_Tree<int, long long> parallel;
+    done = false;
+    readers.clear();
+    readers.emplace_back([&parallel, &done, &failures](){
+        while(!done.load()) {
+            long long prev = -1;
+            parallel.for_each([&](const int &key, const long long &v){
+                if(key <= prev || v != 2LL * key)
+                    ++failures;
+                prev = key;
+            });
+        }
+    });
+
+    std::vector<std::thread> writers;
+    for(int w = 0; w < 4; ++w) {
+        writers.emplace_back([&parallel, w](){
+            for(int k = w; k < 20000; k += 4)
+                parallel.insert(k, 2LL * k);
+            for(int k = w; k < 10000; k += 4)
+                parallel.erase(k);
+        });
+    }
+    for(auto &t : writers)
+        t.join();
+    done = true;
+    readers[0].join();
+    assert_equal(failures.load(), 0, "ConcurrentAVL_Tree reader saw an inconsistent tree");
+    assert_equal(parallel.size(), size_t(10000));
+    assert_equal(parallel.height() <= 1.45 * std::log2(ConcurrentAVL_Tree<int, long long>::partition_size + 2), true, "ConcurrentAVL_Tree partition too large");
+    for(int k = 0; k < 20000; k += 997)
+        assert_equal(parallel.find(k), k >= 10000);
+    int expected = 10000;
+    parallel.for_each([&expected](const int &key, const long long &){assert_equal(key, expected++);});
+    assert_equal(expected, 20000);
+
+    // an update that throws half way destroys the nodes it already made
+    {
+        ConcurrentAVL_Tree<int, FailingCopy> failing;
+        for(int k = 0; k < 100; ++k)
+            failing.insert(k, FailingCopy(k));
+        FailingCopy val(-1);
+        bool thrown = false;
+        FailingCopy::fail_after = 3;
+        try {
+            failing.insert_or_assign(50, val);
+        }
+        catch (std::runtime_error&) {
+            thrown = true;
+        }
+        FailingCopy::fail_after = -1;
+        assert_equal(thrown, true);
+        assert_equal(failing.get(50).v, 50);
+        assert_equal(failing.size(), size_t(100));
+    }
+    assert_equal(FailingCopy::live, 0, "ConcurrentAVL_Tree leaked nodes of a failed update");
+}
+
+static size_t arena_live[3] = {0, 0, 0};
+
+// Stateful allocator that does not propagate: arenas with different ids
+// cannot free each other's memory.
+template <typename U>
+struct ArenaAllocator {
+    using value_type = U;
+
+    explicit ArenaAllocator(int id = 0) : id(id) {}
+    template <typename W>
+    ArenaAllocator(const ArenaAllocator<W> &other) : id(other.id) {}
+
+    U *allocate(size_t n) {arena_live[id] += n; return std::allocator<U>().allocate(n);}
+    void deallocate(U *p, size_t n) {arena_live[id] -= n; std::allocator<U>().deallocate(p, n);}
+
+    template <typename W>
+    bool operator==(const ArenaAllocator<W> &other) const {return id == other.id;}
+    template <typename W>
+    bool operator!=(const ArenaAllocator<W> &other) const {return id != other.id;}
+
+    int id;
+};
+
+void test_persistent_avl_tree()
+{
+    using Tree = PersistentAVL_Tree<int, std::string>;
+
+    Tree tree;
+    std::map<int, std::string> reference;
+    std::vector<std::pair<Tree, std::map<int, std::string>>> snapshots;
+
+    for(int i = 0; i < 5000; ++i) {
+        int k = randint(0, 1000);
+        if(randint(0, 2) > 0) {
+            assert_equal(tree.insert_or_assign(k, std::to_string(i)), reference.count(k) == 0);
+            reference[k] = std::to_string(i);
+        }
+        else if(reference.count(k)) {
+            tree.erase(k);
+            reference.erase(k);
+        }
+
+        if(i % 500 == 0)
+            snapshots.emplace_back(tree.snapshot(), reference);
+    }
+
+    // later updates never show through an older snapshot
+    snapshots.emplace_back(tree, reference);
+    for(auto &snap : snapshots) {
+        assert_equal(snap.first.size(), snap.second.size());
+        auto it = snap.second.begin();
+        snap.first.for_each([&it](const int &k, const std::string &v){
+            assert_equal(k, it->first);
+            assert_equal(v, it->second);
+            ++it;
+        });
+        assert_equal(it == snap.second.end(), true);
+    }
+    assert_equal(tree.height() <= 1.45 * std::log2(tree.size() + 2), true, "PersistentAVL_Tree unbalanced");
+
+    int root_key = reference.begin()->first;
+    Tree sub = tree.subtree(root_key);
+    assert_equal(sub.find(root_key), true);
+    assert_equal(sub.get(root_key), reference[root_key]);
+    tree.erase(root_key);
+    assert_equal(sub.find(root_key), true);
+    assert_equal(tree.find(root_key), false);
+
+    // lvalue arguments are copied, not moved from
+    PersistentAVL_Tree<std::string, std::string> strings;
+    std::string key = "key", val = "val";
+    strings.insert(key, val);
+    assert_equal(key, std::string("key"));
+    assert_equal(val, std::string("val"));
+    val = "other";
+    assert_equal(strings.insert_or_assign(key, val), false);
+    assert_equal(strings.insert_or_assign(std::string("new"), val), true);
+    assert_equal(key, std::string("key"));
+    assert_equal(val, std::string("other"));
+    assert_equal(strings.get(key), std::string("other"));
+    assert_equal(strings.get(std::string("new")), std::string("other"));
+
+    // an update after a snapshot copies one path, not the tree
+    using Counted = PersistentAVL_Tree<int, int, std::less<int>, CountingAllocator<std::pair<const int, int>>>;
+    std::vector<std::pair<int, int>> items;
+    for(int i = 0; i < 4096; ++i)
+        items.emplace_back(i, i);
+    Counted base = Counted::from_sorted(items.begin(), items.end());
+    Counted copy = base;
+    size_t before = counting_allocations;
+    copy.insert_or_assign(1000, -1);
+    copy.insert(5000, 5000);
+    assert_equal(counting_allocations - before <= size_t(2 * base.height() + 4), true, "PersistentAVL_Tree copied more than a path");
+    assert_equal(base.get(1000), 1000);
+    assert_equal(copy.get(1000), -1);
+    assert_equal(base.find(5000), false);
+
+    // once the tree owns its path again, updates stay in place
+    before = counting_allocations;
+    copy.insert_or_assign(1000, -2);
+    assert_equal(counting_allocations, before);
+
+    bool thrown = false;
+    try {
+        copy.erase(-1);
+    }
+    catch (std::out_of_range&) {
+        thrown = true;
+    }
+    assert_equal(thrown, true);
+
+    // assignment between unequal allocators copies the nodes into the
+    // target's allocator instead of sharing them
+    {
+        using Arena = PersistentAVL_Tree<int, int, std::less<int>, ArenaAllocator<std::pair<const int, int>>>;
+        using Alloc = ArenaAllocator<std::pair<const int, int>>;
+        Arena a(std::less<int>(), Alloc(1)), b(std::less<int>(), Alloc(2));
+        for(int i = 0; i < 100; ++i)
+            b.insert(i, i);
+        a.insert(-1, -1);
+
+        a = b;
+        assert_equal(a.get_allocator().id, 1);
+        assert_equal(arena_live[1], size_t(100));
+        assert_equal(arena_live[2], size_t(100));
+        b.clear();
+        assert_equal(arena_live[2], size_t(0));
+        assert_equal(a.size(), size_t(100));
+        assert_equal(a.get(99), 99);
+        assert_equal(a.height() <= 1.45 * std::log2(a.size() + 2), true, "PersistentAVL_Tree unbalanced");
+
+        b.insert(7, 70);
+        a = std::move(b);
+        assert_equal(a.get_allocator().id, 1);
+        assert_equal(arena_live[1], size_t(1));
+        assert_equal(arena_live[2], size_t(0));
+        assert_equal(a.get(7), 70);
+        assert_equal(b.size(), size_t(0));
+
+        Arena c(std::less<int>(), Alloc(1));
+        c = a;
+        assert_equal(arena_live[1], size_t(1), "PersistentAVL_Tree copied between equal allocators");
+    }
+    assert_equal(arena_live[1], size_t(0));
+}
 